@@ -0,0 +1,456 @@
+#ifndef MESH_ADAPTIVE_CONTOUR_H
+#define MESH_ADAPTIVE_CONTOUR_H
+
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+#include "mesh/implementation/util.h"
+#include "mesh/core/trimesh.h"
+#include "mesh/algorithms/contour.h"
+
+namespace Mesh {
+
+namespace impl {
+
+//Reads a density function at the points of the lattice with spacing h and
+//lower corner lo
+template<typename DensityFunc>
+struct FunctionSampler {
+	DensityFunc const& f;
+	Eigen::Vector3f lo;
+	Eigen::Array3f h;
+
+	FunctionSampler(DensityFunc const& f_, Eigen::Vector3f const& lo_, Eigen::Array3f const& h_) :
+		f(f_), lo(lo_), h(h_) {}
+
+	float operator()(int x, int y, int z) const {
+		return f((Eigen::Array3f(x,y,z) * h + lo.array()).matrix());
+	}
+};
+
+template<typename DensityFunc>
+FunctionSampler<DensityFunc> lattice_sampler(
+	DensityFunc const& f,
+	Eigen::Vector3f const& lo,
+	Eigen::Array3f const& h) {
+	return FunctionSampler<DensityFunc>(f, lo, h);
+}
+
+template<typename SampleFunc>
+SampleFunc lattice_sampler(
+	LatticeSamples<SampleFunc> const& f,
+	Eigen::Vector3f const& lo,
+	Eigen::Array3f const& h) {
+	return f.samples;
+}
+
+//Which side of the surface a sample is on, as far as the crossing test in
+//edge_crossing() is concerned
+inline int sample_class(float f) {
+	if(f < -FP_TOLERANCE)
+		return -1;
+	if(f > FP_TOLERANCE)
+		return 1;
+	return 0;
+}
+
+//Whether the lattice cells [m, m+s) can share one vertex without changing
+//the topology of the surface (Ju et al., "Dual Contouring of Hermite Data").
+//The cube's children are assumed to be safe already.
+template<typename SampleFunc>
+bool collapse_safe(SampleFunc& sample, Eigen::Vector3i const& m, int s) {
+	const int hs = s / 2;
+	int cls[3][3][3];
+	for(int i=0; i<3; ++i)
+	for(int j=0; j<3; ++j)
+	for(int k=0; k<3; ++k) {
+		cls[i][j][k] = sample_class(sample(m[0] + i*hs, m[1] + j*hs, m[2] + k*hs));
+	}
+
+	//The middle of each edge and face, and of the cube itself, is on the
+	//same side as one of the corners of that edge, face or cube.  Otherwise
+	//the surface has a piece which the coarse cell can't see.
+	for(int i=0; i<3; ++i)
+	for(int j=0; j<3; ++j)
+	for(int k=0; k<3; ++k) {
+		if(i != 1 && j != 1 && k != 1)
+			continue;
+		bool matched = false;
+		for(int a=(i==1?0:i); a<=(i==1?2:i) && !matched; a+=2)
+		for(int b=(j==1?0:j); b<=(j==1?2:j) && !matched; b+=2)
+		for(int c=(k==1?0:k); c<=(k==1?2:k) && !matched; c+=2) {
+			matched = cls[a][b][c] == cls[i][j][k];
+		}
+		if(!matched)
+			return false;
+	}
+
+	//The corners inside are connected along the edges of the cube, and so
+	//are the ones outside, so the surface crosses it in a single sheet
+	int inside = 0;
+	for(int c=0; c<8; ++c) {
+		if(cls[2*(c&1)][(c&2)][(c&4)/2] > 0)
+			inside |= 1<<c;
+	}
+	for(int side=0; side<2; ++side) {
+		const int set = side ? (~inside & 0xff) : inside;
+		if(set == 0)
+			continue;
+		int reached = set & -set;
+		for(int step=0; step<3; ++step) {
+			for(int c=0; c<8; ++c) {
+				if(reached & (1<<c)) {
+					reached |= set & ((1<<(c^1)) | (1<<(c^2)) | (1<<(c^4)));
+				}
+			}
+		}
+		if(reached != set)
+			return false;
+	}
+	return true;
+}
+
+//Cells of the octree over the lattice which have at least one vertex.
+//Nodes of one level are sorted by Morton code, so the leaves under a node
+//are a contiguous range of the (sorted) leaves.
+struct OctreeNode {
+	uint64_t code;
+	int begin, end;
+	QEF qef;
+
+	//Set if the node is, or was collapsed into, a single vertex
+	bool whole;
+};
+
+//Whether the faces around vertex id, once the vertices of the triangles
+//listed in around[begin, end) are renamed by owner (through position),
+//give every edge at id at most two faces.  Faces are counted the way
+//adaptive_contour() emits them: degenerate ones are dropped, and copies
+//on the same three vertices count once, or not at all if they cancel.
+inline bool merge_manifold(
+	std::vector<int> const& triangles,
+	std::vector<int> const& position,
+	std::vector<int> const& owner,
+	int id,
+	std::vector<int>& around,
+	std::vector<std::array<int, 3> >& faces,
+	std::vector<int>& ends) {
+
+	std::sort(around.begin(), around.end());
+	around.erase(std::unique(around.begin(), around.end()), around.end());
+
+	//The other two corners of each face in order, and which way round
+	//they go
+	faces.clear();
+	for(int i=0; i<around.size(); ++i) {
+		int v[3];
+		int at = -1;
+		for(int k=0; k<3; ++k) {
+			v[k] = owner[position[triangles[3*around[i] + k]]];
+			if(v[k] == id)
+				at = k;
+		}
+		const int a = v[(at+1)%3], b = v[(at+2)%3];
+		if(a == b || a == id || b == id)
+			continue;
+		const std::array<int, 3> face = {{ std::min(a, b), std::max(a, b), a < b ? 1 : -1 }};
+		faces.push_back(face);
+	}
+	std::sort(faces.begin(), faces.end());
+
+	ends.clear();
+	for(int i=0, j; i<faces.size(); i=j) {
+		int net = 0;
+		for(j=i; j<faces.size() && faces[j][0] == faces[i][0] && faces[j][1] == faces[i][1]; ++j) {
+			net += faces[j][2];
+		}
+		if(net != 0) {
+			ends.push_back(faces[i][0]);
+			ends.push_back(faces[i][1]);
+		}
+	}
+	std::sort(ends.begin(), ends.end());
+	for(int i=2; i<ends.size(); ++i) {
+		if(ends[i] == ends[i-2])
+			return false;
+	}
+	return true;
+}
+
+//Merges the vertices of a dual contour (one per cell, with its QEF) up an
+//octree for as long as the RMS distance to the tangent planes stays under
+//max_error and the topology doesn't change.  Crossings without a normal
+//don't say where the surface goes, so cells with them are left alone.  A
+//merge is also undone if it would leave an edge of the new vertex on more
+//than two of the faces in triangles (a vertex list into cells).  On return
+//vertex i of the original contour becomes vertex remap[i] of the
+//simplified one, which is placed at positions[remap[i]].
+template<typename SampleFunc>
+void simplify_octree(
+	SampleFunc& sample,
+	Eigen::Vector3f const& lo,
+	Eigen::Array3f const& h,
+	Eigen::Vector3i const& res,
+	std::vector<QEF> const& leaves,
+	std::vector<Eigen::Vector3i> const& cells,
+	std::vector<int> const& triangles,
+	double max_error,
+	std::vector<int>& remap,
+	std::vector<Eigen::Vector3f>& positions) {
+
+	const int n = leaves.size();
+	ZOrderHash<Eigen::Vector3i> morton;
+
+	//Leaves in Morton order
+	std::vector<std::pair<uint64_t, int> > order(n);
+	for(int i=0; i<n; ++i) {
+		order[i] = std::make_pair((uint64_t)morton(cells[i]), i);
+	}
+	std::sort(order.begin(), order.end());
+
+	//Triangles at each leaf, by its place in Morton order
+	std::vector<int> position(n);
+	for(int i=0; i<n; ++i) {
+		position[order[i].second] = i;
+	}
+	std::vector<int> first(n + 1, 0);
+	for(int i=0; i<triangles.size(); ++i) {
+		++first[position[triangles[i]] + 1];
+	}
+	for(int i=0; i<n; ++i) {
+		first[i+1] += first[i];
+	}
+	std::vector<int> incident(triangles.size());
+	{
+		std::vector<int> fill(first.begin(), first.end() - 1);
+		for(int i=0; i<triangles.size(); ++i) {
+			incident[fill[position[triangles[i]]]++] = i / 3;
+		}
+	}
+
+	//Vertex positions of whole nodes, and the one each leaf currently
+	//belongs to (indexed in Morton order)
+	std::vector<Eigen::Vector3f> candidates(n);
+	std::vector<int> owner(n);
+	std::vector<OctreeNode> nodes(n);
+	for(int i=0; i<n; ++i) {
+		const int leaf = order[i].second;
+		const Eigen::Vector3d cell_lo = (cells[leaf].cast<float>().array() * h + lo.array()).matrix().cast<double>();
+		const Eigen::Vector3d cell_hi = cell_lo + h.matrix().cast<double>();
+		candidates[i] = leaves[leaf].solve(cell_lo, cell_hi).cast<float>();
+		owner[i] = i;
+
+		OctreeNode& node = nodes[i];
+		node.code = order[i].first;
+		node.begin = i;
+		node.end = i + 1;
+		node.qef = leaves[leaf];
+		node.whole = true;
+	}
+
+	const double max_error2 = max_error * max_error;
+	const int max_size = std::max(res[0], std::max(res[1], res[2]));
+	std::vector<OctreeNode> parents;
+	std::vector<int> previous, around, ends;
+	std::vector<std::array<int, 3> > faces;
+	for(int level=1; (1<<level) <= max_size; ++level) {
+		const int size = 1<<level;
+		parents.clear();
+		bool any_whole = false;
+
+		for(int i=0; i<nodes.size(); ) {
+			OctreeNode parent;
+			parent.code = nodes[i].code >> 3;
+			parent.begin = nodes[i].begin;
+			parent.whole = true;
+
+			int j = i;
+			for(; j<nodes.size() && (nodes[j].code >> 3) == parent.code; ++j) {
+				parent.whole = parent.whole && nodes[j].whole;
+				if(parent.whole) {
+					parent.qef.add(nodes[j].qef);
+				}
+			}
+			parent.end = nodes[j-1].end;
+			i = j;
+
+			if(!parent.whole) {
+				parents.push_back(parent);
+				continue;
+			}
+
+			//The cube must fit in the lattice
+			Eigen::Vector3i m = cells[order[parent.begin].second];
+			for(int k=0; k<3; ++k) {
+				m[k] &= ~(size - 1);
+				if(m[k] + size > res[k]) {
+					parent.whole = false;
+				}
+			}
+
+			Eigen::Vector3f x;
+			if(parent.whole) {
+				const Eigen::Vector3d node_lo = (m.cast<float>().array() * h + lo.array()).matrix().cast<double>();
+				const Eigen::Vector3d node_hi = node_lo + (h * (float)size).matrix().cast<double>();
+				const Eigen::Vector3d xd = parent.qef.solve(node_lo, node_hi);
+				parent.whole =
+					parent.qef.unknown == 0 &&
+					parent.qef.error(xd) <= max_error2 * parent.qef.n &&
+					collapse_safe(sample, m, size);
+				x = xd.cast<float>();
+			}
+
+			if(parent.whole) {
+				const int id = candidates.size();
+				previous.assign(owner.begin() + parent.begin, owner.begin() + parent.end);
+				around.clear();
+				for(int k=parent.begin; k<parent.end; ++k) {
+					owner[k] = id;
+					around.insert(around.end(), incident.begin() + first[k], incident.begin() + first[k+1]);
+				}
+				if(merge_manifold(triangles, position, owner, id, around, faces, ends)) {
+					candidates.push_back(x);
+					any_whole = true;
+				}
+				else {
+					std::copy(previous.begin(), previous.end(), owner.begin() + parent.begin);
+					parent.whole = false;
+				}
+			}
+			parents.push_back(parent);
+		}
+
+		nodes.swap(parents);
+		if(!any_whole)
+			break;
+	}
+
+	//Number the surviving vertices in Morton order
+	std::vector<int> number(candidates.size(), -1);
+	remap.resize(n);
+	positions.clear();
+	for(int i=0; i<n; ++i) {
+		const int c = owner[i];
+		if(number[c] < 0) {
+			number[c] = positions.size();
+			positions.push_back(candidates[c]);
+		}
+		remap[order[i].second] = number[c];
+	}
+}
+
+};
+
+/**
+ * Adaptive dual contouring.  Contours like dual_contour(), then merges
+ * vertices up an octree over the lattice wherever the surface is flat
+ * enough: a cube of cells shares one vertex if the RMS distance from it to
+ * the tangent planes inside the cube is at most max_error, and doing so
+ * keeps the topology of the surface.  Faces between cells of different
+ * sizes come from the same edge crossings as before, so the mesh has no
+ * cracks.  Faces which merge onto the same three vertices are only emitted
+ * once, and cells aren't merged if that would put an edge of the merged
+ * vertex on more than two triangles, so merging never makes the mesh less
+ * manifold than dual_contour() would.
+ *
+ * f may be a density function or lattice_samples(), as for isocontour(),
+ * and gradient gives the normals.  All three of f, gradient and attr are
+ * called from several threads at once.
+ */
+template<
+	typename Mesh,
+	typename DensityFunc,
+	typename GradientFunc,
+	typename AttributeFunc,
+	typename Vector>
+void adaptive_contour(
+	Mesh& mesh,
+	DensityFunc const& f,
+	GradientFunc& gradient,
+	AttributeFunc& attr,
+	Vector lo,
+	Vector hi,
+	Eigen::Vector3i res,
+	float max_error) {
+
+	//Grid size
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	lo -= h.matrix();
+	for(int i=0; i<3; ++i)
+		res[i] += 2;
+
+	auto sample = impl::lattice_sampler(f, lo, h);
+	std::vector<impl::QEF> leaves;
+	std::vector<Eigen::Vector3i> cells;
+	std::vector<int> triangles;
+	impl::contour_lattice_points(
+		sample,
+		impl::QEFCellPlacement<GradientFunc>(gradient),
+		lo, h, res,
+		leaves, cells, triangles);
+
+	std::vector<int> remap;
+	std::vector<Eigen::Vector3f> positions;
+	impl::simplify_octree(sample, lo, h, res, leaves, cells, triangles, max_error, remap, positions);
+	std::vector<impl::QEF>().swap(leaves);
+
+	std::vector<typename Mesh::VertexData> vertices;
+	impl::evaluate_attributes(attr, positions, vertices);
+	const int base = mesh.vertices().size();
+	for(int i=0; i<vertices.size(); ++i) {
+		mesh.add_vertex(vertices[i]);
+	}
+
+	//Faces next to bigger cells lose a corner, and faces inside them
+	//disappear.  Where several merged cells meet, faces can also land on the
+	//same three vertices.  One copy is kept, facing the way most of them do,
+	//or none if as many face each way.  Each face is keyed by its sorted
+	//corners, the face's place in triangles, and the parity of the sort.
+	std::vector<std::array<int, 5> > faces;
+	faces.reserve(triangles.size() / 3);
+	for(int i=0; i<triangles.size(); i+=3) {
+		int v[3] = { remap[triangles[i]], remap[triangles[i+1]], remap[triangles[i+2]] };
+		if(v[0] == v[1] || v[1] == v[2] || v[2] == v[0])
+			continue;
+		int parity = 1;
+		for(int k=0; k<3; ++k) {
+			if(v[k%2] > v[k%2+1]) {
+				std::swap(v[k%2], v[k%2+1]);
+				parity = -parity;
+			}
+		}
+		const std::array<int, 5> face = {{ v[0], v[1], v[2], i, parity }};
+		faces.push_back(face);
+	}
+	std::sort(faces.begin(), faces.end());
+
+	std::vector<int> kept;
+	for(int i=0, j; i<faces.size(); i=j) {
+		int net = 0;
+		for(j=i; j<faces.size() && std::equal(&faces[j][0], &faces[j][3], &faces[i][0]); ++j) {
+			net += faces[j][4];
+		}
+		for(int k=i; k<j && net != 0; ++k) {
+			if(faces[k][4] == (net > 0 ? 1 : -1)) {
+				kept.push_back(faces[k][3]);
+				break;
+			}
+		}
+	}
+	std::sort(kept.begin(), kept.end());
+	for(int i=0; i<kept.size(); ++i) {
+		mesh.add_triangle(
+			base + remap[triangles[kept[i]]],
+			base + remap[triangles[kept[i]+1]],
+			base + remap[triangles[kept[i]+2]]);
+	}
+}
+
+};
+
+#endif
@@ -1,78 +1,301 @@
 #ifndef MESH_CONNECTED_COMPONENTS_H
 #define MESH_CONNECTED_COMPONENTS_H
 
+#include <atomic>
+#include <algorithm>
 #include <vector>
-#include <cstring>
 
 #include "mesh/implementation/util.h"
+#include "mesh/implementation/parallel.h"
+#include "mesh/core/triangle.h"
 #include "mesh/core/trimesh.h"
 
 namespace Mesh {
 
+namespace impl {
+
+	//Root of x's set in a union-find forest
+	inline int component_root(std::vector< std::atomic<int> >& parent, int x) {
+		while(true) {
+			int p = parent[x].load(std::memory_order_relaxed);
+			if(p == x) {
+				return x;
+			}
+			//Path halving.  Parents are never numbered higher than their
+			//children, so this can't make a loop, and losing the race just
+			//leaves the longer path.
+			const int gp = parent[p].load(std::memory_order_relaxed);
+			if(gp != p) {
+				parent[x].compare_exchange_weak(p, gp);
+			}
+			x = gp;
+		}
+	}
+
+	//Joins the sets of a and b, under whichever root is numbered lower, so
+	//each set ends up under its lowest numbered member whatever order the
+	//threads get here in
+	inline void component_union(std::vector< std::atomic<int> >& parent, int a, int b) {
+		while(true) {
+			a = component_root(parent, a);
+			b = component_root(parent, b);
+			if(a == b) {
+				return;
+			}
+			if(a < b) {
+				std::swap(a, b);
+			}
+			int expected = a;
+			if(parent[a].compare_exchange_strong(expected, b)) {
+				return;
+			}
+		}
+	}
+};
+
+/**
+ * Which connected component each vertex and triangle of a mesh is in.
+ * Components are numbered in order of their lowest numbered vertex.
+ */
+struct ComponentLabels {
+	///Number of components
+	int count;
+
+	///Component of each triangle
+	std::vector<int> triangle_component;
+
+	///Component of each vertex, or -1 for vertices on no triangle
+	std::vector<int> vertex_component;
+
+	///Number of triangles in each component
+	std::vector<int> triangle_count;
+};
+
+/**
+ * Labels the connected components of a mesh, with a union-find over its
+ * triangles which runs in parallel.  Triangles are connected if they share
+ * a vertex.  The mesh must be garbage collected.
+ */
+template<typename Mesh_t>
+void label_components(Mesh_t const& mesh, ComponentLabels& labels) {
+	auto const& tris = mesh.triangles();
+	const int nv = mesh.vertices().size();
+	const int nt = tris.size();
+
+	std::vector< std::atomic<int> > parent(nv);
+	impl::parallel_for(0, nv, [&](int v) {
+		parent[v].store(v, std::memory_order_relaxed);
+	}, 4096);
+	impl::parallel_for(0, nt, [&](int t) {
+		impl::component_union(parent, tris[t].v[0], tris[t].v[1]);
+		impl::component_union(parent, tris[t].v[0], tris[t].v[2]);
+	}, 4096);
+
+	std::vector<bool> used(nv, false);
+	for(int t=0; t<nt; ++t) {
+		for(int k=0; k<3; ++k) {
+			used[tris[t].v[k]] = true;
+		}
+	}
+
+	//The root of each set is its lowest numbered vertex, so it is labelled
+	//before the rest of the set
+	labels.count = 0;
+	labels.vertex_component.resize(nv);
+	for(int v=0; v<nv; ++v) {
+		const int root = impl::component_root(parent, v);
+		if(!used[v]) {
+			labels.vertex_component[v] = -1;
+		}
+		else if(root == v) {
+			labels.vertex_component[v] = labels.count++;
+		}
+		else {
+			labels.vertex_component[v] = labels.vertex_component[root];
+		}
+	}
+
+	labels.triangle_component.resize(nt);
+	labels.triangle_count.assign(labels.count, 0);
+	for(int t=0; t<nt; ++t) {
+		const int c = labels.vertex_component[tris[t].v[0]];
+		labels.triangle_component[t] = c;
+		++labels.triangle_count[c];
+	}
+}
+
+/**
+ * The triangles of one connected component, without copying the mesh.
+ * Only good while the mesh and the storage it was made from are unchanged.
+ */
+template<typename Mesh_t>
+struct ComponentView {
+	ComponentView(Mesh_t const& mesh_, const int* first_, const int* last_) :
+		mesh(&mesh_), first(first_), last(last_) {}
+
+	///Number of triangles
+	int					size() const				{ return last - first; }
+
+	///Name of the i-th triangle in the mesh
+	int					operator[](int i) const		{ return first[i]; }
+	const int*			begin() const				{ return first; }
+	const int*			end() const					{ return last; }
+
+	///The i-th triangle and the mesh's vertices, as in TriMesh
+	Triangle const&		triangle(int i) const		{ return mesh->triangle(first[i]); }
+	typename Mesh_t::VertexData const& vertex(int v) const { return mesh->vertex(v); }
+
+private:
+	Mesh_t const*	mesh;
+	const int		*first, *last;
+};
+
 /**
- * Splits a mesh into its connected components.
+ * Makes a view of each component, in labels' order.  storage holds the
+ * triangle names the views point into, grouped by component.
+ */
+template<typename Mesh_t>
+void component_views(
+	Mesh_t const& mesh,
+	ComponentLabels const& labels,
+	std::vector<int>& storage,
+	std::vector< ComponentView<Mesh_t> >& views) {
+
+	std::vector<int> fill(labels.count + 1, 0);
+	for(int c=0; c<labels.count; ++c) {
+		fill[c+1] = fill[c] + labels.triangle_count[c];
+	}
+	storage.resize(labels.triangle_component.size());
+	views.clear();
+	views.reserve(labels.count);
+	for(int c=0; c<labels.count; ++c) {
+		views.push_back(ComponentView<Mesh_t>(mesh, &storage[0] + fill[c], &storage[0] + fill[c+1]));
+	}
+	for(int t=0; t<labels.triangle_component.size(); ++t) {
+		storage[fill[labels.triangle_component[t]]++] = t;
+	}
+}
+
+/**
+ * Splits a mesh into its connected components, each a mesh of its own
+ * with the same allocator.  Vertices on no triangle are left out.
  */
 template<typename Mesh_t>
 std::vector<Mesh_t> connected_components(Mesh_t const& mesh) {
-	//Result array
+	ComponentLabels labels;
+	label_components(mesh, labels);
+
 	std::vector<Mesh_t> result;
-		
-	//Allocate visited arrays
-	int nv = mesh.vertices().size();
-	int nt = mesh.triangles().size();
-	int* visited_v = (int*)malloc(nv * sizeof(int));
-	int* visited_t = (int*)malloc(nt * sizeof(int));
-	impl::ScopedFree tguard(visited_v), vguard(visited_t);
-	memset(visited_v, -1, nv*sizeof(int));
-	memset(visited_t, -1, nt*sizeof(int));
-
-	//To-visit stack
-	std::vector<int> to_visit;
-	
-	for(int i=0; i<nv; ++i) {
-		if(visited_v[i] >= 0) {
-			continue;
+	result.reserve(labels.count);
+	for(int c=0; c<labels.count; ++c) {
+		result.push_back(Mesh_t(mesh.get_allocator()));
+	}
+
+	//Vertices and triangles keep their order within each component
+	std::vector<int> local(mesh.vertices().size(), -1);
+	for(int v=0; v<mesh.vertices().size(); ++v) {
+		const int c = labels.vertex_component[v];
+		if(c >= 0) {
+			local[v] = result[c].add_vertex(mesh.vertex(v));
 		}
-		
-		Mesh_t m;
-		to_visit.push_back(i);
-		visited_v[i] = m.add_vertex(mesh.vertex(i));
-		while(to_visit.size() > 0) {
-
-			//Pop vertex
-			int v = to_visit.back();
-			to_visit.pop_back();
-			
-			//Visit neighboring vertices
-			auto incidence = mesh.vertex_incidence(v);
-			for(int j=incidence.size()-1; j>=0; --j) {
-				int t = incidence[j];
-				if(visited_t[t] >= 0) {
-					continue;
-				}
-				
-				//Add neighbors
-				auto tri = mesh.triangle(t);
-				int n[3];
-				for(int k=0; k<3; ++k) {
-					n[k] = visited_v[tri.v[k]];
-					if(n[k] < 0) {
-						int u = tri.v[k];
-						to_visit.push_back(u);
-						n[k] = visited_v[u] = m.add_vertex(mesh.vertex(u));
-					}
+	}
+	for(int t=0; t<mesh.triangles().size(); ++t) {
+		Triangle const& tri = mesh.triangle(t);
+		result[labels.triangle_component[t]].add_triangle(
+			local[tri.v[0]],
+			local[tri.v[1]],
+			local[tri.v[2]]);
+	}
+	return result;
+}
+
+/**
+ * Finds whether the connected component holding triangle t has fewer than
+ * limit triangles, in which case component lists them all, or otherwise
+ * some of them.  Only looks at about limit triangles, so small islands near
+ * an edit can be found without labelling the whole mesh.
+ */
+template<typename Mesh_t>
+bool small_component(
+	Mesh_t const& mesh,
+	int t,
+	int limit,
+	std::vector<int>& component) {
+
+	component.assign(1, t);
+	for(int i=0; i<component.size() && component.size() < limit; ++i) {
+		Triangle const& tri = mesh.triangle(component[i]);
+		for(int k=0; k<3; ++k) {
+			auto around = mesh.vertex_incidence(tri.v[k]);
+			for(int j=0; j<around.size(); ++j) {
+				if(std::find(component.begin(), component.end(), around[j]) == component.end()) {
+					component.push_back(around[j]);
 				}
-				visited_t[t] = m.add_triangle(n[0], n[1], n[2], mesh.triangle_data(t));
 			}
 		}
-		
-		result.push_back(m);
 	}
-	
-	return result;
+	return component.size() < limit;
+}
+
+/**
+ * Removes the connected components with fewer than min_triangles
+ * triangles, such as specks a contour picks up around lone samples.  Their
+ * vertices go too, unless keep_vertices is set, in which case vertex names
+ * don't change and data kept alongside the mesh stays valid.  Everything
+ * else keeps its order, and if anything was removed the mesh is left
+ * compacted.  Returns the number of triangles removed.
+ */
+template<typename Mesh_t>
+int remove_small_components(
+	Mesh_t& mesh,
+	int min_triangles,
+	bool keep_vertices = false) {
+
+	mesh.garbage_collect();
+	ComponentLabels labels;
+	label_components(mesh, labels);
+
+	const int nv = mesh.vertices().size();
+	const int nt = mesh.triangles().size();
+	int removed = 0;
+	for(int c=0; c<labels.count; ++c) {
+		if(labels.triangle_count[c] < min_triangles) {
+			removed += labels.triangle_count[c];
+		}
+	}
+	if(removed == 0) {
+		return 0;
+	}
+
+	//Vertices on no triangle stay, as they belong to no component
+	std::vector<int> number(nv, -1);
+	typename Mesh_t::VertexList vertices(mesh.get_allocator());
+	vertices.reserve(nv);
+	for(int v=0; v<nv; ++v) {
+		const int c = labels.vertex_component[v];
+		if(keep_vertices || c < 0 || labels.triangle_count[c] >= min_triangles) {
+			number[v] = vertices.size();
+			vertices.push_back(mesh.vertex(v));
+		}
+	}
+
+	typename Mesh_t::TriangleList triangles(mesh.get_allocator());
+	triangles.reserve(nt - removed);
+	for(int t=0; t<nt; ++t) {
+		if(labels.triangle_count[labels.triangle_component[t]] < min_triangles) {
+			continue;
+		}
+		Triangle tri = mesh.triangle(t);
+		for(int k=0; k<3; ++k) {
+			tri.v[k] = number[tri.v[k]];
+		}
+		triangles.push_back(tri);
+	}
+
+	mesh.assign(std::move(vertices), std::move(triangles));
+	return removed;
 }
 
 };
 
 #endif
-
@@ -3,28 +3,588 @@
 
 #include <cassert>
 #include <cmath>
-#include <unordered_map>
 #include <algorithm>
 #include <utility>
+#include <vector>
 
 #include <Eigen/Core>
 #include <Eigen/Dense>
 
 #include "mesh/implementation/util.h"
+#include "mesh/implementation/parallel.h"
 #include "mesh/core/trimesh.h"
 
 namespace Mesh {
 
+namespace impl {
+
+//Edge crossing test shared by the contourers.  Returns the crossing on the
+//edge from p (density c_f) to p + h[e] along axis e (density e_f), with the
+//direction of the sign change in w, or w = 0 if there is none.
+inline Eigen::Vector4f edge_crossing(
+	float c_f,
+	float e_f,
+	Eigen::Vector3f const& p,
+	Eigen::Array3f const& h,
+	int e) {
+	
+	if(c_f < -FP_TOLERANCE) {
+		if(e_f < -FP_TOLERANCE) {
+			return Eigen::Vector4f::Zero();
+		}
+	}
+	else if(c_f > FP_TOLERANCE) {
+		if(e_f > FP_TOLERANCE) {
+			return Eigen::Vector4f::Zero();
+		}
+	}
+	else {
+		if(abs(e_f) < FP_TOLERANCE) {
+			return Eigen::Vector4f::Zero();
+		}
+	}
+	
+	//Find intercept
+	Eigen::Vector3f e_p(p);
+	e_p[e] += h[e];
+	const float t = c_f / (c_f - e_f);
+	const Eigen::Vector3f intercept = (1.-t)*p + t*e_p;
+	return Eigen::Vector4f(
+		intercept[0], intercept[1], intercept[2], (c_f < e_f) ? 1 : -1);
+}
+
+//Quadratic error function for dual contouring: the sum of squared distances
+//from a point to a set of planes.  Kept in double precision, since merged
+//ones cover many planes some way from the origin.
+struct QEF {
+	Eigen::Matrix3d AtA;
+	Eigen::Vector3d Atb, mass;
+	double btb;
+	
+	//Number of points, and how many of them had no normal
+	int n, unknown;
+	
+	QEF() :
+		AtA(Eigen::Matrix3d::Zero()),
+		Atb(Eigen::Vector3d::Zero()),
+		mass(Eigen::Vector3d::Zero()),
+		btb(0),
+		n(0),
+		unknown(0) {}
+	
+	//Adds the plane through p with the given (not necessarily unit) normal.
+	//Without a normal, p only counts towards the mass point.
+	void add(Eigen::Vector3f const& p, Eigen::Vector3f const& normal) {
+		const Eigen::Vector3d q = p.cast<double>();
+		mass += q;
+		++n;
+		const double len = normal.cast<double>().norm();
+		if(len < FP_TOLERANCE) {
+			++unknown;
+			return;
+		}
+		const Eigen::Vector3d u = normal.cast<double>() / len;
+		const double d = u.dot(q);
+		AtA += u * u.transpose();
+		Atb += u * d;
+		btb += d * d;
+	}
+	
+	void add(QEF const& other) {
+		AtA += other.AtA;
+		Atb += other.Atb;
+		mass += other.mass;
+		btb += other.btb;
+		n += other.n;
+		unknown += other.unknown;
+	}
+	
+	Eigen::Vector3d mass_point() const {
+		return mass / n;
+	}
+	
+	double error(Eigen::Vector3d const& x) const {
+		return x.dot(AtA * x) - 2. * x.dot(Atb) + btb;
+	}
+	
+	//Minimizer, solved relative to the mass point with a pseudo-inverse.
+	//Directions the planes don't pin down (small eigenvalues) stay at the
+	//mass point.
+	Eigen::Vector3d solve() const {
+		const Eigen::Vector3d m = mass_point();
+		const Eigen::Vector3d r = Atb - AtA * m;
+		Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(AtA);
+		const Eigen::Vector3d& values = solver.eigenvalues();
+		const Eigen::Matrix3d& vectors = solver.eigenvectors();
+		const double cutoff = 0.1 * values.cwiseAbs().maxCoeff();
+		Eigen::Vector3d x = m;
+		for(int k=0; k<3; ++k) {
+			if(values[k] > cutoff && values[k] > FP_TOLERANCE) {
+				x += vectors.col(k) * (vectors.col(k).dot(r) / values[k]);
+			}
+		}
+		return x;
+	}
+	
+	//Minimizer clamped to the box [lo, hi]
+	Eigen::Vector3d solve(Eigen::Vector3d const& lo, Eigen::Vector3d const& hi) const {
+		Eigen::Vector3d x = solve();
+		for(int k=0; k<3; ++k) {
+			x[k] = std::max(lo[k], std::min(hi[k], x[k]));
+		}
+		return x;
+	}
+};
+
+//Vertex placements for contour_layers().  Each is called with the n edge
+//crossings around a cell (w holding the direction of the sign change) and
+//the lower corner of the cell, and returns a Point for the cell's vertex.
+
+//The average of the crossings, which rounds off edges and corners
+struct MeanPlacement {
+	typedef Eigen::Vector3f Point;
+	
+	Eigen::Vector3f operator()(
+		const Eigen::Vector4f* crossings,
+		int n,
+		Eigen::Vector3f const& cell_lo) const {
+		Eigen::Vector4f center(0, 0, 0, 0);
+		for(int i=0; i<n; ++i) {
+			center += crossings[i];
+		}
+		center /= (float)n;
+		return Eigen::Vector3f(center[0], center[1], center[2]);
+	}
+};
+
+//The QEF of the tangent planes at the crossings, given by gradient(p)
+template<typename GradientFunc>
+struct QEFCellPlacement {
+	typedef QEF Point;
+	
+	GradientFunc& gradient;
+	
+	QEFCellPlacement(GradientFunc& gradient_) : gradient(gradient_) {}
+	
+	QEF operator()(
+		const Eigen::Vector4f* crossings,
+		int n,
+		Eigen::Vector3f const& cell_lo) const {
+		QEF qef;
+		for(int i=0; i<n; ++i) {
+			const Eigen::Vector3f p(crossings[i][0], crossings[i][1], crossings[i][2]);
+			qef.add(p, gradient(p));
+		}
+		return qef;
+	}
+};
+
+//Dual contouring.  Finds the point closest (in the least squares sense) to
+//the tangent planes at the crossings, which keeps creases and corners
+//sharp, and keeps it inside the cell.
+template<typename GradientFunc>
+struct QEFPlacement {
+	typedef Eigen::Vector3f Point;
+	
+	QEFCellPlacement<GradientFunc> planes;
+	Eigen::Array3f h;
+	
+	QEFPlacement(GradientFunc& gradient_, Eigen::Array3f const& h_) :
+		planes(gradient_), h(h_) {}
+	
+	Eigen::Vector3f operator()(
+		const Eigen::Vector4f* crossings,
+		int n,
+		Eigen::Vector3f const& cell_lo) const {
+		const Eigen::Vector3d lo = cell_lo.cast<double>();
+		const Eigen::Vector3d hi = (cell_lo.array() + h).matrix().cast<double>();
+		const QEF qef = planes(crossings, n, cell_lo);
+		return qef.solve(lo, hi).cast<float>();
+	}
+};
+
+//Output of contour_layers() for one range of layers
+template<typename Point>
+struct ContourChunk {
+	//Vertices of the chunk's own cells, in the order they were found
+	std::vector<Point> points;
+	std::vector<Eigen::Vector3i> cells;
+	
+	//Triangles, 3 vertices each.  Vertices in the layer below the chunk
+	//belong to the previous chunk, and are stored as -1 - (position in
+	//that layer).
+	std::vector<int> triangles;
+	
+	//Vertex of each cell in the top layer, or -1
+	std::vector<int> top_layer;
+};
+
+//Surface nets over the lattice of res+1 points per axis (res cells) with
+//spacing h and lower corner lo, for the layers of cells [z0, z1) only.
+//sample(x,y,z) is the density at lattice point (x,y,z), and place is one
+//of the placements above, which decides what is stored for each vertex.
+//
+//Sweeps along z one layer of cells at a time.  Only two planes of samples,
+//edge crossings and vertices are kept, and each layer's vertices and faces
+//are emitted as soon as its neighbors are known.  The layer below z0 is
+//swept too, since the faces on plane z0 need its vertices, but nothing is
+//emitted for it.
+template<typename SampleFunc, typename Placement>
+void contour_layers(
+	SampleFunc& sample,
+	Placement const& place,
+	Eigen::Vector3f const& lo,
+	Eigen::Array3f const& h,
+	Eigen::Vector3i const& res,
+	int z0,
+	int z1,
+	ContourChunk<typename Placement::Point>& chunk) {
+	
+	typedef std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > CrossingPlane;
+	
+	//Samples are (res[0]+1) x (res[1]+1) per plane, edges and cells are
+	//res[0] x res[1]
+	const int sx = res[0] + 1, sy = res[1] + 1;
+	const int cx = res[0], cy = res[1];
+	std::vector<float> samples[2];
+	CrossingPlane crossings[2];
+	std::vector<int> vertices[2];
+	for(int i=0; i<2; ++i) {
+		samples[i].resize(sx * sy);
+		crossings[i].resize(3 * cx * cy);
+		vertices[i].resize(cx * cy);
+	}
+	
+	auto read_samples = [&](int z) {
+		float* plane = &samples[z&1][0];
+		for(int y=0; y<sy; ++y)
+		for(int x=0; x<sx; ++x) {
+			*(plane++) = sample(x, y, z);
+		}
+	};
+	
+	//Edges along x and y in plane z
+	auto find_xy_crossings = [&](int z) {
+		const float* plane = &samples[z&1][0];
+		Eigen::Vector4f* out = &crossings[z&1][0];
+		for(int y=0; y<cy; ++y)
+		for(int x=0; x<cx; ++x, out+=3) {
+			const Eigen::Vector3f p = (Eigen::Array3f(x,y,z) * h + lo.array()).matrix();
+			const float c_f = plane[x + sx * y];
+			out[0] = edge_crossing(c_f, plane[x + 1 + sx * y], p, h, 0);
+			out[1] = edge_crossing(c_f, plane[x + sx * (y + 1)], p, h, 1);
+		}
+	};
+	
+	//Edges along z from plane z
+	auto find_z_crossings = [&](int z) {
+		const float* plane = &samples[z&1][0];
+		const float* next = &samples[(z+1)&1][0];
+		Eigen::Vector4f* out = &crossings[z&1][0];
+		for(int y=0; y<cy; ++y)
+		for(int x=0; x<cx; ++x, out+=3) {
+			const Eigen::Vector3f p = (Eigen::Array3f(x,y,z) * h + lo.array()).matrix();
+			out[2] = edge_crossing(plane[x + sx * y], next[x + sx * y], p, h, 2);
+		}
+	};
+	
+	//Each cell with a crossing on any of its 12 edges gets a vertex
+	auto add_vertices = [&](int z) {
+		int* out = &vertices[z&1][0];
+		Eigen::Vector4f found[12];
+		for(int y=0; y<cy; ++y)
+		for(int x=0; x<cx; ++x) {
+			const Eigen::Vector3i coord(x, y, z);
+			int n = 0;
+			
+			for(int e=0; e<3; ++e) {
+				const int u_dir = (e + 1)%3;
+				const int v_dir = (e + 2)%3;
+
+				for(int u=0; u<=1; ++u)
+				for(int v=0; v<=1; ++v) {
+					Eigen::Vector3i tmp(coord);
+					tmp[u_dir] += u;
+					tmp[v_dir] += v;
+					if(tmp[0] >= cx || tmp[1] >= cy || tmp[2] >= res[2])
+						continue;
+					
+					const Eigen::Vector4f& c = crossings[tmp[2]&1][3 * (tmp[0] + cx * tmp[1]) + e];
+					if(c[3] == 0)
+						continue;
+					
+					found[n++] = c;
+				}
+			}
+			
+			if(n == 0) {
+				out[x + cx * y] = -1;
+			}
+			else if(z < z0) {
+				out[x + cx * y] = -1 - (x + cx * y);
+			}
+			else {
+				const Eigen::Vector3f cell_lo = (coord.cast<float>().array() * h + lo.array()).matrix();
+				out[x + cx * y] = chunk.points.size();
+				chunk.points.push_back(place(found, n, cell_lo));
+				chunk.cells.push_back(coord);
+			}
+		}
+	};
+	
+	//A quad around each crossing, joining the vertices of the 4 cells which
+	//share the edge.  Edges in plane z use cells from layers z-1 and z.
+	auto add_faces = [&](int z) {
+		const Eigen::Vector4f* in = &crossings[z&1][0];
+		for(int y=0; y<cy; ++y)
+		for(int x=0; x<cx; ++x, in+=3) {
+			const Eigen::Vector3i coord(x, y, z);
+			for(int e=0; e<3; ++e) {
+				if(in[e][3] == 0)
+					continue;
+				
+				const int u_dir = (e+1) % 3;
+				const int v_dir = (e+2) % 3;
+				if(	coord[u_dir] <= 0 || coord[v_dir] <= 0 ||
+					coord[u_dir] >= res[u_dir]-1 || 
+					coord[v_dir] >= res[v_dir]-1 || 
+					coord[e] >= res[e] - 2)
+					continue;
+				
+				int vert[4], n=0;
+				for(int u=0; u<=1; ++u)
+				for(int v=0; v<=1; ++v) {
+					Eigen::Vector3i tmp(coord);
+					tmp[u_dir] -= u;
+					tmp[v_dir] -= v;
+					vert[n++] = vertices[tmp[2]&1][tmp[0] + cx * tmp[1]];
+				}
+				
+				if(in[e][3] < 0) {
+					const int tri[6] = { vert[0], vert[1], vert[2], vert[2], vert[1], vert[3] };
+					chunk.triangles.insert(chunk.triangles.end(), tri, tri+6);
+				}
+				else {
+					const int tri[6] = { vert[0], vert[2], vert[1], vert[1], vert[2], vert[3] };
+					chunk.triangles.insert(chunk.triangles.end(), tri, tri+6);
+				}
+			}
+		}
+	};
+	
+	const int zs = std::max(z0 - 1, 0);
+	read_samples(zs);
+	find_xy_crossings(zs);
+	for(int z=zs; z<z1; ++z) {
+		read_samples(z+1);
+		find_z_crossings(z);
+		if(z+1 < res[2]) {
+			find_xy_crossings(z+1);
+		}
+		add_vertices(z);
+		if(z >= z0) {
+			add_faces(z);
+		}
+	}
+	chunk.top_layer = vertices[(z1-1)&1];
+}
+
+//Contours the whole lattice, see contour_layers().  Ranges of layers are
+//contoured in parallel, then joined up in order, so the output is the same
+//for any number of threads.  Vertex i gets points[i] and lies in lattice
+//cell cells[i], and triangles holds 3 vertices per triangle.
+template<typename SampleFunc, typename Placement>
+void contour_lattice_points(
+	SampleFunc& sample,
+	Placement const& place,
+	Eigen::Vector3f const& lo,
+	Eigen::Array3f const& h,
+	Eigen::Vector3i const& res,
+	std::vector<typename Placement::Point>& points,
+	std::vector<Eigen::Vector3i>& cells,
+	std::vector<int>& triangles) {
+	
+	typedef ContourChunk<typename Placement::Point> Chunk;
+	static const int CHUNK_LAYERS = 16;
+	const int num_chunks = (res[2] + CHUNK_LAYERS - 1) / CHUNK_LAYERS;
+	std::vector<Chunk> chunks(num_chunks);
+	parallel_for(0, num_chunks, [&](int c) {
+		contour_layers(
+			sample, place, lo, h, res,
+			c * CHUNK_LAYERS,
+			std::min((c + 1) * CHUNK_LAYERS, res[2]),
+			chunks[c]);
+	});
+	
+	//Vertices first, so chunks can refer to the previous chunk's top layer
+	std::vector<int> offsets(num_chunks);
+	size_t num_vertices = 0, num_indices = 0;
+	for(int c=0; c<num_chunks; ++c) {
+		offsets[c] = num_vertices;
+		num_vertices += chunks[c].points.size();
+		num_indices += chunks[c].triangles.size();
+	}
+	points.clear();
+	cells.clear();
+	triangles.clear();
+	points.reserve(num_vertices);
+	cells.reserve(num_vertices);
+	triangles.reserve(num_indices);
+	
+	for(int c=0; c<num_chunks; ++c) {
+		Chunk& chunk = chunks[c];
+		points.insert(points.end(), chunk.points.begin(), chunk.points.end());
+		cells.insert(cells.end(), chunk.cells.begin(), chunk.cells.end());
+		std::vector<typename Placement::Point>().swap(chunk.points);
+	}
+	
+	for(int c=0; c<num_chunks; ++c) {
+		Chunk const& chunk = chunks[c];
+		for(int i=0; i<chunk.triangles.size(); ++i) {
+			const int t = chunk.triangles[i];
+			triangles.push_back(t >= 0 ? offsets[c] + t : offsets[c-1] + chunks[c-1].top_layer[-1 - t]);
+		}
+	}
+}
+
+//Styles the vertices at points, once the contour is finished.  attr is
+//called from several threads at once, and each call only sees its own
+//point, so the result doesn't depend on the number of threads.
+template<typename VertexData, typename AttributeFunc>
+void evaluate_attributes(
+	AttributeFunc& attr,
+	std::vector<Eigen::Vector3f> const& points,
+	std::vector<VertexData>& vertices) {
+	vertices.resize(points.size());
+	parallel_for(0, points.size(), [&](int i) {
+		vertices[i] = attr(points[i]);
+	}, 256);
+}
+
+//Contours the lattice into mesh.
+template<
+	typename Mesh,
+	typename SampleFunc,
+	typename Placement,
+	typename AttributeFunc>
+void isocontour_lattice(
+	Mesh& mesh,
+	SampleFunc& sample,
+	Placement const& place,
+	AttributeFunc& attr,
+	Eigen::Vector3f lo,
+	Eigen::Array3f h,
+	Eigen::Vector3i res,
+	std::vector<Eigen::Vector3i>* vertex_cells) {
+	
+	std::vector<Eigen::Vector3f> points;
+	std::vector<Eigen::Vector3i> cells;
+	std::vector<int> triangles;
+	contour_lattice_points(sample, place, lo, h, res, points, cells, triangles);
+	std::vector<typename Mesh::VertexData> vertices;
+	evaluate_attributes(attr, points, vertices);
+	std::vector<Eigen::Vector3f>().swap(points);
+	
+	const int base = mesh.vertices().size();
+	mesh.reserve(base + vertices.size(), mesh.triangles().size() + triangles.size() / 3);
+	for(int i=0; i<vertices.size(); ++i) {
+		const int vnum = mesh.add_vertex(vertices[i]);
+		if(vertex_cells) {
+			if(vnum >= vertex_cells->size()) {
+				vertex_cells->resize(vnum + 1);
+			}
+			(*vertex_cells)[vnum] = cells[i];
+		}
+	}
+	for(int i=0; i<triangles.size(); i+=3) {
+		mesh.add_triangle(base + triangles[i], base + triangles[i+1], base + triangles[i+2]);
+	}
+}
+
+//Contours the lattice a few ranges of layers at a time, one range per
+//thread, and hands each range's vertices and triangles to out before
+//starting on the next.  Each thread styles its own range's vertices.
+//Only the names of the previous range's top layer are kept, so memory use
+//depends on the size of a layer, not the lattice.  The output is the same
+//as isocontour_lattice()'s.
+template<
+	typename Writer,
+	typename SampleFunc,
+	typename Placement,
+	typename AttributeFunc>
+void stream_lattice(
+	Writer& out,
+	SampleFunc& sample,
+	Placement const& place,
+	AttributeFunc& attr,
+	Eigen::Vector3f const& lo,
+	Eigen::Array3f const& h,
+	Eigen::Vector3i const& res) {
+	
+	typedef ContourChunk<typename Placement::Point> Chunk;
+	static const int CHUNK_LAYERS = 8;
+	const int num_chunks = (res[2] + CHUNK_LAYERS - 1) / CHUNK_LAYERS;
+	const int batch = ThreadPool::instance().size();
+	std::vector<Chunk> chunks(batch);
+	std::vector< std::vector<typename Writer::VertexData> > vertices(batch);
+	std::vector<int> names, top_names;
+	
+	for(int c0=0; c0<num_chunks; c0+=batch) {
+		const int n = std::min(batch, num_chunks - c0);
+		parallel_for(0, n, [&](int i) {
+			const int c = c0 + i;
+			contour_layers(
+				sample, place, lo, h, res,
+				c * CHUNK_LAYERS,
+				std::min((c + 1) * CHUNK_LAYERS, res[2]),
+				chunks[i]);
+			evaluate_attributes(attr, chunks[i].points, vertices[i]);
+		});
+		
+		for(int i=0; i<n; ++i) {
+			Chunk& chunk = chunks[i];
+			names.resize(chunk.points.size());
+			for(int v=0; v<chunk.points.size(); ++v) {
+				names[v] = out.add_vertex(vertices[i][v]);
+			}
+			for(int t=0; t<chunk.triangles.size(); t+=3) {
+				int v[3];
+				for(int k=0; k<3; ++k) {
+					const int j = chunk.triangles[t+k];
+					v[k] = j >= 0 ? names[j] : top_names[-1 - j];
+				}
+				out.add_triangle(v[0], v[1], v[2]);
+			}
+			top_names.resize(chunk.top_layer.size());
+			for(int k=0; k<chunk.top_layer.size(); ++k) {
+				const int j = chunk.top_layer[k];
+				top_names[k] = j >= 0 ? names[j] : -1;
+			}
+			chunk = Chunk();
+			std::vector<typename Writer::VertexData>().swap(vertices[i]);
+		}
+	}
+}
+
+};
+
 /**
  * Computes a mesh estimate for the 0-level set of the given function.
  * Note:  Will evaluate the function f outside the region [lo,hi] in order
- * to acheive correct behaviour at the boundary.
+ * to acheive correct behaviour at the boundary.  f and attr are called
+ * from several threads at once, so they must be thread safe, and attr
+ * should only depend on its argument (no drand48()) for the mesh to come
+ * out the same every time.
  *
  * 
  *  Mesh is of type TriMesh<VertexData>
  *  DensityFunc is a lambda of type Eigen::Vector3f -> float
  *  AttributeFunc is a lambda of type Eigen::Vector3f -> VertexData
  *
+ * If vertex_cells is not NULL, it receives the lattice cell of each new
+ * vertex, indexed by vertex name.  Lattice cell (x,y,z) has its lower corner
+ * at lo + (x-1,y-1,z-1) * (hi - lo) / res.
+ *
  */
 template<
 	typename Mesh,
@@ -37,185 +597,188 @@ void isocontour(
 	AttributeFunc& attr,
 	Vector lo,
 	Vector hi,
-	Eigen::Vector3i res) {
+	Eigen::Vector3i res,
+	std::vector<Eigen::Vector3i>* vertex_cells = NULL) {
 	
-	//Edge intersections
-	typename impl::SpatialGrid<Eigen::Vector4f>::type edges[3];
+	//Grid size
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	lo -= h.matrix();
+	for(int i=0; i<3; ++i)
+		res[i] += 2;
 	
-	//Mesh vertices
-	typename impl::SpatialGrid<int>::type vertices;	
+	auto sample = [&](int x, int y, int z) -> float {
+		return f((Eigen::Array3f(x,y,z) * h + lo.array()).matrix());
+	};
+	impl::isocontour_lattice(mesh, sample, impl::MeanPlacement(), attr, lo, h, res, vertex_cells);
+}
+
+/**
+ * Densities already stored at the points of the lattice isocontour() works
+ * on, so contouring only has to read them back.  samples(x,y,z) is the
+ * density at lo + (x-1,y-1,z-1) * (hi - lo) / res, for x in [0, res[0]+2]
+ * and likewise for y and z.  Make one with lattice_samples().  Like the
+ * density function, samples are read from several threads at once.
+ */
+template<typename SampleFunc>
+struct LatticeSamples {
+	SampleFunc samples;
+	
+	LatticeSamples(SampleFunc const& samples_) : samples(samples_) {}
+};
+
+template<typename SampleFunc>
+LatticeSamples<SampleFunc> lattice_samples(SampleFunc const& samples) {
+	return LatticeSamples<SampleFunc>(samples);
+}
+
+/**
+ * Same as above, but reads stored lattice samples instead of evaluating a
+ * function at every lattice point.
+ */
+template<
+	typename Mesh,
+	typename SampleFunc,
+	typename AttributeFunc,
+	typename Vector>
+void isocontour(
+	Mesh& mesh,
+	LatticeSamples<SampleFunc> f,
+	AttributeFunc& attr,
+	Vector lo,
+	Vector hi,
+	Eigen::Vector3i res,
+	std::vector<Eigen::Vector3i>* vertex_cells = NULL) {
 	
 	//Grid size
-	auto h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
 	lo -= h.matrix();
 	for(int i=0; i<3; ++i)
 		res[i] += 2;
 	
+	impl::isocontour_lattice(mesh, f.samples, impl::MeanPlacement(), attr, lo, h, res, vertex_cells);
+}
+
+/**
+ * Same as isocontour(), but the vertices and triangles go to out as they
+ * are found instead of into a mesh, so that neither the volume nor the
+ * mesh has to fit in memory.  out needs
+ *
+ *	int add_vertex(VertexData const&), which returns the vertex's name
+ *	void add_triangle(int v0, int v1, int v2)
+ *
+ * like TriMesh, or BinaryMeshWriter (see serialize/binary.h) to write the
+ * mesh straight to a file, and has a VertexData typedef for what attr
+ * returns.  f may be a density function or
+ * lattice_samples(), for instance of a MappedGrid.  Memory use is a few
+ * layers of the lattice per thread.
+ */
+template<
+	typename Writer,
+	typename DensityFunc,
+	typename AttributeFunc,
+	typename Vector>
+void isocontour_stream(
+	Writer& out,
+	DensityFunc& f,
+	AttributeFunc& attr,
+	Vector lo,
+	Vector hi,
+	Eigen::Vector3i res) {
 	
-	//Find edge intersections
-	{
-		//Initialize edge bounds
-		const size_t sz = (res[0] + 1) * (res[1] + 1);
+	//Grid size
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	lo -= h.matrix();
+	for(int i=0; i<3; ++i)
+		res[i] += 2;
 	
-		float* above = new float[sz];
-		float* below = new float[sz];
-		impl::ScopedArray<float> aguard(above), bguard(below);
-		
-		int idx = 0;
-		for(int x=0; x<=res[0]; ++x)
-		for(int y=0; y<=res[1]; ++y) {
-			below[idx++] = f((Vector(x,y,0).array() * h + lo.array()).matrix());
-		}
-		
-		for(int z=0; z<res[2]; ++z) {
-			//Initialize array
-			idx = 0;
-			for(int x=0; x<res[0]; ++x) {
-				for(int y=0; y<res[1]; ++y) {
-					const Eigen::Vector3i coord(x, y, z);
-			
-					//Evaluate necessary function values
-					const Vector p = (Eigen::Array3f(x,y,z) * h + lo.array()).matrix();
-					float z_f = above[idx] = f(p + Eigen::Vector3f(0, 0, h[2]));
-					const float c_f = below[idx];
-					++idx;
-					const Vector e_f(below[idx+res[1]], below[idx], z_f);
-			
-					//Compute edge intersection
-					for(int e=0; e<3; ++e) {
-			
-						//Do edge intersection test
-						if(c_f < -FP_TOLERANCE) {
-							if(e_f[e] < -FP_TOLERANCE) {
-								continue;
-							}
-						}
-						else if(c_f > FP_TOLERANCE) {
-							if(e_f[e] > FP_TOLERANCE) {
-								continue;
-							}
-						}
-						else {
-							if(abs(e_f[e]) < FP_TOLERANCE) {
-								continue;
-							}
-						}
-				
-						//Find intercept
-						Eigen::Vector3f e_p(p);
-						e_p[e] += h[e];
-						const float t = c_f / (c_f - e_f[e]);
-						const Eigen::Vector3f intercept = (1.-t)*p + t*e_p;
-						edges[e][coord] = Eigen::Vector4f(
-							intercept[0], intercept[1], intercept[2], (c_f < e_f[e]) ? 1 : -1);
-		
-						//Mark neighboring vertices
-						for(int k=0; k<3; ++k) {
-							if(coord[k] == res[k]-1)
-								continue;
-						}
-						
-						const int u_dir = (e+1)%3;
-						const int v_dir = (e+2)%3;
-						for(int u=0; u<=1; ++u) {
-							if(coord[u_dir]-u < 0)
-								continue;
-							for(int v=0; v<=1; ++v) {
-								if(coord[v_dir]-v < 0)
-									continue;
-								Eigen::Vector3i tmp(coord);
-								tmp[u_dir] -= u;
-								tmp[v_dir] -= v;
-								vertices[tmp] = -1;
-							}
-						}
-					}
-				}
-				above[idx++] = f((Eigen::Array3f(x,res[1],z+1) * h + lo.array()).matrix());				
-			}
-			
-			if(z < res[2]) {
-				//Fill in the x-row
-				Eigen::Vector3f p = (Eigen::Array3f(res[0],0,z+1) * h + lo.array()).matrix();
-				for(int y=0; y<res[1]; ++y, p[1] += h[1]) {
-					above[idx++] = f(p);
-				}
-						
-				//Swap arrays
-				float* tmp = above;
-				above = below;
-				below = tmp;
-			}
-		}
-	}
-		
+	auto sample = [&](int x, int y, int z) -> float {
+		return f((Eigen::Array3f(x,y,z) * h + lo.array()).matrix());
+	};
+	impl::stream_lattice(out, sample, impl::MeanPlacement(), attr, lo, h, res);
+}
+
+template<
+	typename Writer,
+	typename SampleFunc,
+	typename AttributeFunc,
+	typename Vector>
+void isocontour_stream(
+	Writer& out,
+	LatticeSamples<SampleFunc> f,
+	AttributeFunc& attr,
+	Vector lo,
+	Vector hi,
+	Eigen::Vector3i res) {
 	
-	//Compute vertices
-	for(auto iter=vertices.begin(); iter!=vertices.end(); ++iter) {
-		int n = 0;
-		Eigen::Vector4f center(0, 0, 0, 0);
-		
-		//Read in all the planes
-		for(int e=0; e<3; ++e) {
-			const int u_dir = (e + 1)%3;
-			const int v_dir = (e + 2)%3;
+	//Grid size
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	lo -= h.matrix();
+	for(int i=0; i<3; ++i)
+		res[i] += 2;
+	
+	impl::stream_lattice(out, f.samples, impl::MeanPlacement(), attr, lo, h, res);
+}
 
-			for(int u=0; u<=1; ++u)
-			for(int v=0; v<=1; ++v) {
-			
-				Eigen::Vector3i tmp(iter->first);
-				tmp[u_dir] += u;
-				tmp[v_dir] += v;
-				
-				auto e_iter = edges[e].find(tmp);
-				if(e_iter == edges[e].end())
-					continue;
-					
-				center += e_iter->second;
-				++n;
-			}
-		}
-		
-		center /= (float)n;
-		iter->second = mesh.add_vertex(attr(Eigen::Vector3f(center[0], center[1], center[2])));
-	}
+/**
+ * Same as isocontour(), but places vertices with dual contouring, which
+ * keeps sharp edges and corners of the surface instead of rounding them
+ * off.  The normals come from gradient, a lambda of type Eigen::Vector3f ->
+ * Eigen::Vector3f (it doesn't need to be normalized), which is called from
+ * several threads at once.
+ */
+template<
+	typename Mesh,
+	typename DensityFunc,
+	typename GradientFunc,
+	typename AttributeFunc,
+	typename Vector>
+void dual_contour(
+	Mesh& mesh,
+	DensityFunc& f,
+	GradientFunc& gradient,
+	AttributeFunc& attr,
+	Vector lo,
+	Vector hi,
+	Eigen::Vector3i res,
+	std::vector<Eigen::Vector3i>* vertex_cells = NULL) {
 	
-	//Generate faces
-	for(int e=0; e<3; ++e) {
-		const int u_dir = (e+1) % 3;
-		const int v_dir = (e+2) % 3;
-		
-		for(auto iter=edges[e].begin(); iter!=edges[e].end(); ++iter) {
-			auto coord = iter->first;
-			int vert[4], n=0;
-			
-			if(	coord[u_dir] <= 0 || coord[v_dir] <= 0 ||
-				coord[u_dir] >= res[u_dir]-1 || 
-				coord[v_dir] >= res[v_dir]-1 || 
-				coord[e] >= res[e] - 2)
-				continue;
-			
-			for(int u=0; u<=1; ++u)
-			for(int v=0; v<=1; ++v) {
-				Eigen::Vector3i tmp(coord);
-				tmp[u_dir] -= u;
-				tmp[v_dir] -= v;				
-				vert[n++] = vertices[tmp];
-			}		
-		
-			if(iter->second[3] < 0) {
-				mesh.add_triangle(vert[0], vert[1], vert[2]);
-				mesh.add_triangle(vert[2], vert[1], vert[3]);
-			}
-			else {
-				mesh.add_triangle(vert[0], vert[2], vert[1]);
-				mesh.add_triangle(vert[1], vert[2], vert[3]);		
-			}
-		}
-	}
+	//Grid size
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	lo -= h.matrix();
+	for(int i=0; i<3; ++i)
+		res[i] += 2;
+	
+	auto sample = [&](int x, int y, int z) -> float {
+		return f((Eigen::Array3f(x,y,z) * h + lo.array()).matrix());
+	};
+	impl::isocontour_lattice(mesh, sample, impl::QEFPlacement<GradientFunc>(gradient, h), attr, lo, h, res, vertex_cells);
+}
+
+template<
+	typename Mesh,
+	typename SampleFunc,
+	typename GradientFunc,
+	typename AttributeFunc,
+	typename Vector>
+void dual_contour(
+	Mesh& mesh,
+	LatticeSamples<SampleFunc> f,
+	GradientFunc& gradient,
+	AttributeFunc& attr,
+	Vector lo,
+	Vector hi,
+	Eigen::Vector3i res,
+	std::vector<Eigen::Vector3i>* vertex_cells = NULL) {
+	
+	//Grid size
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	lo -= h.matrix();
+	for(int i=0; i<3; ++i)
+		res[i] += 2;
+	
+	impl::isocontour_lattice(mesh, f.samples, impl::QEFPlacement<GradientFunc>(gradient, h), attr, lo, h, res, vertex_cells);
 }
 
 };
 
 #endif
-
@@ -1,6 +1,7 @@
 #ifndef MESH_NORMALS_H
 #define MESH_NORMALS_H
 
+#include <cmath>
 #include <iostream>
 #include <algorithm>
 #include <vector>
@@ -9,36 +10,196 @@
 #include <Eigen/Core>
 
 #include "mesh/implementation/util.h"
+#include "mesh/implementation/parallel.h"
 #include "mesh/core/attributes.h"
 #include "mesh/core/trimesh.h"
 
 namespace Mesh {
 
+///How the triangles around a vertex are weighted in its normal
+enum NormalWeighting {
+	//By the sine of the angle of each triangle at the vertex, as crossing
+	//the two unit edges at each corner gives.  Cheap, and close to
+	//NORMALS_BY_ANGLE unless triangles are very obtuse.
+	NORMALS_BY_SINE,
+	
+	//By the angle of each triangle at the vertex, so the normal doesn't
+	//depend on how the surface around it is split into triangles.  The
+	//slowest, as it needs an arctangent per corner.
+	NORMALS_BY_ANGLE,
+	
+	//By the area of each triangle, which is cheapest, but lets big
+	//triangles outweigh small ones
+	NORMALS_BY_AREA,
+};
+
+namespace impl {
+
+	//Unit vector along n, or zero if n is
+	inline Eigen::Vector3f safe_normalized(Eigen::Vector3f const& n) {
+		const float len = n.norm();
+		return len > 0 ? Eigen::Vector3f(n / len) : Eigen::Vector3f(0, 0, 0);
+	}
+	
+	//atan2(y, x) for y >= 0, to within 1e-5, with a minimax polynomial for
+	//atan on [0, 1] (Abramowitz and Stegun 4.4.49)
+	inline float fast_atan2(float y, float x) {
+		const float ax = std::fabs(x),
+					lo = std::min(y, ax),
+					hi = std::max(y, ax);
+		const float z = hi > 0 ? lo / hi : 0.f;
+		const float z2 = z * z;
+		float r = z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f + z2 * (-0.0851330f + z2 * 0.0208351f))));
+		r = y > ax ? 1.57079633f - r : r;
+		return x < 0 ? 3.14159265f - r : r;
+	}
+	
+	//Normal of triangle t, and how much each corner of it counts towards
+	//the normal of that corner's vertex.  The normal is unit length for
+	//NORMALS_BY_ANGLE and scaled by the area otherwise.
+	template<typename Mesh_t>
+	Eigen::Vector3f face_normal(
+		Mesh_t const& mesh,
+		int t,
+		NormalWeighting weighting,
+		float corner[3]) {
+		using namespace Eigen;
+		
+		PositionAttribute< typename Mesh_t::VertexData > pos_attr;
+		
+		auto const& tri = mesh.triangle(t);
+		Vector3f p[3];
+		for(int k=0; k<3; ++k) {
+			p[k] = pos_attr.get(mesh.vertex(tri.v[k]));
+		}
+		const Vector3f n = (p[2] - p[0]).cross(p[1] - p[0]);
+		
+		if(weighting == NORMALS_BY_AREA) {
+			corner[0] = corner[1] = corner[2] = 1.f;
+			return n;
+		}
+		if(weighting == NORMALS_BY_SINE) {
+			//|n| is the sine at any corner times the lengths of the two
+			//edges there, so dividing those out leaves the sine
+			float inv[3];
+			for(int k=0; k<3; ++k) {
+				const float len2 = (p[(k+1)%3] - p[k]).squaredNorm();
+				inv[k] = len2 > 0 ? 1.f / std::sqrt(len2) : 0.f;
+			}
+			corner[0] = inv[0] * inv[2];
+			corner[1] = inv[0] * inv[1];
+			corner[2] = inv[1] * inv[2];
+			return n;
+		}
+		//The edges at every corner span the same parallelogram, so only
+		//their dot products differ
+		const float len = n.norm();
+		for(int k=0; k<3; ++k) {
+			const Vector3f a = p[(k+1)%3] - p[k],
+						   b = p[(k+2)%3] - p[k];
+			corner[k] = fast_atan2(len, a.dot(b));
+		}
+		return len > 0 ? Vector3f(n / len) : Vector3f(0, 0, 0);
+	}
+	
+	//Weighted average of the normals of the triangles around vertex i
+	template<typename Mesh_t>
+	Eigen::Vector3f vertex_normal(Mesh_t const& mesh, int i, NormalWeighting weighting) {
+		Eigen::Vector3f sum(0, 0, 0);
+		float corner[3];
+		auto incident_tris = mesh.vertex_incidence(i);
+		for(int j=0; j<incident_tris.size(); ++j) {
+			const int t = incident_tris[j];
+			const Eigen::Vector3f n = face_normal(mesh, t, weighting, corner);
+			sum += corner[mesh.triangle(t).index_of(i)] * n;
+		}
+		return safe_normalized(sum);
+	}
+};
+
+/**
+ * Sets the normal of every vertex to the weighted average of the normals of
+ * the triangles around it.  The mesh is garbage collected first.
+ *
+ * Runs in parallel: triangle normals are found once each, into a flat
+ * array, then each vertex gathers the ones around it.  Fastest on a
+ * compacted mesh.  Vertices without triangles get a zero normal.
+ */
 template<typename Mesh_t>
-void estimate_normals(Mesh_t& mesh) {
+void estimate_normals(Mesh_t& mesh, NormalWeighting weighting = NORMALS_BY_SINE) {
 	using namespace Eigen;
-
-	PositionAttribute< typename Mesh_t::VertexData > pos_attr;
 	NormalAttribute< typename Mesh_t::VertexData > normal_attr;
 
 	//Perform an initial garbage collection
 	mesh.garbage_collect();
 	
-	//Compute mesh normals
-	for(int i=mesh.vertices().size()-1; i>=0; --i) {
-		auto incident_tris = mesh.vertex_incidence(i);
-		Vector3f average_normal(0,0,0);
-		for(int j=incident_tris.size()-1; j>=0; --j) {
-			auto tri = mesh.triangle(incident_tris[j]);
-			Vector3f p[3];			
-			int v = tri.index_of(i);
-			for(int k=0; k<3; ++k) {
-				p[k] = pos_attr.get(mesh.vertex(tri.v[(v+k)%3]));
-			}
-			average_normal +=
-				(p[2] - p[0]).normalized().cross((p[1] - p[0]).normalized());
+	const int nt = mesh.triangles().size();
+	std::vector<Vector3f> face(nt);
+	std::vector<float> corner(3 * nt);
+	impl::parallel_for(0, nt, [&](int t) {
+		face[t] = impl::face_normal(mesh, t, weighting, &corner[3*t]);
+	}, 1024);
+	
+	Mesh_t const& cmesh = mesh;
+	impl::parallel_for(0, mesh.vertices().size(), [&](int i) {
+		Vector3f sum(0, 0, 0);
+		auto incident_tris = cmesh.vertex_incidence(i);
+		for(int j=0; j<incident_tris.size(); ++j) {
+			const int t = incident_tris[j];
+			sum += corner[3*t + cmesh.triangle(t).index_of(i)] * face[t];
 		}
-		normal_attr.set(mesh.vertex(i), average_normal.normalized());
+		normal_attr.set(mesh.vertex(i), impl::safe_normalized(sum));
+	}, 1024);
+}
+
+/**
+ * Recomputes the normals of the given vertices only, the same way as the
+ * version above.  This doesn't garbage collect, so vertex and triangle
+ * names stay valid.
+ */
+template<typename Mesh_t>
+void estimate_normals(
+	Mesh_t& mesh,
+	std::vector<int> const& verts,
+	NormalWeighting weighting = NORMALS_BY_SINE) {
+	NormalAttribute< typename Mesh_t::VertexData > normal_attr;
+	
+	for(int i=verts.size()-1; i>=0; --i) {
+		normal_attr.set(mesh.vertex(verts[i]), impl::vertex_normal(mesh, verts[i], weighting));
+	}
+}
+
+/**
+ * Sets the normal of every vertex straight from the gradient of the density
+ * function the mesh was contoured from, instead of from the triangles.
+ * Normals point out of the solid, down the gradient.  gradient is called
+ * from several threads at once.
+ */
+template<typename Mesh_t, typename GradientFunc>
+void gradient_normals(Mesh_t& mesh, GradientFunc const& gradient) {
+	PositionAttribute< typename Mesh_t::VertexData > pos_attr;
+	NormalAttribute< typename Mesh_t::VertexData > normal_attr;
+	
+	impl::parallel_for(0, mesh.vertices().size(), [&](int i) {
+		auto& v = mesh.vertex(i);
+		normal_attr.set(v, impl::safe_normalized(-gradient(pos_attr.get(v))));
+	}, 256);
+}
+
+/**
+ * As above, for the given vertices only.
+ */
+template<typename Mesh_t, typename GradientFunc>
+void gradient_normals(
+	Mesh_t& mesh,
+	GradientFunc const& gradient,
+	std::vector<int> const& verts) {
+	PositionAttribute< typename Mesh_t::VertexData > pos_attr;
+	NormalAttribute< typename Mesh_t::VertexData > normal_attr;
+	
+	for(int i=verts.size()-1; i>=0; --i) {
+		auto& v = mesh.vertex(verts[i]);
+		normal_attr.set(v, impl::safe_normalized(-gradient(pos_attr.get(v))));
 	}
 }
 
@@ -0,0 +1,302 @@
+#ifndef MESH_REORDER_H
+#define MESH_REORDER_H
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "mesh/implementation/util.h"
+#include "mesh/core/attributes.h"
+#include "mesh/core/triangle.h"
+#include "mesh/core/trimesh.h"
+
+namespace Mesh {
+
+namespace impl {
+
+	//Size of the LRU vertex cache forsyth_order() optimizes for
+	static const int FORSYTH_CACHE_SIZE = 32;
+
+	//How much emitting a triangle with this vertex next is worth, given
+	//where the vertex is in the cache (-1 if it isn't) and how many of its
+	//triangles haven't been emitted yet
+	inline float forsyth_score(int cache_pos, int remaining) {
+		if(remaining == 0) {
+			return -1.f;
+		}
+		float score = 0.f;
+		if(cache_pos >= 0) {
+			if(cache_pos < 3) {
+				//Used by the last triangle, so no benefit in going on with it
+				score = 0.75f;
+			}
+			else {
+				score = std::pow(1.f - (cache_pos - 3) * (1.f / (FORSYTH_CACHE_SIZE - 3)), 1.5f);
+			}
+		}
+		//Finish off vertices with few triangles left, so they can leave
+		return score + 2.f / std::sqrt((float)remaining);
+	}
+
+	/**
+	 * Orders triangles for a post-transform vertex cache, after Forsyth's
+	 * "Linear-Speed Vertex Cache Optimisation".  Greedily emits the best
+	 * scoring triangle around the vertices in a simulated LRU cache.  When
+	 * none are left it starts again from the first triangle not emitted, so
+	 * the input order decides where new strips of the surface begin.
+	 */
+	inline void forsyth_order(
+		std::vector<Triangle> const& tris,
+		int nv,
+		std::vector<int>& order) {
+
+		const int nt = tris.size();
+
+		//Triangles around each vertex.  The first remaining[v] of them
+		//haven't been emitted yet.
+		std::vector<int> offsets(nv + 1, 0), around(3 * nt);
+		for(int t=0; t<nt; ++t) {
+			for(int k=0; k<3; ++k) {
+				++offsets[tris[t].v[k] + 1];
+			}
+		}
+		std::vector<int> remaining(nv);
+		for(int v=0; v<nv; ++v) {
+			remaining[v] = offsets[v+1];
+			offsets[v+1] += offsets[v];
+		}
+		std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+		for(int t=0; t<nt; ++t) {
+			for(int k=0; k<3; ++k) {
+				around[fill[tris[t].v[k]]++] = t;
+			}
+		}
+
+		std::vector<int> cache_pos(nv, -1);
+		std::vector<float> score(nv);
+		for(int v=0; v<nv; ++v) {
+			score[v] = forsyth_score(-1, remaining[v]);
+		}
+		std::vector<bool> emitted(nt, false);
+
+		int cache[FORSYTH_CACHE_SIZE + 3];
+		int cache_size = 0;
+
+		order.clear();
+		order.reserve(nt);
+		int best = -1, cursor = 0;
+		while(order.size() < nt) {
+			if(best < 0) {
+				while(emitted[cursor]) {
+					++cursor;
+				}
+				best = cursor;
+			}
+			emitted[best] = true;
+			order.push_back(best);
+			Triangle const& tri = tris[best];
+
+			//Retire the triangle from its vertices
+			for(int k=0; k<3; ++k) {
+				const int v = tri.v[k];
+				int* list = &around[offsets[v]];
+				const int last = --remaining[v];
+				for(int i=0; i<=last; ++i) {
+					if(list[i] == best) {
+						std::swap(list[i], list[last]);
+						break;
+					}
+				}
+			}
+
+			//Its vertices move to the front of the cache
+			int next[FORSYTH_CACHE_SIZE + 3];
+			int n = 0;
+			for(int k=0; k<3; ++k) {
+				if(std::find(next, next + n, tri.v[k]) == next + n) {
+					next[n++] = tri.v[k];
+				}
+			}
+			for(int i=0; i<cache_size; ++i) {
+				if(tri.index_of(cache[i]) < 0) {
+					next[n++] = cache[i];
+				}
+			}
+			for(int i=0; i<n; ++i) {
+				const int v = next[i];
+				cache_pos[v] = i < FORSYTH_CACHE_SIZE ? i : -1;
+				score[v] = forsyth_score(cache_pos[v], remaining[v]);
+			}
+			cache_size = std::min(n, FORSYTH_CACHE_SIZE);
+			for(int i=0; i<cache_size; ++i) {
+				cache[i] = next[i];
+			}
+
+			//The next triangle is the best one using the cache
+			best = -1;
+			float best_score = -1.f;
+			for(int i=0; i<cache_size; ++i) {
+				const int v = cache[i];
+				for(int j=offsets[v]; j<offsets[v] + remaining[v]; ++j) {
+					Triangle const& other = tris[around[j]];
+					const float s =
+						score[other.v[0]] +
+						score[other.v[1]] +
+						score[other.v[2]];
+					if(s > best_score) {
+						best_score = s;
+						best = around[j];
+					}
+				}
+			}
+		}
+	}
+
+	//Numbers points along a Morton curve through their bounding box, so
+	//points close in space get close numbers
+	template<typename Vector>
+	void morton_order(std::vector<Vector> const& points, std::vector<int>& order) {
+		const int n = points.size();
+		Eigen::Array3f lo(0, 0, 0), hi(0, 0, 0);
+		if(n > 0) {
+			lo = hi = points[0].array();
+		}
+		for(int i=1; i<n; ++i) {
+			lo = lo.min(points[i].array());
+			hi = hi.max(points[i].array());
+		}
+		const Eigen::Array3f scale = (hi - lo).max(Eigen::Array3f::Constant(1e-20f)).inverse() * (float)((1<<20) - 1);
+
+		ZOrderHash<Eigen::Vector3i> morton;
+		std::vector<std::pair<uint64_t, int> > keys(n);
+		for(int i=0; i<n; ++i) {
+			const Eigen::Array3f q = (points[i].array() - lo) * scale;
+			keys[i] = std::make_pair((uint64_t)morton(Eigen::Vector3i(q[0], q[1], q[2])), i);
+		}
+		std::sort(keys.begin(), keys.end());
+
+		order.resize(n);
+		for(int i=0; i<n; ++i) {
+			order[i] = keys[i].second;
+		}
+	}
+};
+
+/**
+ * Reorders a mesh so it is quicker to draw and to walk over.  Vertices are
+ * numbered along a Morton curve, so neighbors on the surface tend to be
+ * neighbors in memory.  Triangles are put in Morton order of their centers
+ * and then reordered for a vertex cache by forsyth_order(), so the GPU
+ * transforms fewer vertices more than once, and whichever part of the
+ * surface is being drawn or walked stays in the CPU caches.
+ *
+ * The mesh is garbage collected first.  If vertex_order is given, it
+ * receives the old name of each vertex in the new order, so data kept
+ * alongside the mesh can be reordered to match.
+ */
+template<typename Mesh_t>
+void optimize_mesh_order(Mesh_t& mesh, std::vector<int>* vertex_order = NULL) {
+	PositionAttribute< typename Mesh_t::VertexData > pos_attr;
+
+	mesh.garbage_collect();
+	const int nv = mesh.vertices().size();
+	const int nt = mesh.triangles().size();
+
+	std::vector<Eigen::Vector3f> points(nv);
+	for(int v=0; v<nv; ++v) {
+		points[v] = pos_attr.get(mesh.vertex(v));
+	}
+	std::vector<int> vorder;
+	impl::morton_order(points, vorder);
+
+	//Triangles by where they are, then for the cache
+	std::vector<Eigen::Vector3f> centers(nt);
+	for(int t=0; t<nt; ++t) {
+		Triangle const& tri = mesh.triangle(t);
+		centers[t] = (points[tri.v[0]] + points[tri.v[1]] + points[tri.v[2]]) / 3.f;
+	}
+	std::vector<int> spatial, torder;
+	impl::morton_order(centers, spatial);
+	std::vector<Triangle> tris(nt);
+	for(int i=0; i<nt; ++i) {
+		tris[i] = mesh.triangle(spatial[i]);
+	}
+	impl::forsyth_order(tris, nv, torder);
+	for(int i=0; i<nt; ++i) {
+		torder[i] = spatial[torder[i]];
+	}
+
+	mesh.reorder(vorder, torder);
+	if(vertex_order) {
+		vertex_order->swap(vorder);
+	}
+}
+
+/**
+ * How well the order of a mesh suits the caches which read it.
+ */
+struct CacheStatistics {
+	///Average cache miss ratio: vertices transformed per triangle, with a
+	///FIFO post-transform cache
+	float	acmr;
+
+	///Cache lines read by a CPU walking the triangles in order and reading
+	///each triangle and its vertices
+	int		cpu_misses;
+};
+
+/**
+ * Measures the cache behaviour of a mesh by simulating the caches.  The
+ * post-transform cache holds cache_size vertices, and the CPU cache is a
+ * 32KB, 8 way set associative cache with 64 byte lines.
+ */
+template<typename Mesh_t>
+CacheStatistics cache_statistics(Mesh_t const& mesh, int cache_size = 16) {
+	static const int LINE = 64, WAYS = 8, SETS = (32 << 10) / (LINE * WAYS);
+
+	auto const& tris = mesh.triangles();
+	const int nv = mesh.vertices().size();
+
+	//Time each vertex entered the post-transform cache, or -1
+	std::vector<int> entered(nv, -1);
+	int transforms = 0;
+
+	//Lines in each set of the CPU cache, most recently used first.  Vertices
+	//are laid out after the triangles, as if in one block.
+	std::vector<size_t> lines(SETS * WAYS, (size_t)-1);
+	const size_t vertex_base = tris.size() * sizeof(Triangle);
+	int misses = 0;
+	auto read = [&](size_t address) {
+		const size_t line = address / LINE;
+		size_t* set = &lines[(line % SETS) * WAYS];
+		size_t* hit = std::find(set, set + WAYS, line);
+		if(hit == set + WAYS) {
+			++misses;
+			hit = set + WAYS - 1;
+		}
+		std::copy_backward(set, hit, hit + 1);
+		set[0] = line;
+	};
+
+	for(int t=0; t<tris.size(); ++t) {
+		read(t * sizeof(Triangle));
+		for(int k=0; k<3; ++k) {
+			const int v = tris[t].v[k];
+			read(vertex_base + v * sizeof(typename Mesh_t::VertexData));
+			if(entered[v] < 0 || transforms - entered[v] >= cache_size) {
+				entered[v] = transforms++;
+			}
+		}
+	}
+
+	CacheStatistics stats;
+	stats.acmr = tris.size() > 0 ? (float)transforms / tris.size() : 0.f;
+	stats.cpu_misses = misses;
+	return stats;
+}
+
+};
+
+#endif
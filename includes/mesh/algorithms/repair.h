@@ -1,82 +1,175 @@
 #ifndef MESH_REPAIR_H
 #define MESH_REPAIR_H
 
-#include <iostream>
+#include <cmath>
 #include <algorithm>
+#include <utility>
 #include <vector>
-#include <unordered_map>
 
 #include <Eigen/Core>
 
 #include "mesh/implementation/util.h"
+#include "mesh/implementation/parallel.h"
 #include "mesh/core/attributes.h"
 #include "mesh/core/trimesh.h"
 
 namespace Mesh {
 
+namespace impl {
+
+	//Bits of each coordinate that go into the Morton codes of weld cells
+	static const int WELD_CELL_BITS = 21;
+
+	//Smallest size of weld cells, relative to the tolerance
+	static const float WELD_CELL_SIZE = 32.f;
+
+	//Vertices sorted by the Morton code of the weld cell they are in
+	typedef std::vector<std::pair<uint64_t, int> > WeldKeys;
+
+	//Compares entries of WeldKeys by code alone
+	struct WeldKeyLess {
+		bool operator()(std::pair<uint64_t, int> const& a, uint64_t b) const {
+			return a.first < b;
+		}
+		bool operator()(uint64_t a, std::pair<uint64_t, int> const& b) const {
+			return a < b.first;
+		}
+	};
+};
+
+/**
+ * Welds together vertices within tolerance of each other.  Each vertex
+ * joins the lowest numbered vertex within tolerance of it, or whichever one
+ * that joins, and the survivors keep their data.  Triangles which lose a
+ * corner are removed.  The remaining vertices and triangles keep their
+ * order, and if anything was welded the mesh is left compacted.
+ *
+ * Vertices are radix sorted by the Morton code of a grid cell some way
+ * bigger than tolerance.  Anything close enough to weld to a vertex is then in
+ * its own run of the sorted list, or in the run of a neighboring cell when
+ * the vertex is near a face of its cell.  Finding the runs, sorting and
+ * searching all run in parallel, and the triangles are remapped in one pass.
+ */
 template<typename Mesh_t>
 void repair_mesh_vertices(
-	Mesh_t& mesh, 
+	Mesh_t& mesh,
 	float tolerance = FP_TOLERANCE) {
 
-	PositionAttribute< typename Mesh_t::VertexData > pos_attr;
-	typename impl::SpatialGrid<int>::type vertex_hash;
+	typedef typename Mesh_t::VertexData VertexData;
+	PositionAttribute<VertexData> pos_attr;
+	impl::ZOrderHash<Eigen::Vector3i> morton;
 
-	//Perform an initial garbage collection
 	mesh.garbage_collect();
-	
-	for(int i=mesh.vertices().size()-1; i>=0; --i) {
-		auto pos = pos_attr.get(mesh.vertex(i));		
-		auto fpos = pos * (2.0 / tolerance);
-		const Eigen::Vector3i ipos(fpos[0], fpos[1], fpos[2]);
-		
-		//Get neighbors
-		std::vector<int> overlaps;
-		for(int x=-1; x<=1; ++x)
-		for(int y=-1; y<=1; ++y)
-		for(int z=-1; z<=1; ++z) {
-			auto iter = vertex_hash.find( Eigen::Vector3i(ipos[0]+x, ipos[1]+y, ipos[2]+z) );
-			if(iter != vertex_hash.end() && iter->second > 0)
-				overlaps.push_back(iter->second);
+	const int nv = mesh.vertices().size();
+	const int nt = mesh.triangles().size();
+	if(nv == 0) {
+		return;
+	}
+
+	//Cells are WELD_CELL_SIZE times tolerance across, so few vertices are
+	//near enough to a face to need the neighboring cells searched, or
+	//bigger if need be for the grid to fit in the Morton codes
+	Eigen::Array3f lo = pos_attr.get(mesh.vertex(0)).array(), hi = lo;
+	for(int v=1; v<nv; ++v) {
+		lo = lo.min(pos_attr.get(mesh.vertex(v)).array());
+		hi = hi.max(pos_attr.get(mesh.vertex(v)).array());
+	}
+	const float cell = std::max(tolerance * impl::WELD_CELL_SIZE, (hi - lo).maxCoeff() / ((1 << impl::WELD_CELL_BITS) - 2));
+	auto grid_point = [&](int v) -> Eigen::Array3f {
+		return (pos_attr.get(mesh.vertex(v)).array() - lo) * (1.f / cell);
+	};
+	auto cell_of = [&](Eigen::Array3f const& g) -> Eigen::Vector3i {
+		return Eigen::Vector3i(
+			std::min((int)g[0], (1 << impl::WELD_CELL_BITS) - 2),
+			std::min((int)g[1], (1 << impl::WELD_CELL_BITS) - 2),
+			std::min((int)g[2], (1 << impl::WELD_CELL_BITS) - 2));
+	};
+
+	impl::WeldKeys keys(nv);
+	impl::parallel_for(0, nv, [&](int v) {
+		keys[v] = std::make_pair((uint64_t)morton(cell_of(grid_point(v))), v);
+	}, 4096);
+	impl::parallel_radix_sort(keys, 3 * impl::WELD_CELL_BITS);
+
+	//Lowest numbered vertex within tolerance of each vertex.  Runs are in
+	//vertex order, since the sort is stable.
+	std::vector<int> target(nv);
+	impl::parallel_for(0, nv, [&](int s) {
+		const int v = keys[s].second;
+		const Eigen::Vector3f p = pos_attr.get(mesh.vertex(v));
+		const Eigen::Array3f g = grid_point(v);
+		const Eigen::Vector3i c = cell_of(g);
+
+		//Neighboring cells only matter within tolerance of their faces
+		int d_lo[3], d_hi[3];
+		for(int k=0; k<3; ++k) {
+			d_lo[k] = c[k] > 0 && (g[k] - c[k]) * cell <= tolerance ? -1 : 0;
+			d_hi[k] = (c[k] + 1 - g[k]) * cell <= tolerance ? 1 : 0;
 		}
-				
-		//Fuse overlapping vertices
-		for(int j=overlaps.size()-1; j>=0; --j) {
-			//Check for vertex overlap
-			const int v = overlaps[j];
-			auto vpos = pos_attr.get(mesh.vertex(v));
-			if( (pos - vpos).norm() > tolerance ) {
-				continue;
+
+		int best = v;
+		auto search = [&](int first, int last) {
+			for(int i=first; i<last && keys[i].second < best; ++i) {
+				const int u = keys[i].second;
+				if((pos_attr.get(mesh.vertex(u)) - p).norm() <= tolerance) {
+					best = u;
+				}
 			}
-			
-			//Fuse overlapping triangles
-			auto tris = mesh.vertex_incidence(v);
-			for(int k=tris.size()-1; k>=0; --k) {
-				int t = tris[k];
-				auto tri = mesh.triangle(t);
-				mesh.remove_triangle(t);
-				if(tri.index_of(i) != -1) {
-					continue;
+		};
+		for(int dx=d_lo[0]; dx<=d_hi[0]; ++dx)
+		for(int dy=d_lo[1]; dy<=d_hi[1]; ++dy)
+		for(int dz=d_lo[2]; dz<=d_hi[2]; ++dz) {
+			if(dx == 0 && dy == 0 && dz == 0) {
+				//Own run, which is vertices numbered below v up to s
+				int first = s;
+				while(first > 0 && keys[first-1].first == keys[s].first) {
+					--first;
 				}
-				tri.v[tri.index_of(v)] = i;
-				mesh.add_triangle(tri);
+				search(first, s);
+				continue;
 			}
-			
-			//Remove redundant vertex
-			mesh.remove_vertex(v);
-			auto vfpos = vpos * (2.0 / tolerance);
-			vertex_hash[ Eigen::Vector3i(vfpos[0], vfpos[1], vfpos[2]) ] = -1;
+			const uint64_t code = morton(Eigen::Vector3i(c[0] + dx, c[1] + dy, c[2] + dz));
+			auto run = std::equal_range(keys.begin(), keys.end(), code, impl::WeldKeyLess());
+			search(run.first - keys.begin(), run.second - keys.begin());
 		}
-		
-		//Update hash
-		vertex_hash[ipos] = i;
+		target[v] = best;
+	}, 1024);
+	impl::WeldKeys().swap(keys);
+
+	//Follow each vertex to the one it finally joins, which is numbered
+	//lower, so is already settled.  Survivors are numbered in order.
+	std::vector<int> number(nv);
+	int survivors = 0;
+	for(int v=0; v<nv; ++v) {
+		number[v] = target[v] == v ? survivors++ : number[target[v]];
 	}
-	
-	mesh.garbage_collect();
+	if(survivors == nv) {
+		return;
+	}
+
+	typename Mesh_t::VertexList vertices(mesh.get_allocator());
+	vertices.reserve(survivors);
+	for(int v=0; v<nv; ++v) {
+		if(target[v] == v) {
+			vertices.push_back(mesh.vertex(v));
+		}
+	}
+
+	typename Mesh_t::TriangleList triangles(mesh.get_allocator());
+	triangles.reserve(nt);
+	for(int t=0; t<nt; ++t) {
+		Triangle tri = mesh.triangle(t);
+		for(int k=0; k<3; ++k) {
+			tri.v[k] = number[tri.v[k]];
+		}
+		if(tri.v[0] != tri.v[1] && tri.v[1] != tri.v[2] && tri.v[2] != tri.v[0]) {
+			triangles.push_back(tri);
+		}
+	}
+
+	mesh.assign(std::move(vertices), std::move(triangles));
 }
 
 };
 
 #endif
-
-
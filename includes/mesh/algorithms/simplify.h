@@ -0,0 +1,332 @@
+#ifndef MESH_SIMPLIFY_H
+#define MESH_SIMPLIFY_H
+
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "mesh/implementation/util.h"
+#include "mesh/core/attributes.h"
+#include "mesh/core/triangle.h"
+#include "mesh/core/trimesh.h"
+#include "mesh/algorithms/contour.h"
+
+namespace Mesh {
+
+namespace impl {
+
+	//An edge waiting to be collapsed by MeshSimplifier: vertex b merges into
+	//vertex a.  Stamps only go up, so if the sum of a's and b's is not what
+	//it was when the edge was queued, one of them has changed since and the
+	//entry is stale.
+	struct EdgeCollapse {
+		float	cost;
+		int		a, b;
+		int		stamp;
+
+		//Cheapest first out of a std::priority_queue
+		bool operator<(EdgeCollapse const& other) const {
+			return cost > other.cost;
+		}
+	};
+
+	//The default vertex for a collapse: the data of whichever end is
+	//nearer, moved to p, with the normals of the two ends blended.  t is
+	//where p lies along the edge, 0 at a and 1 at b.
+	template<typename VertexData>
+	struct NearestVertexMerge {
+		VertexData operator()(
+			VertexData const& a,
+			VertexData const& b,
+			float t,
+			Eigen::Vector3f const& p) const {
+			PositionAttribute<VertexData> pos_attr;
+			NormalAttribute<VertexData> norm_attr;
+			VertexData v = t < 0.5f ? a : b;
+			pos_attr.set(v, p);
+			Eigen::Vector3f n = (1.f - t) * norm_attr.get(a) + t * norm_attr.get(b);
+			const float len = n.norm();
+			norm_attr.set(v, len > FP_TOLERANCE ? Eigen::Vector3f(n / len) : norm_attr.get(t < 0.5f ? a : b));
+			return v;
+		}
+	};
+};
+
+/**
+ * Simplifies a mesh by edge collapses, cheapest first, after Garland and
+ * Heckbert's "Surface Simplification Using Quadric Error Metrics".  Each
+ * vertex carries a QEF of the planes of the triangles around it in the
+ * original mesh, and the two ends of a collapsed edge pool theirs.  The
+ * cost of a collapse is the mean squared distance from the merged vertex
+ * to its planes, so simplify(max_error) stops once every remaining
+ * collapse would move the surface by more than max_error (RMS), the same
+ * measure adaptive_contour() uses.
+ *
+ * A collapse is skipped if it would change the topology (the link
+ * condition) or turn any triangle over.  Vertices on open edges never
+ * move, so a piece cut out of a bigger mesh keeps its border and still
+ * fits its neighbors after simplification.
+ *
+ * simplify() can be called again with a larger error to carry on from
+ * where it stopped, so a chain of levels of detail costs no more than the
+ * coarsest one.  VertexMerge makes the vertex for a collapse from the data
+ * at its two ends; see impl::NearestVertexMerge.
+ */
+template<
+	typename Mesh_t,
+	typename VertexMerge = impl::NearestVertexMerge<typename Mesh_t::VertexData> >
+struct MeshSimplifier {
+	typedef typename Mesh_t::VertexData VertexData;
+
+	MeshSimplifier(Mesh_t const& mesh_, VertexMerge const& merge_ = VertexMerge()) :
+		mesh(mesh_),
+		merge(merge_),
+		dead_triangles(0) {
+		mesh.garbage_collect();
+		mesh.expand();
+
+		const int nv = mesh.vertices().size();
+		quadrics.resize(nv);
+		stamps.assign(nv, 0);
+		locked.assign(nv, false);
+		for(int t=0; t<mesh.triangles().size(); ++t) {
+			Triangle const& tri = mesh.triangle(t);
+			const Eigen::Vector3f	p0 = position(tri.v[0]),
+									p1 = position(tri.v[1]),
+									p2 = position(tri.v[2]);
+			const Eigen::Vector3f n = (p1 - p0).cross(p2 - p0);
+			for(int k=0; k<3; ++k) {
+				quadrics[tri.v[k]].add(position(tri.v[k]), n);
+
+				//Open and non-manifold edges stay where they are
+				const int a = tri.v[k], b = tri.v[(k+1)%3];
+				if(edge_triangles(a, b) != 2) {
+					locked[a] = locked[b] = true;
+				}
+			}
+		}
+
+		//Both directions of each edge turn up, but one will do.  The queue
+		//is built in one go, which is quicker than pushing one at a time.
+		std::vector<impl::EdgeCollapse> edges;
+		edges.reserve(3 * mesh.triangles().size() / 2);
+		for(int t=0; t<mesh.triangles().size(); ++t) {
+			Triangle const& tri = mesh.triangle(t);
+			for(int k=0; k<3; ++k) {
+				impl::EdgeCollapse e;
+				if(tri.v[k] < tri.v[(k+1)%3] && evaluate(tri.v[k], tri.v[(k+1)%3], e)) {
+					edges.push_back(e);
+				}
+			}
+		}
+		queue = std::priority_queue<impl::EdgeCollapse>(std::less<impl::EdgeCollapse>(), std::move(edges));
+	}
+
+	/**
+	 * Collapses edges until the cheapest one left costs more than
+	 * max_error.  Returns the number of edges collapsed.
+	 */
+	int simplify(float max_error) {
+		const double max_error2 = (double)max_error * max_error;
+		int count = 0;
+		while(!queue.empty()) {
+			const impl::EdgeCollapse e = queue.top();
+			if(e.cost > max_error2) {
+				break;
+			}
+			queue.pop();
+			if(e.stamp != stamps[e.a] + stamps[e.b]) {
+				continue;
+			}
+			if(collapse(e.a, e.b)) {
+				++count;
+			}
+		}
+		return count;
+	}
+
+	/**
+	 * Copies out the mesh as simplified so far, garbage collected and
+	 * compacted.
+	 */
+	void result(Mesh_t& out) const {
+		out = mesh;
+		out.garbage_collect();
+
+		//Collecting triangles doesn't fix up the incidence lists, but
+		//compact() rebuilds them from the triangles
+		out.compact();
+	}
+
+	///Live triangles in the simplified mesh
+	int triangle_count() const {
+		return mesh.triangles().size() - dead_triangles;
+	}
+
+private:
+	Mesh_t					mesh;
+	VertexMerge				merge;
+	std::vector<impl::QEF>	quadrics;
+
+	//Bumped whenever a vertex moves or dies, which makes queued collapses
+	//on its edges stale
+	std::vector<int>		stamps;
+	std::vector<bool>		locked;
+	std::priority_queue<impl::EdgeCollapse> queue;
+	int						dead_triangles;
+
+	//Scratch space for collapse()
+	std::vector<int>		ring_a, ring_b, around;
+
+	Eigen::Vector3f const& position(int v) const {
+		return PositionAttribute<VertexData>().get(mesh.vertex(v));
+	}
+
+	int edge_triangles(int a, int b) const {
+		auto around = mesh.vertex_incidence(a);
+		int count = 0;
+		for(int i=0; i<around.size(); ++i) {
+			if(mesh.triangle(around[i]).index_of(b) >= 0) {
+				++count;
+			}
+		}
+		return count;
+	}
+
+	//Vertices sharing a triangle with v, not counting v
+	void one_ring(int v, std::vector<int>& ring) const {
+		ring.clear();
+		auto around = mesh.vertex_incidence(v);
+		for(int i=0; i<around.size(); ++i) {
+			Triangle const& tri = mesh.triangle(around[i]);
+			for(int k=0; k<3; ++k) {
+				if(tri.v[k] != v && std::find(ring.begin(), ring.end(), tri.v[k]) == ring.end()) {
+					ring.push_back(tri.v[k]);
+				}
+			}
+		}
+	}
+
+	//Where the vertex from collapsing b into a goes.  The endpoints are
+	//swapped if need be so b is free to move.  Returns false if neither is.
+	bool place(int& a, int& b, Eigen::Vector3f& x, impl::QEF& q) const {
+		if(locked[b]) {
+			std::swap(a, b);
+		}
+		if(locked[b]) {
+			return false;
+		}
+		q = quadrics[a];
+		q.add(quadrics[b]);
+		if(locked[a]) {
+			x = position(a);
+			return true;
+		}
+
+		//Keep near the edge, where the planes are known
+		const Eigen::Vector3d	pa = position(a).template cast<double>(),
+								pb = position(b).template cast<double>();
+		const Eigen::Vector3d margin = Eigen::Vector3d::Constant(0.5 * (pb - pa).norm());
+		x = q.solve(pa.cwiseMin(pb) - margin, pa.cwiseMax(pb) + margin).template cast<float>();
+		return true;
+	}
+
+	bool evaluate(int a, int b, impl::EdgeCollapse& e) const {
+		Eigen::Vector3f x;
+		impl::QEF q;
+		if(!place(a, b, x, q)) {
+			return false;
+		}
+		e.cost = (float)std::max(0., q.error(x.cast<double>()) / q.n);
+		e.a = a;
+		e.b = b;
+		e.stamp = stamps[a] + stamps[b];
+		return true;
+	}
+
+	//Collapses b into a, unless that would change the topology or fold
+	//the surface over
+	bool collapse(int a, int b) {
+		Eigen::Vector3f x;
+		impl::QEF q;
+		if(!place(a, b, x, q)) {
+			return false;
+		}
+
+		//Link condition: the only vertices next to both ends are the ones
+		//opposite the edge, and the merged vertex still has three neighbors
+		one_ring(a, ring_a);
+		one_ring(b, ring_b);
+		int shared = 0;
+		for(int i=0; i<ring_a.size(); ++i) {
+			if(std::find(ring_b.begin(), ring_b.end(), ring_a[i]) != ring_b.end()) {
+				++shared;
+			}
+		}
+		if(shared != 2 || ring_a.size() + ring_b.size() < 7) {
+			return false;
+		}
+
+		//No triangle which survives may turn over, or get much closer to it
+		for(int side=0; side<2; ++side) {
+			auto around = mesh.vertex_incidence(side ? b : a);
+			for(int i=0; i<around.size(); ++i) {
+				Triangle const& tri = mesh.triangle(around[i]);
+				if(tri.index_of(a) >= 0 && tri.index_of(b) >= 0) {
+					continue;
+				}
+				Eigen::Vector3f p[3];
+				for(int k=0; k<3; ++k) {
+					p[k] = position(tri.v[k]);
+				}
+				const Eigen::Vector3f before = (p[1] - p[0]).cross(p[2] - p[0]);
+				p[tri.index_of(side ? b : a)] = x;
+				const Eigen::Vector3f after = (p[1] - p[0]).cross(p[2] - p[0]);
+				if(after.dot(before) <= 0.25f * after.norm() * before.norm()) {
+					return false;
+				}
+			}
+		}
+
+		const Eigen::Vector3f pa = position(a), edge = position(b) - pa;
+		const float len2 = edge.squaredNorm();
+		const float t = len2 > 0.f ? std::max(0.f, std::min(1.f, (x - pa).dot(edge) / len2)) : 0.f;
+		mesh.vertex(a) = merge(mesh.vertex(a), mesh.vertex(b), t, x);
+		quadrics[a] = q;
+
+		//Triangles on the edge go, the rest of b's move over to a
+		auto moving = mesh.vertex_incidence(b);
+		around.assign(moving.begin(), moving.end());
+		for(int i=0; i<around.size(); ++i) {
+			Triangle tri = mesh.triangle(around[i]);
+			mesh.remove_triangle(around[i]);
+			if(tri.index_of(a) >= 0) {
+				++dead_triangles;
+				continue;
+			}
+			tri.v[tri.index_of(b)] = a;
+			mesh.add_triangle(tri);
+		}
+		mesh.remove_vertex(b);
+
+		++stamps[a];
+		++stamps[b];
+		one_ring(a, ring_a);
+		for(int i=0; i<ring_a.size(); ++i) {
+			impl::EdgeCollapse e;
+			if(evaluate(a, ring_a[i], e)) {
+				queue.push(e);
+			}
+		}
+		return true;
+	}
+};
+
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef MESH_ARENA_H
+#define MESH_ARENA_H
+
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <vector>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+namespace Mesh {
+
+/**
+ * A region of memory for data which all goes away at once.
+ *
+ * Allocation just bumps a pointer through large blocks, and nothing is
+ * given back until release(), which frees every block in one go.  Memory
+ * freed before then is simply left unused.  Allocating is thread safe.
+ */
+struct Arena {
+	Arena(size_t block_size_ = (1<<20)) :
+		block_size(block_size_),
+		ptr(NULL),
+		end(NULL),
+		used(0) {}
+	~Arena() {
+		release();
+	}
+
+	void* allocate(size_t bytes, size_t align) {
+		std::lock_guard<std::mutex> guard(lock);
+		char* p = (char*)(((size_t)ptr + align - 1) & ~(align - 1));
+		if(!ptr || p + bytes > end) {
+			//Big requests get a block of their own, so the current block
+			//isn't wasted
+			const size_t size = bytes + align;
+			char* block = (char*)malloc(size > block_size ? size : block_size);
+			if(!block) {
+				throw std::bad_alloc();
+			}
+			blocks.push_back(block);
+			p = (char*)(((size_t)block + align - 1) & ~(align - 1));
+			if(size <= block_size) {
+				end = block + block_size;
+				ptr = p + bytes;
+			}
+		}
+		else {
+			ptr = p + bytes;
+		}
+		used += bytes;
+		return p;
+	}
+
+	///Frees everything allocated from the arena
+	void release() {
+		std::lock_guard<std::mutex> guard(lock);
+		for(int i=0; i<blocks.size(); ++i) {
+			free(blocks[i]);
+		}
+		blocks.clear();
+		ptr = end = NULL;
+		used = 0;
+	}
+
+	///Bytes handed out since the last release()
+	size_t size() const {
+		return used;
+	}
+
+	///The arena which default constructed ArenaAllocators on this thread
+	///draw from, or NULL for the heap.  Set it with an ArenaScope.
+	static Arena*& current() {
+		static __thread Arena* arena = NULL;
+		return arena;
+	}
+
+private:
+	size_t				block_size;
+	std::vector<char*>	blocks;
+	char				*ptr, *end;
+	size_t				used;
+	std::mutex			lock;
+
+	Arena(Arena const&);
+	Arena& operator=(Arena const&);
+};
+
+/**
+ * Makes arena the current one on this thread until the scope ends.
+ */
+struct ArenaScope {
+	ArenaScope(Arena* arena) : previous(Arena::current()) {
+		Arena::current() = arena;
+	}
+	~ArenaScope() {
+		Arena::current() = previous;
+	}
+
+private:
+	Arena* previous;
+};
+
+/**
+ * A standard allocator which draws from an Arena, or from the heap if it
+ * has none.  Default constructed ones use Arena::current().  Containers
+ * using it must be gone, or at least never touched again, by the time
+ * their arena is released.
+ */
+template<typename T>
+struct ArenaAllocator {
+	typedef T				value_type;
+	typedef T*				pointer;
+	typedef T const*		const_pointer;
+	typedef T&				reference;
+	typedef T const&		const_reference;
+	typedef size_t			size_type;
+	typedef ptrdiff_t		difference_type;
+
+	//Containers keep their memory's arena when moved or swapped
+	typedef std::true_type	propagate_on_container_copy_assignment;
+	typedef std::true_type	propagate_on_container_move_assignment;
+	typedef std::true_type	propagate_on_container_swap;
+
+	template<typename U> struct rebind {
+		typedef ArenaAllocator<U> other;
+	};
+
+	ArenaAllocator() : arena(Arena::current()) {}
+	ArenaAllocator(Arena* arena_) : arena(arena_) {}
+	template<typename U>
+	ArenaAllocator(ArenaAllocator<U> const& other) : arena(other.arena) {}
+
+	T* allocate(size_t n, const void* = NULL) {
+		if(arena) {
+			return (T*)arena->allocate(n * sizeof(T), __alignof__(T));
+		}
+		return (T*)::operator new(n * sizeof(T));
+	}
+
+	//Arena memory is only freed with the whole arena
+	void deallocate(T* p, size_t) {
+		if(!arena) {
+			::operator delete(p);
+		}
+	}
+
+	size_t max_size() const {
+		return size_t(-1) / sizeof(T);
+	}
+
+	template<typename U, typename... Args>
+	void construct(U* p, Args&&... args) {
+		::new((void*)p) U(std::forward<Args>(args)...);
+	}
+
+	template<typename U>
+	void destroy(U* p) {
+		p->~U();
+	}
+
+	Arena* arena;
+};
+
+template<typename T, typename U>
+bool operator==(ArenaAllocator<T> const& a, ArenaAllocator<U> const& b) {
+	return a.arena == b.arena;
+}
+
+template<typename T, typename U>
+bool operator!=(ArenaAllocator<T> const& a, ArenaAllocator<U> const& b) {
+	return a.arena != b.arena;
+}
+
+};
+
+#endif
@@ -1,10 +1,13 @@
 #ifndef MESH_TRIMESH_H
 #define MESH_TRIMESH_H
 
+#include <cassert>
 #include <algorithm>
+#include <memory>
 #include <vector>
 
 #include "mesh/implementation/util.h"
+#include "mesh/implementation/parallel.h"
 #include "mesh/core/triangle.h"
 
 namespace Mesh {
@@ -24,47 +27,118 @@ namespace Mesh {
  *		have a default constructor. Other properties may be required for 
  *		additional algorithms.
  *
+ *   Allocator_t : Allocator for vertices, rebound for triangles and
+ *		incidence, so all of a mesh's storage can come from one place, such
+ *		as an Arena.
+ *
+ * Vertex incidence starts out as one list per vertex, which is easy to edit.
+ * Once a mesh is built, compact() packs it into two flat arrays instead,
+ * which is much smaller and quicker to walk, and records the neighbors of
+ * every triangle.  Editing a compacted mesh unpacks it again first.
+ *
  *******************************************************************************/
-template<typename VertexData_t>
+template<
+	typename VertexData_t,
+	typename Allocator_t = std::allocator<VertexData_t> >
 struct TriMesh {
 	
-	///A list of vertex names
-	typedef std::vector<int> IncidenceList;
-	
 	///Type alias for the vertex data structure.
 	typedef VertexData_t VertexData;
+	
+	///Allocator for vertices, rebound for everything else the mesh stores
+	typedef Allocator_t Allocator;
+	typedef typename Allocator::template rebind<int>::other IntAllocator;
+	typedef typename Allocator::template rebind<Triangle>::other TriangleAllocator;
+	
+	///A list of vertex names
+	typedef std::vector<int, IntAllocator> IncidenceList;
+	typedef typename Allocator::template rebind<IncidenceList>::other IncidenceListAllocator;
+	
+	///Storage for names, triangles and vertices
+	typedef std::vector<int, IntAllocator>				IndexList;
+	typedef std::vector<Triangle, TriangleAllocator>	TriangleList;
+	typedef std::vector<VertexData, Allocator>			VertexList;
+	
+	///A read-only view of the triangles around a vertex.  It is only good
+	///until the mesh is next modified.
+	struct IncidenceRange {
+		IncidenceRange(const int* first_, const int* last_) :
+			first(first_), last(last_) {}
+		
+		int			size() const				{ return last - first; }
+		bool		empty() const				{ return first == last; }
+		int			operator[](int i) const		{ return first[i]; }
+		const int*	begin() const				{ return first; }
+		const int*	end() const					{ return last; }
+		
+	private:
+		const int	*first, *last;
+	};
 
 	//Constructors/assignment operator boilerplate
-	TriMesh() {}
+	TriMesh(Allocator const& alloc = Allocator()) :
+		dead_tris(alloc),
+		tri_data(alloc),
+		dead_verts(alloc),
+		vert_data(alloc),
+		incidence(alloc),
+		compacted(false),
+		incidence_offsets(alloc),
+		incidence_tris(alloc),
+		neighbor_data(alloc) {}
 	TriMesh(const TriMesh& other) :
 		dead_tris(other.dead_tris),
 		tri_data(other.tri_data),
 		dead_verts(other.dead_verts),
 		vert_data(other.vert_data),
-		incidence(other.incidence) {}
+		incidence(other.incidence),
+		compacted(other.compacted),
+		incidence_offsets(other.incidence_offsets),
+		incidence_tris(other.incidence_tris),
+		neighbor_data(other.neighbor_data) {}
 	TriMesh(TriMesh&& other) :
-		dead_tris(other.dead_tris),
-		tri_data(other.tri_data),
-		dead_verts(other.dead_verts),
-		vert_data(other.vert_data),
-		incidence(other.incidence) {}
+		dead_tris(std::move(other.dead_tris)),
+		tri_data(std::move(other.tri_data)),
+		dead_verts(std::move(other.dead_verts)),
+		vert_data(std::move(other.vert_data)),
+		incidence(std::move(other.incidence)),
+		compacted(other.compacted),
+		incidence_offsets(std::move(other.incidence_offsets)),
+		incidence_tris(std::move(other.incidence_tris)),
+		neighbor_data(std::move(other.neighbor_data)) {
+		other.compacted = false;
+	}
 	TriMesh& operator=(const TriMesh& other) {
-		dead_tris	= other.dead_tris;
-		tri_data	= other.tri_data;
-		dead_verts	= other.dead_verts;
-		vert_data	= other.vert_data;
-		incidence	= other.incidence;
+		dead_tris			= other.dead_tris;
+		tri_data			= other.tri_data;
+		dead_verts			= other.dead_verts;
+		vert_data			= other.vert_data;
+		incidence			= other.incidence;
+		compacted			= other.compacted;
+		incidence_offsets	= other.incidence_offsets;
+		incidence_tris		= other.incidence_tris;
+		neighbor_data		= other.neighbor_data;
 		return *this;
 	}
-	TriMesh&& operator=(TriMesh&& other) {
-		dead_tris	= std::move(other.dead_tris);
-		tri_data	= std::move(other.tri_data);
-		dead_verts	= std::move(other.dead_verts);
-		vert_data	= std::move(other.vert_data);
-		incidence	= std::move(other.incidence);
+	TriMesh& operator=(TriMesh&& other) {
+		dead_tris			= std::move(other.dead_tris);
+		tri_data			= std::move(other.tri_data);
+		dead_verts			= std::move(other.dead_verts);
+		vert_data			= std::move(other.vert_data);
+		incidence			= std::move(other.incidence);
+		compacted			= other.compacted;
+		incidence_offsets	= std::move(other.incidence_offsets);
+		incidence_tris		= std::move(other.incidence_tris);
+		neighbor_data		= std::move(other.neighbor_data);
+		other.clear();
 		return *this;
 	}
 	
+	///The allocator the mesh was made with
+	Allocator get_allocator() const {
+		return vert_data.get_allocator();
+	}
+	
 	/**
 	 * Reserves space for vertices and triangles.
 	 *
@@ -78,7 +152,9 @@ struct TriMesh {
 	void reserve(int nv, int nt) {
 		tri_data.reserve(nt);	
 		vert_data.reserve(nv);
-		incidence.reserve(nv);
+		if(!compacted) {
+			incidence.reserve(nv);
+		}
 	}
 	
 	/**
@@ -92,6 +168,10 @@ struct TriMesh {
 		dead_verts.swap(other.dead_verts);
 		vert_data.swap(other.vert_data);
 		incidence.swap(other.incidence);
+		std::swap(compacted, other.compacted);
+		incidence_offsets.swap(other.incidence_offsets);
+		incidence_tris.swap(other.incidence_tris);
+		neighbor_data.swap(other.neighbor_data);
 	}
 
 	/**
@@ -103,6 +183,25 @@ struct TriMesh {
 		dead_verts.clear();
 		vert_data.clear();
 		incidence.clear();
+		compacted = false;
+		incidence_offsets.clear();
+		incidence_tris.clear();
+		neighbor_data.clear();
+	}
+	
+	/**
+	 * Replaces everything in the mesh with the given vertices and
+	 * triangles, and compacts it.  Much quicker than adding them one at a
+	 * time, since no per-vertex incidence lists are made.
+	 *
+	 *	vertices : The new vertices, which are moved from
+	 *	triangles : The new triangles, which are moved from
+	 */
+	void assign(VertexList&& vertices, TriangleList&& triangles) {
+		clear();
+		vert_data = std::move(vertices);
+		tri_data = std::move(triangles);
+		compact();
 	}
 	
 	/**
@@ -118,7 +217,7 @@ struct TriMesh {
 	/**
 	 * Returns a readable list of all triangles
 	 */
-	const std::vector<Triangle>& triangles()  const		{ return tri_data; }
+	const TriangleList&			triangles()  const		{ return tri_data; }
 
 	/**
 	 * Returns the vertex with the given name.
@@ -133,14 +232,114 @@ struct TriMesh {
 	/**
 	 * Returns a readable list of all vertices
 	 */
-	const std::vector<VertexData>&	vertices() const		{ return vert_data; }
+	const VertexList&			vertices() const		{ return vert_data; }
 	
 	/**
 	 * Returns the collection of all triangles incident to a given vertex.
 	 *
 	 *	v : The name of the vertex
 	 */
-	const IncidenceList&	vertex_incidence(int v) const	{ return incidence[v]; }
+	IncidenceRange vertex_incidence(int v) const {
+		if(compacted) {
+			const int* base = incidence_tris.data();
+			return IncidenceRange(base + incidence_offsets[v], base + incidence_offsets[v+1]);
+		}
+		return IncidenceRange(incidence[v].data(), incidence[v].data() + incidence[v].size());
+	}
+	
+	/**
+	 * Returns the triangle on the other side of the edge opposite vertex k
+	 * of triangle t, that is the edge from t.v[k+1] to t.v[k+2], or -1 if
+	 * there is none.  Where more than two triangles share the edge, this is
+	 * the first one around t.v[k+1] which doesn't contain t.v[k].
+	 *
+	 * Constant time on a compacted mesh, otherwise it searches the triangles
+	 * around t.v[k+1].
+	 *
+	 *	t : The name of the triangle
+	 *	k : Which edge of the triangle, 0 to 2
+	 */
+	int triangle_neighbor(int t, int k) const {
+		if(compacted) {
+			return neighbor_data[3*t + k];
+		}
+		return find_neighbor(t, k);
+	}
+	
+	/**
+	 * Packs vertex incidence into one offset and one triangle array, and
+	 * frees the per-vertex lists.  Triangles around a vertex keep the order
+	 * they were added in.  Also builds the table behind triangle_neighbor().
+	 * Queries on a compacted mesh are safe to make from several threads at
+	 * once.
+	 */
+	void compact() {
+		if(compacted) {
+			return;
+		}
+		
+		std::vector<bool> dead(tri_data.size(), false);
+		for(int i=0; i<dead_tris.size(); ++i) {
+			dead[dead_tris[i]] = true;
+		}
+		
+		//Count the triangles around each vertex, then place them
+		const int nv = vert_data.size();
+		incidence_offsets.assign(nv + 1, 0);
+		for(int t=0; t<tri_data.size(); ++t) {
+			if(dead[t])
+				continue;
+			for(int i=0; i<3; ++i) {
+				++incidence_offsets[tri_data[t].v[i] + 1];
+			}
+		}
+		for(int v=0; v<nv; ++v) {
+			incidence_offsets[v+1] += incidence_offsets[v];
+		}
+		
+		incidence_tris.resize(incidence_offsets[nv]);
+		std::vector<int> fill(incidence_offsets.begin(), incidence_offsets.end() - 1);
+		for(int t=0; t<tri_data.size(); ++t) {
+			if(dead[t])
+				continue;
+			for(int i=0; i<3; ++i) {
+				incidence_tris[fill[tri_data[t].v[i]]++] = t;
+			}
+		}
+		
+		release(incidence);
+		compacted = true;
+		
+		neighbor_data.resize(3 * tri_data.size());
+		impl::parallel_for(0, tri_data.size(), [&](int t) {
+			for(int k=0; k<3; ++k) {
+				neighbor_data[3*t + k] = dead[t] ? -1 : find_neighbor(t, k);
+			}
+		}, 1024);
+	}
+	
+	/**
+	 * Undoes compact(), so the mesh can be edited cheaply again.  Editing
+	 * operations call this themselves.
+	 */
+	void expand() {
+		if(!compacted) {
+			return;
+		}
+		
+		const int nv = vert_data.size();
+		incidence.assign(nv, IncidenceList(incidence_tris.get_allocator()));
+		for(int v=0; v<nv; ++v) {
+			incidence[v].assign(
+				incidence_tris.begin() + incidence_offsets[v],
+				incidence_tris.begin() + incidence_offsets[v+1]);
+		}
+		
+		release(incidence_offsets);
+		release(incidence_tris);
+		release(neighbor_data);
+		compacted = false;
+	}
 	
 	/**
 	 * Creates a vertex.
@@ -150,7 +349,8 @@ struct TriMesh {
 	 *	Returns : The name of the vertex which was created.
 	 */
 	int add_vertex(const VertexData& vdata) {
-		IncidenceList tmp;
+		expand();
+		IncidenceList tmp(dead_verts.get_allocator());
 		
 		if(dead_verts.size() > 0) {
 			int n = dead_verts.back();
@@ -174,6 +374,7 @@ struct TriMesh {
 	 *	Returns : The name of a triangle.
 	 */
 	int add_triangle(const Triangle& tri) {
+		expand();
 		int n;
 		if(dead_tris.size() > 0) {
 			n = dead_tris.back();
@@ -212,6 +413,7 @@ struct TriMesh {
 	 *	n : The name of the vertex to remove
 	 */
 	void remove_vertex(int n) {
+		expand();
 		for(int i = incidence[n].size()-1; i>=0; --i) {
 			remove_triangle(incidence[n][i]);
 		}
@@ -228,6 +430,7 @@ struct TriMesh {
 	 *	n : The name of the triangle to remove
 	 */
 	void remove_triangle(int n) {
+		expand();
 		for(int i=0; i<3; ++i) {
 			IncidenceList& ind = incidence[tri_data[n].v[i]];
 			for(int j=0; j<ind.size(); ++j) {
@@ -260,6 +463,12 @@ struct TriMesh {
 	 *  amount of time w/r to the vertices of the mesh.
 	 */
 	void garbage_collect(bool cleanup_orphan_vertices=false) {	
+		//Nothing to do, so don't unpack a compacted mesh
+		if(!cleanup_orphan_vertices && dead_verts.empty() && dead_tris.empty()) {
+			return;
+		}
+		expand();
+		
 		if(cleanup_orphan_vertices) {
 			for(int i=vert_data.size()-1; i>=0; --i) {
 				if(incidence[i].size() == 0) {
@@ -347,6 +556,54 @@ struct TriMesh {
 		}
 	}
 	
+	/**
+	 * Renames every vertex and triangle.
+	 *
+	 * Vertex i of the result is vertex vertex_order[i] of the mesh, and
+	 * triangle i is triangle triangle_order[i].  Both must be permutations,
+	 * and the mesh must have been garbage collected.  Incidence is rebuilt,
+	 * compacted if it was before.
+	 *
+	 *	vertex_order : The old name of each vertex, in the new order
+	 *	triangle_order : The old name of each triangle, in the new order
+	 */
+	void reorder(
+		std::vector<int> const& vertex_order,
+		std::vector<int> const& triangle_order) {
+		assert(dead_verts.empty() && dead_tris.empty());
+		assert(vertex_order.size() == vert_data.size());
+		assert(triangle_order.size() == tri_data.size());
+		
+		std::vector<int> name(vert_data.size());
+		VertexList verts(vert_data.get_allocator());
+		verts.reserve(vert_data.size());
+		for(int i=0; i<vertex_order.size(); ++i) {
+			verts.push_back(std::move(vert_data[vertex_order[i]]));
+			name[vertex_order[i]] = i;
+		}
+		
+		TriangleList tris(tri_data.get_allocator());
+		tris.reserve(tri_data.size());
+		for(int i=0; i<triangle_order.size(); ++i) {
+			Triangle tri = tri_data[triangle_order[i]];
+			for(int k=0; k<3; ++k) {
+				tri.v[k] = name[tri.v[k]];
+			}
+			tris.push_back(tri);
+		}
+		vert_data.swap(verts);
+		tri_data.swap(tris);
+		
+		//compact() builds incidence from the triangles alone
+		const bool was_compacted = compacted;
+		compacted = false;
+		release(incidence);
+		compact();
+		if(!was_compacted) {
+			expand();
+		}
+	}
+	
 	/**
 	 * Retrieves index/vertex buffers for drawing.
 	 *
@@ -366,12 +623,42 @@ struct TriMesh {
 	}
 	
 protected:
-	std::vector<int>			dead_tris;
-	std::vector<Triangle>		tri_data;
+	int find_neighbor(int t, int k) const {
+		Triangle const& tri = tri_data[t];
+		const int	a = tri.v[k],
+					b = tri.v[(k+1)%3],
+					c = tri.v[(k+2)%3];
+		IncidenceRange around = vertex_incidence(b);
+		for(int i=0; i<around.size(); ++i) {
+			Triangle const& other = tri_data[around[i]];
+			if(other.index_of(c) >= 0 && other.index_of(a) < 0) {
+				return around[i];
+			}
+		}
+		return -1;
+	}
+	
+	//Frees a vector's memory, keeping its allocator
+	template<typename Vector>
+	static void release(Vector& v) {
+		Vector(v.get_allocator()).swap(v);
+	}
+	
+	IndexList			dead_tris;
+	TriangleList		tri_data;
+	
+	IndexList			dead_verts;
+	VertexList			vert_data;
+	std::vector<IncidenceList, IncidenceListAllocator>	incidence;
+	
+	//Incidence after compact(): the triangles around vertex v are
+	//incidence_tris[incidence_offsets[v]] up to incidence_offsets[v+1]
+	bool				compacted;
+	IndexList			incidence_offsets;
+	IndexList			incidence_tris;
 	
-	std::vector<int>			dead_verts;
-	std::vector<VertexData>		vert_data;
-	std::vector<IncidenceList>	incidence;
+	//Also after compact(): entry 3*t + k is triangle_neighbor(t, k)
+	IndexList			neighbor_data;
 };
 
 };
@@ -0,0 +1,221 @@
+#ifndef MESH_PARALLEL_H
+#define MESH_PARALLEL_H
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <utility>
+#include <stdint.h>
+
+namespace Mesh {
+namespace impl {
+
+	/**
+	 * A persistent pool of worker threads.
+	 *
+	 * Work is submitted as a number of tasks, which are handed out to the
+	 * workers (and the calling thread) until they run out.  Callers that need
+	 * deterministic results should make the output of each task independent
+	 * of which thread runs it; parallel_for() does this by splitting ranges
+	 * the same way no matter how many threads there are.
+	 *
+	 * Nested calls, or calls made while the pool is busy, just run serially
+	 * on the calling thread.
+	 */
+	struct ThreadPool {
+
+		static ThreadPool& instance() {
+			static ThreadPool pool;
+			return pool;
+		}
+
+		//Number of threads which run tasks, including the caller
+		int size() const {
+			return workers.size() + 1;
+		}
+
+		/**
+		 * Calls func(t) for every t in [0, n) and waits for them to finish.
+		 */
+		void run(int n, std::function<void(int)> const& func) {
+			if(n <= 0) {
+				return;
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			if(busy || workers.empty() || n == 1) {
+				lock.unlock();
+				for(int t=0; t<n; ++t) {
+					func(t);
+				}
+				return;
+			}
+
+			busy		= true;
+			job			= &func;
+			job_size	= n;
+			next_task	= 0;
+			remaining	= n;
+			++generation;
+			wake.notify_all();
+
+			work(lock);
+			while(remaining > 0) {
+				done.wait(lock);
+			}
+
+			job		= NULL;
+			busy	= false;
+		}
+
+	private:
+		std::vector<std::thread>		workers;
+		std::mutex						mutex;
+		std::condition_variable			wake, done;
+		const std::function<void(int)>*	job;
+		int								job_size, next_task, remaining;
+		unsigned						generation;
+		bool							busy, stopping;
+
+		ThreadPool() :
+			job(NULL),
+			job_size(0),
+			next_task(0),
+			remaining(0),
+			generation(0),
+			busy(false),
+			stopping(false) {
+			int n = std::thread::hardware_concurrency();
+			for(int i=1; i<n; ++i) {
+				workers.push_back(std::thread(&ThreadPool::worker_main, this));
+			}
+		}
+
+		~ThreadPool() {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				stopping = true;
+				wake.notify_all();
+			}
+			for(int i=0; i<workers.size(); ++i) {
+				workers[i].join();
+			}
+		}
+
+		//Runs tasks from the current job until there are none left.
+		//Called with the lock held.
+		void work(std::unique_lock<std::mutex>& lock) {
+			while(job && next_task < job_size) {
+				const std::function<void(int)>* f = job;
+				int t = next_task++;
+				lock.unlock();
+				(*f)(t);
+				lock.lock();
+				if(--remaining == 0) {
+					done.notify_all();
+				}
+			}
+		}
+
+		void worker_main() {
+			std::unique_lock<std::mutex> lock(mutex);
+			unsigned seen = generation;
+			while(true) {
+				while(!stopping && seen == generation) {
+					wake.wait(lock);
+				}
+				if(stopping) {
+					return;
+				}
+				seen = generation;
+				work(lock);
+			}
+		}
+
+		//Not copyable
+		ThreadPool(ThreadPool const&);
+		ThreadPool& operator=(ThreadPool const&);
+	};
+
+	/**
+	 * Calls func(lo, hi) over disjoint sub-ranges covering [begin, end), in
+	 * parallel.  Ranges are at least grain long and don't depend on the
+	 * number of threads.
+	 */
+	template<typename Func>
+	void parallel_for_ranges(int begin, int end, int grain, Func const& func) {
+		const int n = end - begin;
+		if(n <= 0) {
+			return;
+		}
+		grain = std::max(grain, 1);
+		const int chunks = (n + grain - 1) / grain;
+		ThreadPool::instance().run(chunks, [&](int c) {
+			int lo = begin + c * grain;
+			func(lo, std::min(lo + grain, end));
+		});
+	}
+
+	/**
+	 * Calls func(i) for every i in [begin, end), in parallel.
+	 */
+	template<typename Func>
+	void parallel_for(int begin, int end, Func const& func, int grain = 1) {
+		parallel_for_ranges(begin, end, grain, [&](int lo, int hi) {
+			for(int i=lo; i<hi; ++i) {
+				func(i);
+			}
+		});
+	}
+
+	/**
+	 * Sorts (key, value) pairs by key with a least significant digit radix
+	 * sort, eight bits at a time, covering the low key_bits of the keys.
+	 * Each pass counts digits in fixed blocks in parallel, then scatters
+	 * the blocks in parallel, so the sort is stable and the result doesn't
+	 * depend on the number of threads.
+	 */
+	inline void parallel_radix_sort(
+		std::vector<std::pair<uint64_t, int> >& items,
+		int key_bits = 64) {
+		static const int DIGITS = 256, BLOCK = 1<<14;
+		const int n = items.size();
+		const int blocks = (n + BLOCK - 1) / BLOCK;
+		std::vector<std::pair<uint64_t, int> > scratch(n);
+		std::vector<int> counts(blocks * DIGITS);
+		for(int shift=0; shift<key_bits; shift+=8) {
+			parallel_for(0, blocks, [&](int b) {
+				int* count = &counts[b * DIGITS];
+				std::fill(count, count + DIGITS, 0);
+				for(int i=b*BLOCK; i<std::min(n, (b+1)*BLOCK); ++i) {
+					++count[(items[i].first >> shift) & (DIGITS - 1)];
+				}
+			});
+			
+			//Where each block's run of each digit starts
+			int total = 0;
+			for(int d=0; d<DIGITS; ++d) {
+				for(int b=0; b<blocks; ++b) {
+					const int c = counts[b * DIGITS + d];
+					counts[b * DIGITS + d] = total;
+					total += c;
+				}
+			}
+			
+			parallel_for(0, blocks, [&](int b) {
+				int* next = &counts[b * DIGITS];
+				for(int i=b*BLOCK; i<std::min(n, (b+1)*BLOCK); ++i) {
+					scratch[next[(items[i].first >> shift) & (DIGITS - 1)]++] = items[i];
+				}
+			});
+			items.swap(scratch);
+		}
+	}
+
+}; };
+
+#endif
+
@@ -3,8 +3,10 @@
 
 //Implementation stuff
 #include "mesh/implementation/util.h"
+#include "mesh/implementation/parallel.h"
 
 //Core data structures
+#include "mesh/core/arena.h"
 #include "mesh/core/attributes.h"
 #include "mesh/core/triangle.h"
 #include "mesh/core/trimesh.h"
@@ -12,11 +14,16 @@
 //Algorithms
 #include "mesh/algorithms/connected_components.h"
 #include "mesh/algorithms/contour.h"
+#include "mesh/algorithms/adaptive_contour.h"
 #include "mesh/algorithms/repair.h"
 #include "mesh/algorithms/normals.h"
+#include "mesh/algorithms/reorder.h"
+#include "mesh/algorithms/simplify.h"
 
 //Serialization
 #include "mesh/serialize/ply.h"
+#include "mesh/serialize/binary.h"
+#include "mesh/serialize/grid.h"
 
 #endif
 
@@ -0,0 +1,200 @@
+#ifndef MESH_SERIALIZE_BINARY_H
+#define MESH_SERIALIZE_BINARY_H
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "mesh/core/trimesh.h"
+
+namespace Mesh {
+
+/**
+ * Binary mesh files: a BinaryMeshHeader, then vertex_count vertices as raw
+ * VertexFormat structs, then triangle_count triangles of 3 ints each.  They
+ * are only meant to be read back on the same kind of machine which wrote
+ * them.
+ */
+struct BinaryMeshHeader {
+	char	magic[4];
+	int		version;
+	int		vertex_size;
+	int		vertex_count;
+	int		triangle_count;
+};
+
+namespace impl {
+	static const char	BINARY_MESH_MAGIC[4]	= { 'M', 'E', 'S', 'H' };
+	static const int	BINARY_MESH_VERSION		= 1;
+};
+
+/**
+ * Writes a binary mesh file one vertex and triangle at a time, so the mesh
+ * never has to be in memory; isocontour_stream() can write straight to one.
+ * Triangles are kept in a temporary file until close(), which appends them
+ * to the vertices.  The file is written under a temporary name and only
+ * renamed to path once it is complete.
+ */
+template<typename VertexFormat>
+struct BinaryMeshWriter {
+	typedef VertexFormat VertexData;
+
+	BinaryMeshWriter(const char* path_) :
+		path(path_),
+		tmp_path(std::string(path_) + ".tmp"),
+		failed(false) {
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, impl::BINARY_MESH_MAGIC, sizeof(header.magic));
+		header.version = impl::BINARY_MESH_VERSION;
+		header.vertex_size = sizeof(VertexFormat);
+
+		file = fopen(tmp_path.c_str(), "wb");
+		triangles = tmpfile();
+		if(!file || !triangles) {
+			failed = true;
+		}
+		else {
+			fwrite(&header, sizeof(header), 1, file);
+		}
+	}
+
+	~BinaryMeshWriter() {
+		close();
+	}
+
+	//False if anything went wrong so far
+	bool ok() const {
+		return !failed;
+	}
+
+	int add_vertex(VertexFormat const& v) {
+		if(!failed && fwrite(&v, sizeof(VertexFormat), 1, file) != 1) {
+			failed = true;
+		}
+		return header.vertex_count++;
+	}
+
+	int add_triangle(int v0, int v1, int v2) {
+		const int tri[3] = { v0, v1, v2 };
+		if(!failed && fwrite(tri, sizeof(int), 3, triangles) != 3) {
+			failed = true;
+		}
+		return header.triangle_count++;
+	}
+
+	/**
+	 * Finishes the file.  Returns true if it was written completely, in
+	 * which case it now has the name given to the constructor.
+	 */
+	bool close() {
+		if(!file && !triangles) {
+			return !failed;
+		}
+
+		if(!failed) {
+			rewind(triangles);
+			std::vector<char> buffer(1<<16);
+			size_t n;
+			while((n = fread(&buffer[0], 1, buffer.size(), triangles)) > 0) {
+				if(fwrite(&buffer[0], 1, n, file) != n) {
+					failed = true;
+					break;
+				}
+			}
+			failed = failed || ferror(triangles);
+		}
+		if(!failed) {
+			fseek(file, 0, SEEK_SET);
+			failed = fwrite(&header, sizeof(header), 1, file) != 1;
+		}
+
+		if(triangles) {
+			fclose(triangles);
+			triangles = NULL;
+		}
+		if(file) {
+			failed = (fclose(file) != 0) || failed;
+			file = NULL;
+		}
+		if(failed || rename(tmp_path.c_str(), path.c_str()) != 0) {
+			remove(tmp_path.c_str());
+			failed = true;
+		}
+		return !failed;
+	}
+
+private:
+	std::string			path, tmp_path;
+	FILE				*file, *triangles;
+	BinaryMeshHeader	header;
+	bool				failed;
+
+	BinaryMeshWriter(BinaryMeshWriter const&);
+	BinaryMeshWriter& operator=(BinaryMeshWriter const&);
+};
+
+/**
+ * Reads a file written by BinaryMeshWriter into mesh.  Returns false, and
+ * leaves mesh empty, if the file is missing, truncated, or holds another
+ * kind of vertex.
+ */
+template<typename VertexFormat, typename Allocator>
+bool binary_mesh_read(const char* path, TriMesh<VertexFormat, Allocator>& mesh) {
+	mesh.clear();
+
+	FILE* file = fopen(path, "rb");
+	if(!file) {
+		return false;
+	}
+
+	BinaryMeshHeader header;
+	bool ok =
+		fread(&header, sizeof(header), 1, file) == 1 &&
+		memcmp(header.magic, impl::BINARY_MESH_MAGIC, sizeof(header.magic)) == 0 &&
+		header.version == impl::BINARY_MESH_VERSION &&
+		header.vertex_size == sizeof(VertexFormat) &&
+		header.vertex_count >= 0 &&
+		header.triangle_count >= 0;
+
+	if(ok) {
+		mesh.reserve(header.vertex_count, header.triangle_count);
+	}
+
+	//Read in blocks, so the file is never held in memory twice
+	static const int BLOCK = 4096;
+	std::vector<VertexFormat> verts(BLOCK);
+	for(int i=0; ok && i<header.vertex_count; i+=BLOCK) {
+		const int n = std::min(BLOCK, header.vertex_count - i);
+		ok = fread(&verts[0], sizeof(VertexFormat), n, file) == (size_t)n;
+		for(int j=0; ok && j<n; ++j) {
+			mesh.add_vertex(verts[j]);
+		}
+	}
+
+	std::vector<int> tris(3 * BLOCK);
+	for(int i=0; ok && i<header.triangle_count; i+=BLOCK) {
+		const int n = std::min(BLOCK, header.triangle_count - i);
+		ok = fread(&tris[0], 3 * sizeof(int), n, file) == (size_t)n;
+		for(int j=0; ok && j<3*n; ++j) {
+			ok = tris[j] >= 0 && tris[j] < header.vertex_count;
+		}
+		for(int j=0; ok && j<n; ++j) {
+			mesh.add_triangle(tris[3*j], tris[3*j+1], tris[3*j+2]);
+		}
+	}
+
+	fclose(file);
+	if(!ok) {
+		mesh.clear();
+	}
+	return ok;
+}
+
+};
+
+#endif
+
@@ -0,0 +1,192 @@
+#ifndef MESH_SERIALIZE_GRID_H
+#define MESH_SERIALIZE_GRID_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <Eigen/Core>
+
+#include "mesh/implementation/parallel.h"
+
+namespace Mesh {
+
+/**
+ * Grid files: a GridHeader, then res[0] x res[1] x res[2] float densities
+ * with x varying fastest.  Sample (x,y,z) is the density at
+ * lo + (x,y,z) * (hi - lo) / res, the same points isocontour() samples.
+ */
+struct GridHeader {
+	char	magic[4];
+	int		version;
+	int		res[3];
+};
+
+namespace impl {
+	static const char	GRID_MAGIC[4]	= { 'G', 'R', 'I', 'D' };
+	static const int	GRID_VERSION	= 1;
+};
+
+/**
+ * Samples f into a grid file, one z plane at a time, so the volume never
+ * has to be in memory.  f is called from several threads at once.  Returns
+ * false if the file couldn't be written.
+ */
+template<typename DensityFunc, typename Vector>
+bool grid_write(
+	const char* path,
+	DensityFunc& f,
+	Vector lo,
+	Vector hi,
+	Eigen::Vector3i res) {
+
+	const std::string tmp_path = std::string(path) + ".tmp";
+	FILE* file = fopen(tmp_path.c_str(), "wb");
+	if(!file) {
+		return false;
+	}
+
+	GridHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, impl::GRID_MAGIC, sizeof(header.magic));
+	header.version = impl::GRID_VERSION;
+	for(int i=0; i<3; ++i) {
+		header.res[i] = res[i];
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+	const Eigen::Array3f h = (hi - lo).array() / Vector(res[0], res[1], res[2]).array();
+	std::vector<float> plane(res[0] * res[1]);
+	for(int z=0; ok && z<res[2]; ++z) {
+		impl::parallel_for(0, res[1], [&](int y) {
+			for(int x=0; x<res[0]; ++x) {
+				plane[x + res[0] * y] = f((Eigen::Array3f(x,y,z) * h + lo.array()).matrix());
+			}
+		});
+		ok = fwrite(&plane[0], sizeof(float), plane.size(), file) == plane.size();
+	}
+
+	ok = (fclose(file) == 0) && ok;
+	if(!ok || rename(tmp_path.c_str(), path) != 0) {
+		remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+/**
+ * A grid file mapped into memory, so the system pages samples in as they
+ * are read and can drop them again once contouring has moved on.  To
+ * contour it,
+ *
+ *	MappedGrid grid;
+ *	grid.open(path);
+ *	isocontour_stream(out,
+ *		lattice_samples([&](int x, int y, int z) { return grid.lattice(x, y, z); }),
+ *		attr, lo, hi, grid.resolution());
+ *
+ * with the lo and hi the grid was written with.
+ */
+struct MappedGrid {
+	MappedGrid() : outside(-1.f), data(NULL), size(0), samples(NULL) {
+		memset(res, 0, sizeof(res));
+	}
+
+	~MappedGrid() {
+		close();
+	}
+
+	//Maps the grid at path.  Returns false if it isn't a grid file.
+	bool open(const char* path) {
+		close();
+
+		int fd = ::open(path, O_RDONLY);
+		if(fd < 0) {
+			return false;
+		}
+		struct stat st;
+		if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(GridHeader)) {
+			::close(fd);
+			return false;
+		}
+		void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(p == MAP_FAILED) {
+			return false;
+		}
+		data = p;
+		size = st.st_size;
+
+		GridHeader const& header = *(GridHeader const*)data;
+		bool ok =
+			memcmp(header.magic, impl::GRID_MAGIC, sizeof(header.magic)) == 0 &&
+			header.version == impl::GRID_VERSION;
+		for(int i=0; i<3; ++i) {
+			res[i] = header.res[i];
+			ok = ok && res[i] > 0;
+		}
+		ok = ok && size == sizeof(GridHeader) + sizeof(float) * (size_t)res[0] * res[1] * res[2];
+		if(!ok) {
+			close();
+			return false;
+		}
+
+		//Contouring reads the planes in order
+		madvise(data, size, MADV_SEQUENTIAL);
+		samples = (const float*)((const char*)data + sizeof(GridHeader));
+		return true;
+	}
+
+	void close() {
+		if(data) {
+			munmap(data, size);
+		}
+		data = NULL;
+		size = 0;
+		samples = NULL;
+		memset(res, 0, sizeof(res));
+	}
+
+	Eigen::Vector3i resolution() const {
+		return Eigen::Vector3i(res[0], res[1], res[2]);
+	}
+
+	float operator()(int x, int y, int z) const {
+		return samples[x + (size_t)res[0] * (y + (size_t)res[1] * z)];
+	}
+
+	//Sample at point (x,y,z) of the contour lattice, which is sample
+	//(x-1,y-1,z-1), and outside for the border around the grid
+	float lattice(int x, int y, int z) const {
+		--x; --y; --z;
+		if(	x < 0 || x >= res[0] ||
+			y < 0 || y >= res[1] ||
+			z < 0 || z >= res[2]) {
+			return outside;
+		}
+		return (*this)(x, y, z);
+	}
+
+	//Density of the space around the grid, negative (empty) by default
+	float outside;
+
+private:
+	void*			data;
+	size_t			size;
+	const float*	samples;
+	int				res[3];
+
+	MappedGrid(MappedGrid const&);
+	MappedGrid& operator=(MappedGrid const&);
+};
+
+};
+
+#endif
+
@@ -11,10 +11,10 @@
 
 namespace Mesh {
 
-template<typename VertexFormat>
+template<typename VertexFormat, typename Allocator>
 void ply_ascii_serialize(
 	FILE* fout,
-	TriMesh<VertexFormat> const& mesh) {
+	TriMesh<VertexFormat, Allocator> const& mesh) {
 
 	auto verts = mesh.verts();
 	auto tris = mesh.tris();
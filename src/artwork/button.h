@@ -42,7 +42,8 @@ Solid* make_button_on() {
 	auto player_art = new Solid(
 		Vector3i(16, 16, 4),
 		Vector3f(-1, -1, -0.25),
-		Vector3f( 1,  1,  0.25));
+		Vector3f( 1,  1,  0.25),
+		SOLID_LOW_POLY);
 	setup_solid(*player_art, player_model, player_style);
 	
 	return player_art;
@@ -54,7 +55,8 @@ Solid* make_button_off() {
 	auto player_art = new Solid(
 		Vector3i(16, 16, 4),
 		Vector3f(-1, -1, -0.25),
-		Vector3f( 1,  1,  0.25));
+		Vector3f( 1,  1,  0.25),
+		SOLID_LOW_POLY);
 	setup_solid(*player_art, player_model, player_style);
 	
 	return player_art;
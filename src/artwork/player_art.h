@@ -16,7 +16,7 @@ struct PlayerStyleFunc {
 		
 		Vertex result;
 		result.position = v;
-		float t = drand48();
+		float t = PointRandom(v[0], v[1], v[2]).uniform();
 		result.color = Vector3f(t,t*0.2,t*(0.4 * t + (1-t)*0.6));
 		return result;
 	}
@@ -28,7 +28,8 @@ Solid* make_player() {
 	auto player_art = new Solid(
 		Vector3i(16, 16, 16),
 		Vector3f(-1, -1, -1),
-		Vector3f( 1,  1,  1));
+		Vector3f( 1,  1,  1),
+		SOLID_DISTANCE_FIELD);
 	setup_solid(*player_art, player_model, player_style);
 	
 	return player_art;
@@ -27,7 +27,8 @@ Solid* make_prisimgate() {
 	auto model = new Solid(
 		Vector3i(16, 16, 16),
 		Vector3f(-2, -2, -2),
-		Vector3f( 2,  2,  2));
+		Vector3f( 2,  2,  2),
+		SOLID_DISTANCE_FIELD);
 	setup_solid(*model, func, style);
 	
 	return model;
@@ -1,17 +1,3 @@
-struct SpikeballModelFunc {
-	Cell operator()(Eigen::Vector3f v) const {
-		using namespace Eigen;
-		Cell result;
-		result.density = 
-			max_list({
-			bicone(v, Vector3f(1, 0, 0), 0.2, 2),
-			bicone(v, Vector3f(0, 1, 0), 0.2, 2),
-			bicone(v, Vector3f(0, 0, 1), 0.2, 2)});
-		result.friction = 0;
-		return result;
-	}
-};
-
 struct SpikeballStyleFunc {
 	Vertex operator()(Eigen::Vector3f const& v) const {
 		using namespace Eigen;
@@ -26,12 +12,18 @@ struct SpikeballStyleFunc {
 };
 
 Solid* make_spikeball() {
-	SpikeballModelFunc func;
+	using namespace CSG;
+	auto func = density(
+		unite(Bicone(Vector3f(1, 0, 0), 0.2, 2),
+		unite(Bicone(Vector3f(0, 1, 0), 0.2, 2),
+		      Bicone(Vector3f(0, 0, 1), 0.2, 2))),
+		0);
 	SpikeballStyleFunc style;
 	auto model = new Solid(
 		Vector3i(16, 16, 16),
 		Vector3f(-2, -2, -2),
-		Vector3f( 2,  2,  2));
+		Vector3f( 2,  2,  2),
+		SOLID_LOW_POLY);
 	setup_solid(*model, func, style);
 	
 	return model;
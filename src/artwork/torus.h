@@ -29,7 +29,8 @@ Solid* make_torus() {
 	auto player_art = new Solid(
 		Vector3i(16, 16, 8),
 		Vector3f(-4, -4, -2),
-		Vector3f( 4,  4,  2));
+		Vector3f( 4,  4,  2),
+		SOLID_DISTANCE_FIELD);
 	setup_solid(*player_art, player_model, player_style);
 	
 	return player_art;
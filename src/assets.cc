@@ -18,6 +18,7 @@
 #include "assets.h"
 #include "entity.h"
 #include "noise.h"
+#include "csg.h"
 
 using namespace std;
 using namespace Eigen;
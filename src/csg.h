@@ -0,0 +1,442 @@
+#ifndef CSG_H
+#define CSG_H
+
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Core>
+
+#include "voxels.h"
+#include "interval.h"
+#include "solid_cache.h"
+
+//Constructive solid geometry over density functions.
+//
+//Shapes are small value types, and combining them builds a nested type, so a
+//whole level definition is inlined into the loop that samples it without any
+//allocation or virtual calls.  Densities are positive inside.
+//
+//Every shape provides:
+//
+//	float operator()(Vector3f const& v) const
+//		Density at v.
+//
+//	float operator()(Vector3f const& v, Vector3f& gradient) const
+//		Density at v, also storing its gradient.
+//
+//	Interval bound(IntervalVector const& box) const
+//		Range of the density over box.
+//
+//	void cache_key(SolidCacheHash& h) const
+//		Adds the shape's parameters to h, so solids made from it can be
+//		found in the solid cache.
+//
+//The gradient of a union, intersection or difference comes from whichever
+//side is active at v.
+namespace CSG {
+
+	using Eigen::Vector3f;
+	using Eigen::Matrix3f;
+
+	//Primitives
+
+	struct Sphere {
+		float rad2;
+
+		Sphere(float rad2_) : rad2(rad2_) {}
+
+		float operator()(Vector3f const& v) const {
+			return rad2 - v.dot(v);
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			gradient = -2.f * v;
+			return (*this)(v);
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			return rad2 - squared_norm(v);
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			h.add(rad2);
+		}
+	};
+
+	//A ring around the z axis
+	struct Torus {
+		float radius, ringrad2;
+
+		Torus(float radius_, float ringrad2_) : radius(radius_), ringrad2(ringrad2_) {}
+
+		float operator()(Vector3f const& v) const {
+			float val = radius - std::sqrt(v[0] * v[0] + v[1] * v[1]);
+			return -(val * val + v[2] * v[2] - ringrad2);
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			float r = std::sqrt(v[0] * v[0] + v[1] * v[1]);
+			float val = radius - r;
+			float s = r > 0 ? 2.f * val / r : 0.f;
+			gradient = Vector3f(s * v[0], s * v[1], -2.f * v[2]);
+			return -(val * val + v[2] * v[2] - ringrad2);
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			Interval val = radius - sqrt(sqr(v[0]) + sqr(v[1]));
+			return -(sqr(val) + sqr(v[2]) - ringrad2);
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			h.add(radius);
+			h.add(ringrad2);
+		}
+	};
+
+	//An infinite cylinder through the origin along a unit axis
+	struct Cylinder {
+		Vector3f axis;
+		float rad2;
+
+		Cylinder(Vector3f const& axis_, float rad2_) : axis(axis_), rad2(rad2_) {}
+
+		float operator()(Vector3f const& v) const {
+			return rad2 - (v - axis*v.dot(axis)).squaredNorm();
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			Vector3f w = v - axis*v.dot(axis);
+			gradient = -2.f * w;
+			return rad2 - w.squaredNorm();
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			return rad2 - squared_distance_to_axis(v, axis);
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			h.add(axis);
+			h.add(rad2);
+		}
+	};
+
+	//A double cone with its apex at the origin
+	struct Cone {
+		Vector3f axis;
+		float rad2;
+
+		Cone(Vector3f const& axis_, float rad2_) : axis(axis_), rad2(rad2_) {}
+
+		float operator()(Vector3f const& v) const {
+			float a = axis.dot(v);
+			float b = (v - axis * a).squaredNorm();
+			return a*a*rad2 - b;
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			float a = axis.dot(v);
+			Vector3f w = v - axis * a;
+			gradient = (2.f * a * rad2) * axis - 2.f * w;
+			return a*a*rad2 - w.squaredNorm();
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			return sqr(dot(v, axis))*rad2 - squared_distance_to_axis(v, axis);
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			h.add(axis);
+			h.add(rad2);
+		}
+	};
+
+	//Axis aligned box, +1 inside and -1 outside.  The gradient is zero.
+	struct Box {
+		float width, height, depth;
+
+		Box(float width_, float height_, float depth_) :
+			width(width_), height(height_), depth(depth_) {}
+
+		float operator()(Vector3f const& v) const {
+			if(v[0] > -width && v[0] < width && v[1] > -height && v[1] < height && v[2] > -depth && v[2] < depth)
+				return 1;
+			return -1;
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			gradient = Vector3f::Zero();
+			return (*this)(v);
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			const float size[3] = { width, height, depth };
+			bool inside = true;
+			for(int i=0; i<3; ++i) {
+				if(v[i].hi <= -size[i] || v[i].lo >= size[i])
+					return Interval(-1);
+				inside = inside && v[i].lo > -size[i] && v[i].hi < size[i];
+			}
+			return inside ? Interval(1) : Interval(-1, 1);
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			h.add(width);
+			h.add(height);
+			h.add(depth);
+		}
+	};
+
+	//Two cones of length len, joined at their bases
+	struct Bicone {
+		Vector3f axis;
+		float rad2, len;
+
+		Bicone(Vector3f const& axis_, float rad2_, float len_) :
+			axis(axis_), rad2(rad2_), len(len_) {}
+
+		float operator()(Vector3f const& v) const {
+			float a = axis.dot(v);
+			float b = (v - axis * a).squaredNorm();
+
+			a = len - std::abs(a);
+			if(a < 0) {
+				return -1e10;
+			}
+			return a*a*rad2 - b;
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			float a = axis.dot(v);
+			Vector3f w = v - axis * a;
+			float h = len - std::abs(a);
+			if(h < 0) {
+				gradient = Vector3f::Zero();
+				return -1e10;
+			}
+			gradient = (a < 0 ? 2.f : -2.f) * h * rad2 * axis - 2.f * w;
+			return h*h*rad2 - w.squaredNorm();
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			Interval a = len - abs(dot(v, axis));
+			if(a.hi < 0) {
+				return Interval(-1e10);
+			}
+
+			Interval r = sqr(Interval(std::max(a.lo, 0.f), a.hi))*rad2 - squared_distance_to_axis(v, axis);
+			if(a.lo < 0) {
+				r = hull(r, Interval(-1e10));
+			}
+			return r;
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			h.add(axis);
+			h.add(rad2);
+			h.add(len);
+		}
+	};
+
+	//Combinations
+
+	template<typename A, typename B>
+	struct Union {
+		A a;
+		B b;
+
+		Union(A const& a_, B const& b_) : a(a_), b(b_) {}
+
+		float operator()(Vector3f const& v) const {
+			return std::max(a(v), b(v));
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			Vector3f gb;
+			float fa = a(v, gradient), fb = b(v, gb);
+			if(fb > fa) {
+				gradient = gb;
+				return fb;
+			}
+			return fa;
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			return max(a.bound(v), b.bound(v));
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			a.cache_key(h);
+			b.cache_key(h);
+		}
+	};
+
+	template<typename A, typename B>
+	struct Intersect {
+		A a;
+		B b;
+
+		Intersect(A const& a_, B const& b_) : a(a_), b(b_) {}
+
+		float operator()(Vector3f const& v) const {
+			return std::min(a(v), b(v));
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			Vector3f gb;
+			float fa = a(v, gradient), fb = b(v, gb);
+			if(fb < fa) {
+				gradient = gb;
+				return fb;
+			}
+			return fa;
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			return min(a.bound(v), b.bound(v));
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			a.cache_key(h);
+			b.cache_key(h);
+		}
+	};
+
+	//The part of a outside of b
+	template<typename A, typename B>
+	struct Subtract {
+		A a;
+		B b;
+
+		Subtract(A const& a_, B const& b_) : a(a_), b(b_) {}
+
+		float operator()(Vector3f const& v) const {
+			return std::min(a(v), -b(v));
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			Vector3f gb;
+			float fa = a(v, gradient), fb = -b(v, gb);
+			if(fb < fa) {
+				gradient = -gb;
+				return fb;
+			}
+			return fa;
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			return min(a.bound(v), -b.bound(v));
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			a.cache_key(h);
+			b.cache_key(h);
+		}
+	};
+
+	//Evaluates a at linear * v + offset, so linear and offset take points
+	//from world space into the space of a
+	template<typename A>
+	struct Transform {
+		A a;
+		Matrix3f linear;
+		Vector3f offset;
+
+		Transform(A const& a_, Matrix3f const& linear_, Vector3f const& offset_) :
+			a(a_), linear(linear_), offset(offset_) {}
+
+		float operator()(Vector3f const& v) const {
+			return a(Vector3f(linear * v + offset));
+		}
+
+		float operator()(Vector3f const& v, Vector3f& gradient) const {
+			Vector3f g;
+			float f = a(Vector3f(linear * v + offset), g);
+			gradient = linear.transpose() * g;
+			return f;
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			IntervalVector u;
+			for(int i=0; i<3; ++i) {
+				u[i] = Interval(offset[i]);
+				for(int j=0; j<3; ++j) {
+					if(linear(i,j) != 0) {
+						u[i] = u[i] + v[j] * linear(i,j);
+					}
+				}
+			}
+			return a.bound(u);
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			a.cache_key(h);
+			h.add(linear);
+			h.add(offset);
+		}
+	};
+
+	template<typename A, typename B>
+	Union<A, B> unite(A const& a, B const& b) {
+		return Union<A, B>(a, b);
+	}
+
+	template<typename A, typename B>
+	Intersect<A, B> intersect(A const& a, B const& b) {
+		return Intersect<A, B>(a, b);
+	}
+
+	template<typename A, typename B>
+	Subtract<A, B> subtract(A const& a, B const& b) {
+		return Subtract<A, B>(a, b);
+	}
+
+	//Applies linear to points before evaluating a
+	template<typename A>
+	Transform<A> transform(A const& a, Matrix3f const& linear) {
+		return Transform<A>(a, linear, Vector3f::Zero());
+	}
+
+	//Moves a by t
+	template<typename A>
+	Transform<A> translate(A const& a, Vector3f const& t) {
+		return Transform<A>(a, Matrix3f::Identity(), -t);
+	}
+
+	//Wraps a shape as a density function for setup_solid(), with constant
+	//friction
+	template<typename A>
+	struct Density {
+		A shape;
+		float friction;
+
+		Density(A const& shape_, float friction_) : shape(shape_), friction(friction_) {}
+
+		Cell operator()(Vector3f const& v) const {
+			Cell result;
+			result.density = shape(v);
+			result.friction = friction;
+			return result;
+		}
+
+		Interval bound(IntervalVector const& v) const {
+			return shape.bound(v);
+		}
+
+		Vector3f gradient(Vector3f const& v) const {
+			Vector3f g;
+			shape(v, g);
+			return g;
+		}
+
+		void cache_key(SolidCacheHash& h) const {
+			shape.cache_key(h);
+			h.add(friction);
+		}
+	};
+
+	template<typename A>
+	Density<A> density(A const& shape, float friction) {
+		return Density<A>(shape, friction);
+	}
+};
+
+#endif
@@ -0,0 +1,255 @@
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Core>
+#include <mesh/implementation/parallel.h>
+
+#include "distance_field.h"
+
+using namespace std;
+using namespace Eigen;
+using namespace Mesh::impl;
+
+//Distance of cells which haven't been reached yet
+static const float FAR_AWAY = 1e30f;
+
+//Godunov upwind update for |grad u| = 1, given the smallest neighbor value
+//m and the inverse squared spacing w along each axis
+static inline float eikonal_update(float m0, float m1, float m2, float w0, float w1, float w2) {
+	//Sort by neighbor value
+	if(m0 > m1) { swap(m0, m1); swap(w0, w1); }
+	if(m1 > m2) { swap(m1, m2); swap(w1, w2); }
+	if(m0 > m1) { swap(m0, m1); swap(w0, w1); }
+
+	float u = m0 + 1.f / sqrt(w0);
+	if(u <= m1) {
+		return u;
+	}
+	float	A = w0 + w1,
+			B = w0 * m0 + w1 * m1,
+			C = w0 * m0 * m0 + w1 * m1 * m1 - 1.f;
+	u = (B + sqrt(max(B*B - A*C, 0.f))) / A;
+	if(u <= m2) {
+		return u;
+	}
+	A += w2;
+	B += w2 * m2;
+	C += w2 * m2 * m2;
+	return (B + sqrt(max(B*B - A*C, 0.f))) / A;
+}
+
+//Solves for the unsigned distance in the cells [lo, hi).  The layer of cells
+//around the region keeps its current distance, or FAR_AWAY outside the grid.
+//On return u holds the distances (with that border) and value the densities
+//of the region.
+static void solve_region(
+	VoxelGrid const& density,
+	Array3f const& spacing,
+	VoxelGrid const& distance,
+	const int* lo,
+	const int* hi,
+	vector<float>& u,
+	vector<float>& value) {
+
+	const Vector3i res = density.resolution;
+	const Vector3i bres(hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]);
+	const int dy = bres[0], dz = bres[0] * bres[1];
+	const int n = bres[0] * bres[1] * bres[2];
+
+	//Distances are stored with a one cell border, so the sweeps don't need
+	//bounds checks
+	const int py = bres[0] + 2, pz = py * (bres[1] + 2);
+	value.assign(n, 0.f);
+	u.assign(pz * (bres[2] + 2), FAR_AWAY);
+	vector<char> fixed(u.size(), 0);
+
+	//Read densities
+	parallel_for(0, bres[2], [&](int k) {
+		int idx = k * dz;
+		for(int j=0; j<bres[1]; ++j)
+		for(int i=0; i<bres[0]; ++i) {
+			value[idx++] = density.density(lo[0] + i, lo[1] + j, lo[2] + k);
+		}
+	});
+
+	//Border cells inside the grid keep their old distance
+	for(int k=0; k<bres[2]+2; ++k)
+	for(int j=0; j<bres[1]+2; ++j)
+	for(int i=0; i<bres[0]+2; ++i) {
+		if(i > 0 && i <= bres[0] && j > 0 && j <= bres[1] && k > 0 && k <= bres[2]) {
+			continue;
+		}
+		const int x = lo[0] + i - 1, y = lo[1] + j - 1, z = lo[2] + k - 1;
+		if(x < 0 || x >= res[0] || y < 0 || y >= res[1] || z < 0 || z >= res[2]) {
+			continue;
+		}
+		const int pidx = i + py * j + pz * k;
+		u[pidx] = abs(distance.density(x, y, z));
+		fixed[pidx] = 1;
+	}
+
+	//Seed the cells next to a sign change with the distance to the linearly
+	//interpolated crossings along each axis.  These are never updated.
+	parallel_for(0, bres[2], [&](int k) {
+		int idx = k * dz;
+		for(int j=0; j<bres[1]; ++j)
+		for(int i=0; i<bres[0]; ++i, ++idx) {
+			const int c[3] = { i, j, k }, vstride[3] = { 1, dy, dz };
+			const float v = value[idx];
+			float w = 0.f;
+			bool on_surface = false;
+			for(int a=0; a<3; ++a) {
+				float da = FAR_AWAY;
+				for(int s=-1; s<=1; s+=2) {
+					int x = c[a] + s;
+					float vn;
+					if(x >= 0 && x < bres[a]) {
+						vn = value[idx + s * vstride[a]];
+					}
+					else {
+						int g[3] = { lo[0] + i, lo[1] + j, lo[2] + k };
+						g[a] += s;
+						vn = (g[a] < 0 || g[a] >= res[a]) ? -1000.f : density.density(g[0], g[1], g[2]);
+					}
+					if((v > 0) != (vn > 0)) {
+						da = min(da, spacing[a] * v / (v - vn));
+					}
+				}
+				if(da < FAR_AWAY) {
+					if(da <= 0.f) {
+						on_surface = true;
+					}
+					else {
+						w += 1.f / (da * da);
+					}
+				}
+			}
+			const int pidx = (i+1) + py * (j+1) + pz * (k+1);
+			if(on_surface) {
+				u[pidx] = 0.f;
+				fixed[pidx] = 1;
+			}
+			else if(w > 0.f) {
+				u[pidx] = 1.f / sqrt(w);
+				fixed[pidx] = 1;
+			}
+		}
+	});
+
+	//Sweep in all 8 diagonal directions until nothing changes
+	const float	w0 = 1.f / (spacing[0] * spacing[0]),
+				w1 = 1.f / (spacing[1] * spacing[1]),
+				w2 = 1.f / (spacing[2] * spacing[2]);
+	const int planes = bres[0] + bres[1] + bres[2] - 2;
+	const float tolerance = 1e-2f * spacing.minCoeff();
+	vector<char> changed(bres[2]);
+	for(int round=0; round<4; ++round) {
+		fill(changed.begin(), changed.end(), 0);
+
+		for(int dir=0; dir<8; ++dir) {
+			const bool flip[3] = { (dir&1) != 0, (dir&2) != 0, (dir&4) != 0 };
+			for(int p=0; p<planes; ++p) {
+				const int c_lo = max(0, p - (bres[0]-1) - (bres[1]-1)),
+						  c_hi = min(bres[2]-1, p);
+				parallel_for(c_lo, c_hi+1, [&](int c) {
+					const int k = flip[2] ? bres[2]-1-c : c;
+					const int b_lo = max(0, p - c - (bres[0]-1)),
+							  b_hi = min(bres[1]-1, p - c);
+					bool row_changed = false;
+					for(int b=b_lo; b<=b_hi; ++b) {
+						const int a = p - c - b;
+						const int i = flip[0] ? bres[0]-1-a : a,
+								  j = flip[1] ? bres[1]-1-b : b;
+						const int x = (i+1) + py * (j+1) + pz * (k+1);
+						if(fixed[x]) {
+							continue;
+						}
+						const float	m0 = min(u[x-1],  u[x+1]),
+									m1 = min(u[x-py], u[x+py]),
+									m2 = min(u[x-pz], u[x+pz]);
+						if(min(m0, min(m1, m2)) >= FAR_AWAY) {
+							continue;
+						}
+						const float t = eikonal_update(m0, m1, m2, w0, w1, w2);
+						if(t < u[x] - tolerance) {
+							u[x] = t;
+							row_changed = true;
+						}
+						else if(t < u[x]) {
+							u[x] = t;
+						}
+					}
+					if(row_changed) {
+						changed[k] = 1;
+					}
+				}, 4);
+			}
+		}
+
+		if(find(changed.begin(), changed.end(), 1) == changed.end()) {
+			break;
+		}
+	}
+}
+
+void compute_distance_field(
+	VoxelGrid const& density,
+	Array3f const& spacing,
+	VoxelGrid& distance) {
+
+	const Vector3i res = density.resolution;
+	const int lo[3] = { 0, 0, 0 }, hi[3] = { res[0], res[1], res[2] };
+	vector<float> u, value;
+	solve_region(density, spacing, distance, lo, hi, u, value);
+
+	//Cells which never saw the surface get the size of the grid
+	const int dy = res[0], dz = res[0] * res[1];
+	const int py = res[0] + 2, pz = py * (res[1] + 2);
+	const float far_distance = (spacing * res.cast<float>().array()).matrix().norm();
+	distance.fill_cells([&](int i, int j, int k) {
+		Cell c;
+		c.density = min(u[(i+1) + py * (j+1) + pz * (k+1)], far_distance);
+		if(!(value[i + dy * j + dz * k] > 0)) {
+			c.density = -c.density;
+		}
+		c.friction = 0.f;
+		return c;
+	}, VoxelGrid::COLLAPSE_NEAREST);
+	distance.drop_friction(0.f);
+}
+
+void update_distance_field(
+	VoxelGrid const& density,
+	Array3f const& spacing,
+	VoxelGrid& distance,
+	const int* lo,
+	const int* hi) {
+
+	const Vector3i res = density.resolution;
+	int rlo[3], rhi[3];
+	for(int a=0; a<3; ++a) {
+		rlo[a] = max(lo[a], 0);
+		rhi[a] = min(hi[a], res[a]);
+		if(rlo[a] >= rhi[a]) {
+			return;
+		}
+	}
+	vector<float> u, value;
+	solve_region(density, spacing, distance, rlo, rhi, u, value);
+
+	const int dy = rhi[0] - rlo[0], dz = dy * (rhi[1] - rlo[1]);
+	const int py = dy + 2, pz = py * (rhi[1] - rlo[1] + 2);
+	const float far_distance = (spacing * res.cast<float>().array()).matrix().norm();
+	distance.refill_cells([&](int i, int j, int k) {
+		i -= rlo[0];
+		j -= rlo[1];
+		k -= rlo[2];
+		Cell c;
+		c.density = min(u[(i+1) + py * (j+1) + pz * (k+1)], far_distance);
+		if(!(value[i + dy * j + dz * k] > 0)) {
+			c.density = -c.density;
+		}
+		c.friction = 0.f;
+		return c;
+	}, rlo, rhi);
+}
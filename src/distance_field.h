@@ -0,0 +1,31 @@
+#ifndef DISTANCE_FIELD_H
+#define DISTANCE_FIELD_H
+
+#include <Eigen/Core>
+
+#include "voxels.h"
+
+//Converts the densities of a grid into a signed distance field, positive
+//inside, in the same units as spacing (the size of one cell along each axis).
+//Samples outside the grid count as empty space.
+//
+//Solved with the fast sweeping method.  Each sweep walks the grid in planes
+//of constant i+j+k, whose cells don't depend on each other, so the planes are
+//updated in parallel and the result doesn't depend on the number of threads.
+void compute_distance_field(
+	VoxelGrid const& density,
+	Eigen::Array3f const& spacing,
+	VoxelGrid& distance);
+
+//Recomputes an existing distance field in the cells [lo, hi) only, after the
+//densities there have changed.  The cells around the region keep their old
+//distances and act as boundary values, so distances which should change
+//outside the region (or which only reach it through the outside) go stale.
+void update_distance_field(
+	VoxelGrid const& density,
+	Eigen::Array3f const& spacing,
+	VoxelGrid& distance,
+	const int* lo,
+	const int* hi);
+
+#endif
@@ -305,15 +305,53 @@ void ObstacleEntity::draw() {
 bool ObstacleEntity::process_collision(Particle* part, float dt) {
 
 	auto tinv = transform.inverse();
-	auto npos = tinv * part->center();
-	auto grad = (transform.linear() * model->gradient(npos)).normalized();
+	Vector3f npos = tinv * part->center();
 	
-	if((*model)(npos) > -1e-6) {
+	//World space direction into the model.  Deep inside, the density of a
+	//culled block is flat and has no gradient, so head for the middle.
+	auto inward = [&](Vector3f const& g) -> Vector3f {
+		Vector3f w = transform.linear() * g;
+		if(w.squaredNorm() < 1e-12f) {
+			w = transform.translation() - part->center();
+		}
+		return w.squaredNorm() > 0.f ? Vector3f(w.normalized()) : Vector3f::UnitY();
+	};
+	
+	//With a distance field, one lookup tells us how far the particle is
+	if(model->has_distance_field()) {
+		Vector3f grad;
+		float dist = model->distance(npos, &grad);
+		grad = inward(grad);
+		float radius = part->radius * (tinv.linear() * grad).norm();
+		
+		if(dist > -1e-6) {
+			part->apply_force(-grad * 100.0);
+			play_sound_from_group(SOUND_GROUP_BOUNCE);
+			return true;
+		}
+		else if(dist > -radius) {
+			float d = part->velocity.dot(grad);
+			if( d > 0 ) {
+				part->apply_force(-grad * part->velocity.dot(grad) * 2. / dt);
+				play_sound_from_group(SOUND_GROUP_BOUNCE);
+			}
+			return true;
+		}
+		return false;
+	}
+	
+	//Fetch density and gradient together
+	float density;
+	Vector3f grad;
+	model->sample(npos, &density, &grad, NULL);
+	grad = inward(grad);
+	
+	if(density > -1e-6) {
 		part->apply_force(-grad * 100.0);
 		play_sound_from_group(SOUND_GROUP_BOUNCE);
 		return true;
 	} else {	
-		auto spos = tinv * (part->coordinate.position + grad * part->radius);	
+		Vector3f spos = tinv * (part->coordinate.position + grad * part->radius);	
 		if((*model)(spos) > 0) {
 			float d = part->velocity.dot(grad);
 			if( d > 0 ) {
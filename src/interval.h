@@ -0,0 +1,174 @@
+#ifndef INTERVAL_H
+#define INTERVAL_H
+
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Core>
+
+//A closed range of floats, for bounding a function over a box.  Operations
+//return a range containing every possible result, though not always the
+//smallest one.
+struct Interval {
+	float lo, hi;
+
+	Interval() : lo(0.f), hi(0.f) {}
+	explicit Interval(float x) : lo(x), hi(x) {}
+	Interval(float lo_, float hi_) : lo(lo_), hi(hi_) {}
+
+	bool contains(float x) const {
+		return lo <= x && x <= hi;
+	}
+};
+
+inline Interval operator-(Interval const& a) {
+	return Interval(-a.hi, -a.lo);
+}
+inline Interval operator+(Interval const& a, Interval const& b) {
+	return Interval(a.lo + b.lo, a.hi + b.hi);
+}
+inline Interval operator-(Interval const& a, Interval const& b) {
+	return Interval(a.lo - b.hi, a.hi - b.lo);
+}
+inline Interval operator*(Interval const& a, Interval const& b) {
+	float	p0 = a.lo * b.lo, p1 = a.lo * b.hi,
+			p2 = a.hi * b.lo, p3 = a.hi * b.hi;
+	return Interval(
+		std::min(std::min(p0, p1), std::min(p2, p3)),
+		std::max(std::max(p0, p1), std::max(p2, p3)));
+}
+inline Interval operator+(Interval const& a, float s) {
+	return Interval(a.lo + s, a.hi + s);
+}
+inline Interval operator+(float s, Interval const& a) {
+	return a + s;
+}
+inline Interval operator-(Interval const& a, float s) {
+	return Interval(a.lo - s, a.hi - s);
+}
+inline Interval operator-(float s, Interval const& a) {
+	return Interval(s - a.hi, s - a.lo);
+}
+inline Interval operator*(Interval const& a, float s) {
+	return s >= 0 ? Interval(a.lo * s, a.hi * s) : Interval(a.hi * s, a.lo * s);
+}
+inline Interval operator*(float s, Interval const& a) {
+	return a * s;
+}
+inline Interval operator/(Interval const& a, float s) {
+	return a * (1.f / s);
+}
+
+inline Interval sqr(Interval const& a) {
+	if(a.lo >= 0) {
+		return Interval(a.lo * a.lo, a.hi * a.hi);
+	}
+	if(a.hi <= 0) {
+		return Interval(a.hi * a.hi, a.lo * a.lo);
+	}
+	return Interval(0.f, std::max(a.lo * a.lo, a.hi * a.hi));
+}
+
+inline Interval sqrt(Interval const& a) {
+	return Interval(std::sqrt(std::max(a.lo, 0.f)), std::sqrt(std::max(a.hi, 0.f)));
+}
+
+inline Interval abs(Interval const& a) {
+	if(a.lo >= 0) {
+		return a;
+	}
+	if(a.hi <= 0) {
+		return -a;
+	}
+	return Interval(0.f, std::max(-a.lo, a.hi));
+}
+
+inline Interval cos(Interval const& a) {
+	if(a.hi - a.lo >= 2.f * M_PI) {
+		return Interval(-1.f, 1.f);
+	}
+	float	c0 = std::cos(a.lo),
+			c1 = std::cos(a.hi);
+	Interval r(std::min(c0, c1), std::max(c0, c1));
+
+	//Maxima at 2 pi n, minima at pi + 2 pi n
+	if(std::floor(a.hi / (2.f * M_PI)) > std::floor(a.lo / (2.f * M_PI))) {
+		r.hi = 1.f;
+	}
+	if(std::floor((a.hi - M_PI) / (2.f * M_PI)) > std::floor((a.lo - M_PI) / (2.f * M_PI))) {
+		r.lo = -1.f;
+	}
+	return r;
+}
+
+inline Interval min(Interval const& a, Interval const& b) {
+	return Interval(std::min(a.lo, b.lo), std::min(a.hi, b.hi));
+}
+inline Interval max(Interval const& a, Interval const& b) {
+	return Interval(std::max(a.lo, b.lo), std::max(a.hi, b.hi));
+}
+
+//Smallest interval containing both
+inline Interval hull(Interval const& a, Interval const& b) {
+	return Interval(std::min(a.lo, b.lo), std::max(a.hi, b.hi));
+}
+
+//An axis aligned box, as one interval per coordinate
+struct IntervalVector {
+	Interval v[3];
+
+	IntervalVector() {}
+	IntervalVector(Interval const& x, Interval const& y, Interval const& z) {
+		v[0] = x;
+		v[1] = y;
+		v[2] = z;
+	}
+	IntervalVector(Eigen::Vector3f const& lo, Eigen::Vector3f const& hi) {
+		for(int i=0; i<3; ++i) {
+			v[i] = Interval(lo[i], hi[i]);
+		}
+	}
+
+	Interval& operator[](int i)				{ return v[i]; }
+	Interval const& operator[](int i) const	{ return v[i]; }
+
+	Eigen::Vector3f center() const {
+		return Eigen::Vector3f(
+			0.5f * (v[0].lo + v[0].hi),
+			0.5f * (v[1].lo + v[1].hi),
+			0.5f * (v[2].lo + v[2].hi));
+	}
+};
+
+inline IntervalVector operator*(IntervalVector const& a, float s) {
+	return IntervalVector(a[0] * s, a[1] * s, a[2] * s);
+}
+inline IntervalVector operator/(IntervalVector const& a, float s) {
+	return a * (1.f / s);
+}
+
+inline Interval dot(IntervalVector const& a, Eigen::Vector3f const& b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+inline Interval squared_norm(IntervalVector const& a) {
+	return sqr(a[0]) + sqr(a[1]) + sqr(a[2]);
+}
+
+//Squared distance from the line through the origin along (unit) axis.  Each
+//component is written so every coordinate appears once, which keeps the
+//bound tight.
+inline Interval squared_distance_to_axis(IntervalVector const& a, Eigen::Vector3f const& axis) {
+	Interval r(0.f);
+	for(int i=0; i<3; ++i) {
+		Interval w = a[i] * (1.f - axis[i] * axis[i]);
+		for(int j=0; j<3; ++j) {
+			if(j != i) {
+				w = w - a[j] * (axis[i] * axis[j]);
+			}
+		}
+		r = r + sqr(w);
+	}
+	return r;
+}
+
+#endif
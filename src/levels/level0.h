@@ -7,16 +7,23 @@ struct Level0Solid {
 		result.friction = 1.0/4.0;
 		return result;
 	}
+	
+	Interval bound(IntervalVector const& v) const {
+		return sphere(v, 50.f);
+	}
 };
 
 struct Level0Attr {
 	Vertex operator()(Eigen::Vector3f const& v) const {
 		using namespace Eigen;
 		
+		PointRandom random(v[0], v[1], v[2]);
+		const float a = random.uniform(), b = random.uniform();
+		
 		Vertex result;
 		result.position = v;
 		result.normal = Vector3f(1, 0, 0);
-		result.color = Vector3f(0.2,0.2,0.8)*drand48() + Vector3f(1, 1, 0) * drand48();
+		result.color = Vector3f(0.2,0.2,0.8)*a + Vector3f(1, 1, 0)*b;
 		return result;
 	}
 };
@@ -32,7 +39,8 @@ struct Level0 : public PuzzleGenerator {
 		auto level = new Solid(
 			Vector3i( 128, 128, 128 ),
 			Vector3f(-8, -8, -8),
-			Vector3f( 8,  8,  8));
+			Vector3f( 8,  8,  8),
+			SOLID_SPARSE | SOLID_DISTANCE_FIELD | SOLID_LOD | SOLID_NO_ISLANDS);
 		Level0Solid	level_func;
 		Level0Attr	attr_func;
 		setup_solid(*level, level_func, attr_func);
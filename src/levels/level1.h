@@ -1,29 +1,13 @@
-struct Level1Solid {
-	Cell operator()(Eigen::Vector3f v) const {
-		using namespace Eigen;
-		
-		Cell result;
-		result.density = 
-		result.density = 
-		min(-box(Vector3f(v[0], v[1] + 34, v[2]), 6, 6, 6),
-		max(torus(Vector3f(v[0], v[1] - 18, v[2]), 16, 16),
-		max(torus(Vector3f(v[0], v[1] + 18, v[2]), 16, 16),
-		torus(Vector3f(v[2], v[1], v[0]), 16, 16))));
-		//float val = 2 - sqrt(v[0] * v[0] + v[1] * v[1]);
-		//result.density = val * val + v[2] * v[2] - 64;
-		result.friction = 1.0/4.0;
-		return result;
-	}
-};
-
 struct Level1Attr {
 	Vertex operator()(Eigen::Vector3f const& v) const {
 		using namespace Eigen;
 		
+		PointRandom random(v[0], v[1], v[2]);
+		
 		Vertex result;
 		result.position = v;
 		result.normal = Vector3f(1, 0, 0);
-		result.color = Vector3f(0.2,0.2,0.2)*drand48();
+		result.color = Vector3f(0.2,0.2,0.2)*random.uniform();
 		return result;
 	}
 };
@@ -35,12 +19,26 @@ struct Level1 : public PuzzleGenerator {
 	virtual void setup(Puzzle* puzzle) {
 		using namespace Eigen;
 		
-		//Create geometry
+		//Create geometry.  The creases where the rings meet stay sharp with
+		//dual contouring, so half the resolution is enough.
 		auto level = new Solid(
-			Vector3i( 64,  256,  64),
+			Vector3i( 32,  128,  32),
 			Vector3f(-22, -50, -22),
-			Vector3f( 22,  50,  22));
-		Level1Solid	level_func;
+			Vector3f( 22,  50,  22),
+			SOLID_SPARSE | SOLID_DISTANCE_FIELD | SOLID_SHARP_FEATURES);
+		//Three rings, with a box cut out of the bottom one for the teleporter
+		using namespace CSG;
+		Matrix3f swap_xz;
+		swap_xz << 0, 0, 1,
+		           0, 1, 0,
+		           1, 0, 0;
+		auto level_func = density(
+			subtract(
+				unite(translate(Torus(16, 16), Vector3f(0,  18, 0)),
+				unite(translate(Torus(16, 16), Vector3f(0, -18, 0)),
+				      transform(Torus(16, 16), swap_xz))),
+				translate(Box(6, 6, 6), Vector3f(0, -34, 0))),
+			1.0/4.0);
 		Level1Attr	attr_func;
 		setup_solid(*level, level_func, attr_func);
 		
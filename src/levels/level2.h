@@ -43,7 +43,8 @@ struct Level2 : public PuzzleGenerator {
 		auto level = new Solid(
 			Vector3i( 128, 128, 128 ),
 			Vector3f(-30, -30, -30),
-			Vector3f( 30. +60./128., 30.+60./128., 30.+60./128.));
+			Vector3f( 30. +60./128., 30.+60./128., 30.+60./128.),
+			SOLID_DISTANCE_FIELD | SOLID_LOD | SOLID_NO_ISLANDS);
 		Level2Solid	level_func;
 		Level2Attr	attr_func;
 		setup_solid(*level, level_func, attr_func);
@@ -9,6 +9,11 @@ struct Level3Solid {
 		result.friction = 1.0/4.0;
 		return result;
 	}
+	
+	Interval bound(IntervalVector const& v) const {
+		IntervalVector u = v / 3.;
+		return -20*(cos(u[0]) + cos(u[1]) + cos(u[2])) + sphere(u, (M_PI*M_PI));
+	}
 };
 
 struct Level3Attr {
@@ -45,7 +50,8 @@ struct Level3 : public PuzzleGenerator {
 		auto level = new Solid(
 			Vector3i( 128, 128, 128 ),
 			Vector3f(-20, -20, -20),
-			Vector3f( 20,  20,  20));
+			Vector3f( 20,  20,  20),
+			SOLID_SPARSE | SOLID_DISTANCE_FIELD | SOLID_LOD | SOLID_NO_ISLANDS);
 		Level3Solid	level_func;
 		Level3Attr	attr_func;
 		setup_solid(*level, level_func, attr_func);
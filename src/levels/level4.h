@@ -9,6 +9,10 @@ struct Level4Solid0 {
 		
 		return result;
 	}
+	
+	Interval bound(IntervalVector const& v) const {
+		return torus(v, 20, 5*5);
+	}
 };
 
 struct Level4Attr0 {
@@ -20,10 +24,12 @@ struct Level4Attr0 {
 		
 		float t = v[2] + simplexNoise3D(v[0] * 0.1, v[1] *0.1,  v[2]*0.1, 2);
 		
+		PointRandom random(v[0], v[1], v[2]);
 		if(t > 0) {
 			result.color = Vector3f(132, 90, 40)/255.;
-		} else if(drand48() < 0.05) {
-			result.color = Vector3f(drand48(), drand48(), drand48());
+		} else if(random.uniform() < 0.05) {
+			const float r = random.uniform(), g = random.uniform(), b = random.uniform();
+			result.color = Vector3f(r, g, b);
 		} else {
 			result.color = Vector3f(1, 1, 1);
 		}
@@ -43,6 +49,10 @@ struct Level4Solid1 {
 		
 		return result;
 	}
+	
+	Interval bound(IntervalVector const& v) const {
+		return sphere(v, 12*12);
+	}
 };
 
 struct Level4Attr1 {
@@ -78,7 +88,8 @@ struct Level4 : public PuzzleGenerator {
 		auto part0 = new Solid(
 			Vector3i( 128, 128, 32 ),
 			Vector3f(-30, -30, -8),
-			Vector3f( 30,  30,  8));
+			Vector3f( 30,  30,  8),
+			SOLID_SPARSE | SOLID_DISTANCE_FIELD);
 		{
 			Level4Solid0	level_func;
 			Level4Attr0		attr_func;
@@ -92,7 +103,8 @@ struct Level4 : public PuzzleGenerator {
 		auto part1 = new Solid(
 			Vector3i( 64, 64, 64 ),
 			Vector3f(-13, -13, -13),
-			Vector3f( 13, 13, 13));
+			Vector3f( 13, 13, 13),
+			SOLID_DISTANCE_FIELD);
 		{
 			Level4Solid1	level_func;
 			Level4Attr1		attr_func;
@@ -7,6 +7,10 @@ struct LevelXXXSolid {
 		result.friction = 1.0/4.0;
 		return result;
 	}
+	
+	Interval bound(IntervalVector const& v) const {
+		return sphere(v, 50.f);
+	}
 };
 
 struct LevelXXXAttr {
@@ -32,7 +36,8 @@ struct LevelTemplate : public PuzzleGenerator {
 		auto level = new Solid(
 			Vector3i( 128, 128, 128 ),
 			Vector3f(-8, -8, -8),
-			Vector3f( 8,  8,  8));
+			Vector3f( 8,  8,  8),
+			SOLID_SPARSE | SOLID_DISTANCE_FIELD | SOLID_NO_ISLANDS);
 		LevelXXXSolid	level_func;
 		LevelXXXAttr	attr_func;
 		setup_solid(*level, level_func, attr_func);
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <cmath>
 #include <GL/glfw.h>
 
@@ -9,6 +10,7 @@
 #include <mesh/mesh.h>
 
 #include "solid.h"
+#include "solid_cache.h"
 #include "surface_coordinate.h"
 #include "particle.h"
 #include "player.h"
@@ -359,8 +361,15 @@ int main(int argc, char* argv[])
 		return -1;
 	}
 	
-	if(argc > 1) {
-		App::start_level = atoi(argv[1]);
+	//Arguments: an optional level to start on, and --no-cache to always
+	//generate solids rather than load them from cache/
+	for(int i=1; i<argc; ++i) {
+		if(strcmp(argv[i], "--no-cache") == 0) {
+			set_solid_cache_enabled(false);
+		}
+		else {
+			App::start_level = atoi(argv[i]);
+		}
 	}
 	
     glfwSetWindowTitle("Help!  I'm stuck in a compact 2D Riemannian manifold!");
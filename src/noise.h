@@ -2,6 +2,7 @@
 #define NOISE_H
 
 #include <stdint.h>
+#include <string.h>
 
 void setNoiseSeed(int64_t);
 
@@ -12,4 +13,34 @@ float simplexNoise3D(float xin, float yin, float zin, int64_t octaves);
 int32_t pseudorand(int32_t a);
 int64_t pseudorand_var(int64_t i, ...);
 
+//Random numbers which only depend on a point.  Vertex styles are evaluated
+//from several threads at once and cached, so they use this instead of
+//drand48(): the same vertex always gets the same colors.
+struct PointRandom {
+	uint64_t state;
+
+	PointRandom(float x, float y, float z) : state(0) {
+		const float p[3] = { x, y, z };
+		for(int i=0; i<3; ++i) {
+			uint32_t bits;
+			memcpy(&bits, &p[i], sizeof(bits));
+			state = mix(state ^ bits);
+		}
+	}
+
+	//Uniform in [0, 1)
+	float uniform() {
+		state += 0x9e3779b97f4a7c15ULL;
+		return (mix(state) >> 40) * (1.f / 16777216.f);
+	}
+
+private:
+	//Finalizer of splitmix64
+	static uint64_t mix(uint64_t z) {
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+};
+
 #endif
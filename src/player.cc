@@ -97,28 +97,60 @@ void clip_camera(
 	
 
 	auto tinv = transform.inverse();
-	auto q = tinv * local_position;
-	auto p = tinv * camera_position;
+	Vector3f q = tinv * local_position;
+	Vector3f p = tinv * camera_position;
 	
-	float lo=0, hi=1.0, m;
-	for(hi=0.05; hi<=1.0; hi+=1./32.) {
-		auto x = q*(1.-hi) + p*hi;
-		if( (*s)(x) > -1e-6 ) {
-			break;
+	float m = 1.f;
+	if(s->has_distance_field()) {
+		//Sphere trace along the ray.  Only a hit pulls the camera in; running
+		//out of steps on a grazing ray leaves it where it is, as the march
+		//does when it finds nothing.
+		const float len = (p - q).norm();
+		const float eps = 1e-3f / s->scale.maxCoeff();
+		float t = 0.05;
+		for(int i=0; i<32 && t<1.f; ++i) {
+			float d = s->distance(q*(1.-t) + p*t);
+			if(d > -eps) {
+				m = t;
+				break;
+			}
+			t += -d / len;
 		}
 	}
-	
-	hi = min(hi, 1.f);
-	
-	while(abs(lo - hi) > 1e-6) {
-		m = 0.5 * (lo + hi);
+	else {
+		//March along the ray with one batched lookup
+		const int max_steps = 32;
+		float t[max_steps], x[max_steps], y[max_steps], z[max_steps], f[max_steps];
+		int n = 0;
+		for(float h=0.05; h<=1.0; h+=1./32.) {
+			Vector3f v = q*(1.-h) + p*h;
+			t[n] = h;
+			x[n] = v[0];
+			y[n] = v[1];
+			z[n] = v[2];
+			++n;
+		}
+		s->sample(n, x, y, z, f, NULL, NULL, NULL, NULL);
 		
-		auto x = q*(1.-m) + p*m;
-		if( (*s)(x) > -1e-6 ) {
-			hi = m;
+		float lo=0, hi=1.0;
+		int i;
+		for(i=0; i<n; ++i) {
+			if( f[i] > -1e-6 ) {
+				break;
+			}
 		}
-		else {
-			lo = m;
+		hi = (i < n) ? t[i] : 1.f;
+		
+		while(abs(lo - hi) > 1e-6) {
+			m = 0.5 * (lo + hi);
+			
+			Vector3f x = q*(1.-m) + p*m;
+			if( (*s)(x) > -1e-6 ) {
+				hi = m;
+			}
+			else {
+				lo = m;
+			}
 		}
 	}
 	
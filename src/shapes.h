@@ -1,59 +1,72 @@
+//The basic shapes, as plain functions.  These are evaluated by the CSG
+//primitives in csg.h, which can also be combined without building any
+//temporaries.
+
 float torus(Vector3f const& v, float radius, float ringrad2)
 {
-	float val = radius - sqrt(v[0] * v[0] + v[1] * v[1]);
-	return -(val * val + v[2] * v[2] - ringrad2);
+	return CSG::Torus(radius, ringrad2)(v);
 }
 
 float sphere(Vector3f const& v, float rad2)
 {
-	return rad2 - v.dot(v);
+	return CSG::Sphere(rad2)(v);
 }
 
 float cylinder(Vector3f const& v, Vector3f const& axis, float rad2) {
-	return rad2 - (v - axis*v.dot(axis)).squaredNorm();
+	return CSG::Cylinder(axis, rad2)(v);
 }
 
 float cone(Vector3f const& v, 
 	Vector3f const& axis, 
 	float rad2) {
-	
-	float a = axis.dot(v);
-	float b = (v - axis * a).squaredNorm();
-
-	return a*a*rad2 - b;
+	return CSG::Cone(axis, rad2)(v);
 }
 
 float box(Vector3f const& v, float width, float height, float depth)
 {
-	if(v[0] > -width && v[0] < width && v[1] > -height && v[1] < height && v[2] > -depth && v[2] < depth)
-		return 1;
-	
-	return -1;
+	return CSG::Box(width, height, depth)(v);
 }
 
 float bicone(Vector3f const& v, 
 	Vector3f const& axis, 
 	float rad2, 
 	float len) {
-	
-	float a = axis.dot(v);
-	float b = (v - axis * a).squaredNorm();
+	return CSG::Bicone(axis, rad2, len)(v);
+}
 
-	a = len - abs(a);
-	if(a < 0) {
-		return -1e10;
-	}
 
-	return a*a*rad2 - b;
+//Interval versions of the shapes above.  Each one bounds the shape over a box.
+
+Interval torus(IntervalVector const& v, float radius, float ringrad2)
+{
+	return CSG::Torus(radius, ringrad2).bound(v);
 }
 
+Interval sphere(IntervalVector const& v, float rad2)
+{
+	return CSG::Sphere(rad2).bound(v);
+}
 
-float max_list(vector<float> const& l) {
-	float m = -1e20;
-	for(int i=0; i<l.size(); ++i) {
-		m = max(m, l[i]);
-	}
-	return m;
+Interval cylinder(IntervalVector const& v, Vector3f const& axis, float rad2) {
+	return CSG::Cylinder(axis, rad2).bound(v);
+}
+
+Interval cone(IntervalVector const& v, 
+	Vector3f const& axis, 
+	float rad2) {
+	return CSG::Cone(axis, rad2).bound(v);
+}
+
+Interval box(IntervalVector const& v, float width, float height, float depth)
+{
+	return CSG::Box(width, height, depth).bound(v);
+}
+
+Interval bicone(IntervalVector const& v, 
+	Vector3f const& axis, 
+	float rad2, 
+	float len) {
+	return CSG::Bicone(axis, rad2, len).bound(v);
 }
 
 
@@ -1,59 +1,965 @@
 #include <stddef.h>
+#include <cstdio>
 #include <iostream>
 #include <cmath>
 #include <cassert>
+#include <vector>
+#include <algorithm>
+#include <functional>
 #include <Eigen/Core>
 #include <GL/glfw.h>
 #include <mesh/mesh.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "solid.h"
+#include "distance_field.h"
 #include "surface_coordinate.h"
 
 using namespace std;
 using namespace Eigen;
 using namespace Mesh;
+using namespace Mesh::impl;
 
-//Rebuilds the display list
+//Rebuilds the display lists
 void Solid::setup_data() {
-	//Grab buffers
-	const Vertex *vbuffer;
-	const int *ibuffer;
-	int vcount, icount;
-	mesh.get_buffers(
-		&vbuffer,
-		&vcount,
-		&ibuffer,
-		&icount);
+	//Sort triangles into chunks
+	const Vector3i cres = chunk_resolution();
+	free_display_lists();
+	display_lists.assign(cres[0] * cres[1] * cres[2], 0);
+	chunk_triangles.assign(display_lists.size(), vector<int>());
+	triangle_chunk.resize(mesh.triangles().size());
+	for(int t=0; t<mesh.triangles().size(); ++t) {
+		auto tri = mesh.triangle(t);
+		int c = chunk_of((mesh.vertex(tri.v[0]).position +
+						  mesh.vertex(tri.v[1]).position +
+						  mesh.vertex(tri.v[2]).position) / 3.f);
+		triangle_chunk[t] = c;
+		chunk_triangles[c].push_back(t);
+	}
+	
+	//Generate display lists
+	vector<int> chunks;
+	for(int c=0; c<chunk_triangles.size(); ++c) {
+		if(chunk_triangles[c].size() > 0) {
+			chunks.push_back(c);
+		}
+	}
+	compile_chunks(chunks);
+	
+	cell_vertex.clear();
+	free_vertices.clear();
+
+	//Update mass
+	float J = 1.0 / (scale[0]*scale[1]*scale[2]);
+	mass = J * voxels.positive_density_sum();
+}
+
+void Solid::optimize_mesh() {
+#ifdef REPORT_MESH_STATS
+	const CacheStatistics before = cache_statistics(mesh);
+#endif
+	
+	vector<int> order;
+	optimize_mesh_order(mesh, &order);
+	if(vertex_cells.size() > 0) {
+		vector<Vector3i> cells(order.size());
+		for(int v=0; v<order.size(); ++v) {
+			cells[v] = vertex_cells[order[v]];
+		}
+		vertex_cells.swap(cells);
+	}
+	
+#ifdef REPORT_MESH_STATS
+	const CacheStatistics after = cache_statistics(mesh);
+	fprintf(stderr, "mesh: %d vertices, %d triangles, ACMR %.3f -> %.3f, CPU cache misses %d -> %d\n",
+		(int)mesh.vertices().size(), (int)mesh.triangles().size(),
+		before.acmr, after.acmr, before.cpu_misses, after.cpu_misses);
+#endif
+}
+
+//Chunks cover the contour lattice, which has a one cell border around the grid
+Vector3i Solid::chunk_resolution() const {
+	Vector3i r;
+	for(int i=0; i<3; ++i) {
+		r[i] = (resolution[i] + 2 + (1 << CHUNK_SHIFT) - 1) >> CHUNK_SHIFT;
+	}
+	return r;
+}
+
+int Solid::chunk_of(Vector3f const& p) const {
+	const Vector3i cres = chunk_resolution();
+	int c[3];
+	for(int i=0; i<3; ++i) {
+		int x = floor((p[i] - lower_bound[i]) * scale[i]) + 1;
+		c[i] = max(0, min(cres[i] - 1, x >> CHUNK_SHIFT));
+	}
+	return c[0] + cres[0] * (c[1] + cres[1] * c[2]);
+}
+
+//Middle of the contour lattice, which has a one cell border around the grid
+Vector3f Solid::render_origin() const {
+	return (lower_bound + upper_bound) / 2.f;
+}
+
+//One step covers the longest side of the contour lattice in 16 bits, with
+//some room for vertices clamped to its faces
+float Solid::render_step() const {
+	const Array3f extent = (upper_bound - lower_bound).array() *
+		(resolution.array() + 2).cast<float>() / resolution.array().cast<float>();
+	return extent.maxCoeff() / 65000.f;
+}
+
+RenderVertex Solid::render_vertex(Vertex const& v) const {
+	const Vector3f p = (v.position - render_origin()) / render_step();
+	const float len = v.normal.norm();
+	const Vector3f n = len > 0 ? Vector3f(v.normal / len) : Vector3f(0, 0, 0);
+	RenderVertex r;
+	for(int i=0; i<3; ++i) {
+		r.position[i] = (int16_t)max(-32767.f, min(32767.f, floor(p[i] + 0.5f)));
+		r.normal[i] = (int8_t)floor(n[i] * 127.f + 0.5f);
+	}
+	r.position[3] = 0;
+	r.normal[3] = 0;
+	r.color = v.color;
+	return r;
+}
+
+//Recompiles the display lists of some chunks, and their levels of detail
+void Solid::compile_chunks(vector<int> chunks) {
+	sort(chunks.begin(), chunks.end());
+	chunks.erase(unique(chunks.begin(), chunks.end()), chunks.end());
+	
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	
+	vector<int> local(mesh.vertices().size(), -1);
+	for(int i=0; i<chunks.size(); ++i) {
+		const int c = chunks[i];
+		if(display_lists[c]) {
+			glDeleteLists(display_lists[c], 1);
+			display_lists[c] = 0;
+		}
+		if(chunk_triangles[c].size() > 0) {
+			display_lists[c] = compile_list(mesh, chunk_triangles[c], local);
+		}
+	}
+	
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	
+	if(lod_errors.size() > 0) {
+		compile_lods(chunks);
+	}
+}
+
+//Simplifies each of the chunks on its own, all of the levels in one go,
+//then compiles the results.  The chunks must be sorted.
+void Solid::compile_lods(vector<int> const& chunks) {
+	const int levels = lod_errors.size();
+	lod_lists.resize(levels);
+	for(int l=0; l<levels; ++l) {
+		lod_lists[l].resize(display_lists.size(), 0);
+		for(int i=0; i<chunks.size(); ++i) {
+			GLuint& list = lod_lists[l][chunks[i]];
+			if(list) {
+				glDeleteLists(list, 1);
+				list = 0;
+			}
+		}
+	}
+	
+	const float cell = scale.inverse().minCoeff();
+	vector< vector<SolidMesh> > pieces(chunks.size(), vector<SolidMesh>(levels));
+	parallel_for(0, chunks.size(), [&](int i) {
+		vector<int> const& tris = chunk_triangles[chunks[i]];
+		if(tris.size() == 0) {
+			return;
+		}
 		
-	//Generate display list
-	display_list = glGenLists(1);
-	glNewList(display_list, GL_COMPILE);
-	glEnable(GL_DEPTH_TEST);
+		//Cut the chunk out, which leaves its edges open, so they stay put
+		vector<int> verts;
+		verts.reserve(3 * tris.size());
+		for(int j=0; j<tris.size(); ++j) {
+			auto tri = mesh.triangle(tris[j]);
+			verts.insert(verts.end(), tri.v, tri.v + 3);
+		}
+		sort(verts.begin(), verts.end());
+		verts.erase(unique(verts.begin(), verts.end()), verts.end());
+		
+		SolidMesh piece;
+		piece.reserve(verts.size(), tris.size());
+		for(int j=0; j<verts.size(); ++j) {
+			piece.add_vertex(mesh.vertex(verts[j]));
+		}
+		for(int j=0; j<tris.size(); ++j) {
+			Triangle tri = mesh.triangle(tris[j]);
+			for(int k=0; k<3; ++k) {
+				tri.v[k] = std::lower_bound(verts.begin(), verts.end(), tri.v[k]) - verts.begin();
+			}
+			piece.add_triangle(tri);
+		}
+		
+		MeshSimplifier<SolidMesh, VertexMerge> simplifier(piece);
+		for(int l=0; l<levels; ++l) {
+			simplifier.simplify(lod_errors[l] * cell);
+			simplifier.result(pieces[i][l]);
+		}
+	});
+	
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
 	glEnableClientState(GL_COLOR_ARRAY);
-	glVertexPointer(3, GL_FLOAT, sizeof(Vertex), &vbuffer[0].position);
-	glNormalPointer(GL_FLOAT, sizeof(Vertex), &vbuffer[0].normal);
-	glColorPointer(3, GL_FLOAT, sizeof(Vertex), &vbuffer[0].color);	
-	glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_INT, ibuffer);
+	
+	//Levels which hardly save anything over the one before are left out,
+	//and draw() uses the finer one instead.  Chunk edges can't move, so
+	//small chunks soon stop getting any simpler.
+	vector<int> all, local;
+	for(int i=0; i<chunks.size(); ++i) {
+		int previous = chunk_triangles[chunks[i]].size();
+		for(int l=0; l<levels; ++l) {
+			SolidMesh const& piece = pieces[i][l];
+			if(piece.triangles().size() == 0 || 10 * piece.triangles().size() > 9 * previous) {
+				continue;
+			}
+			previous = piece.triangles().size();
+			all.resize(piece.triangles().size());
+			for(int t=0; t<all.size(); ++t) {
+				all[t] = t;
+			}
+			local.assign(piece.vertices().size(), -1);
+			lod_lists[l][chunks[i]] = compile_list(piece, all, local);
+		}
+	}
+	
 	glDisableClientState(GL_VERTEX_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
 	glDisableClientState(GL_COLOR_ARRAY);
-    glEndList();	
+}
 
-	//Update mass
-	mass = 0.0;
-	float J = 1.0 / (scale[0]*scale[1]*scale[2]);
-	for(int i=0; i<resolution[0]*resolution[1]*resolution[2]; ++i) {
-		if(data[i].density > 0) {
-			mass += J * data[i].density;
+//Compiles some triangles of a mesh into a display list.  They are packed
+//into RenderVertex, and indexed with 16 bits when there are few enough.
+//local must have an entry of -1 for every vertex of m, and is left that
+//way.  The vertex, normal and color arrays must be enabled.
+GLuint Solid::compile_list(SolidMesh const& m, vector<int> const& tris, vector<int>& local) const {
+	vector<int> used;
+	vector<RenderVertex> packed;
+	vector<GLuint> indices;
+	indices.reserve(3 * tris.size());
+	for(int j=0; j<tris.size(); ++j) {
+		auto tri = m.triangle(tris[j]);
+		for(int k=0; k<3; ++k) {
+			const int v = tri.v[k];
+			if(local[v] < 0) {
+				local[v] = packed.size();
+				packed.push_back(render_vertex(m.vertex(v)));
+				used.push_back(v);
+			}
+			indices.push_back(local[v]);
+		}
+	}
+	for(int j=0; j<used.size(); ++j) {
+		local[used[j]] = -1;
+	}
+	
+	glVertexPointer(3, GL_SHORT, sizeof(RenderVertex), packed[0].position);
+	glNormalPointer(GL_BYTE, sizeof(RenderVertex), packed[0].normal);
+	glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(RenderVertex), packed[0].color.rgba);
+	
+	const GLuint list = glGenLists(1);
+	glNewList(list, GL_COMPILE);
+	glEnable(GL_DEPTH_TEST);
+	if(packed.size() <= 65536) {
+		vector<GLushort> short_indices(indices.begin(), indices.end());
+		glDrawElements(GL_TRIANGLES, short_indices.size(), GL_UNSIGNED_SHORT, &short_indices[0]);
+	}
+	else {
+		glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, &indices[0]);
+	}
+	glEndList();
+	return list;
+}
+
+void Solid::free_display_lists() {
+	for(int c=display_lists.size()-1; c>=0; --c) {
+		if(display_lists[c]) {
+			glDeleteLists(display_lists[c], 1);
+		}
+	}
+	display_lists.clear();
+	for(int l=0; l<lod_lists.size(); ++l) {
+		for(int c=lod_lists[l].size()-1; c>=0; --c) {
+			if(lod_lists[l][c]) {
+				glDeleteLists(lod_lists[l][c], 1);
+			}
+		}
+	}
+	lod_lists.clear();
+}
+
+Vertex VertexMerge::operator()(
+	Vertex const& a,
+	Vertex const& b,
+	float t,
+	Vector3f const& p) const {
+	Vertex v;
+	v.position = p;
+	v.normal = (1.f - t) * a.normal + t * b.normal;
+	const float len = v.normal.norm();
+	v.normal = len > 0 ? Vector3f(v.normal / len) : (t < 0.5f ? a.normal : b.normal);
+	for(int i=0; i<4; ++i) {
+		v.color.rgba[i] = (uint8_t)floor((1.f - t) * a.color.rgba[i] + t * b.color.rgba[i] + 0.5f);
+	}
+	return v;
+}
+
+//Surface nets over the contour lattice of Mesh::isocontour, restricted to
+//the cells which can see the samples [clo, chi).  Those cells get new
+//vertices, and every face touching them is rebuilt.  Vertices of other cells
+//don't move, so the patch joins up with the rest of the mesh.
+void Solid::patch_mesh(
+	const int* clo,
+	const int* chi,
+	function<Vertex(Vector3f const&)> const& attr,
+	function<Vector3f(Vector3f const&)> const& gradient) {
+	
+	//Lattice point x is sample x-1, and there are res+2 cells along each axis
+	const Vector3i lres = resolution + Vector3i(2, 2, 2);
+	const Array3f h = (upper_bound - lower_bound).array() / resolution.array().cast<float>();
+	const Vector3f lo = lower_bound - h.matrix();
+	auto cell_key = [&](Vector3i const& c) {
+		return c[0] + lres[0] * (c[1] + lres[1] * c[2]);
+	};
+	
+	if(cell_vertex.empty()) {
+		for(int v=0; v<vertex_cells.size(); ++v) {
+			if(vertex_cells[v][0] >= 0) {
+				cell_vertex[cell_key(vertex_cells[v])] = v;
+			}
+		}
+	}
+	
+	//Cells with a corner on a changed sample, plus one more on each side
+	Vector3i c0, c1, s0, s1;
+	for(int i=0; i<3; ++i) {
+		c0[i] = max(clo[i] - 1, 0);
+		c1[i] = min(chi[i] + 1, lres[i] - 1);
+		s0[i] = c0[i];
+		s1[i] = min(c1[i] + 2, lres[i]);
+	}
+	
+	//Read lattice points the same way Mesh::isocontour does
+	const Vector3i sn = s1 - s0 + Vector3i(1, 1, 1);
+	vector<float> samples(sn[0] * sn[1] * sn[2]);
+	auto sample_at = [&](Vector3i const& x) -> float& {
+		return samples[(x[0] - s0[0]) + sn[0] * ((x[1] - s0[1]) + sn[1] * (x[2] - s0[2]))];
+	};
+	parallel_for(s0[2], s1[2] + 1, [&](int z) {
+		for(int y=s0[1]; y<=s1[1]; ++y)
+		for(int x=s0[0]; x<=s1[0]; ++x) {
+			sample_at(Vector3i(x, y, z)) = lattice_density(x, y, z);
+		}
+	});
+	
+	//Edge crossings, for edges starting at lattice points [c0, c1+1]
+	const Vector3i en = c1 - c0 + Vector3i(2, 2, 2);
+	vector<Vector4f, aligned_allocator<Vector4f> > crossings(3 * en[0] * en[1] * en[2]);
+	vector<char> crosses(crossings.size(), 0);
+	auto edge_index = [&](Vector3i const& x, int e) {
+		return 3 * ((x[0] - c0[0]) + en[0] * ((x[1] - c0[1]) + en[1] * (x[2] - c0[2]))) + e;
+	};
+	auto edge_in_range = [&](Vector3i const& x) {
+		for(int i=0; i<3; ++i) {
+			if(x[i] < c0[i] || x[i] > c1[i] + 1 || x[i] > lres[i] - 1) {
+				return false;
+			}
+		}
+		return true;
+	};
+	for(int z=c0[2]; z<=c1[2]+1; ++z)
+	for(int y=c0[1]; y<=c1[1]+1; ++y)
+	for(int x=c0[0]; x<=c1[0]+1; ++x) {
+		const Vector3i coord(x, y, z);
+		if(!edge_in_range(coord)) {
+			continue;
+		}
+		const Vector3f p = (Array3f(x, y, z) * h + lo.array()).matrix();
+		const float c_f = sample_at(coord);
+		for(int e=0; e<3; ++e) {
+			Vector3i ec = coord;
+			ec[e] += 1;
+			const float e_f = sample_at(ec);
+			
+			//Same test as Mesh::isocontour
+			if(c_f < -FP_TOLERANCE) {
+				if(e_f < -FP_TOLERANCE) {
+					continue;
+				}
+			}
+			else if(c_f > FP_TOLERANCE) {
+				if(e_f > FP_TOLERANCE) {
+					continue;
+				}
+			}
+			else {
+				if(abs(e_f) < FP_TOLERANCE) {
+					continue;
+				}
+			}
+			
+			Vector3f e_p(p);
+			e_p[e] += h[e];
+			const float t = c_f / (c_f - e_f);
+			const Vector3f intercept = (1.f-t)*p + t*e_p;
+			const int idx = edge_index(coord, e);
+			crossings[idx] = Vector4f(
+				intercept[0], intercept[1], intercept[2], (c_f < e_f) ? 1 : -1);
+			crosses[idx] = 1;
+		}
+	}
+	
+	//Calls f(coord, e) for every edge next to a patched cell which can have
+	//a face, in the same order as Mesh::isocontour
+	auto for_each_face_edge = [&](function<void(Vector3i const&, int)> const& f) {
+		for(int e=0; e<3; ++e) {
+			const int u_dir = (e+1) % 3;
+			const int v_dir = (e+2) % 3;
+			Vector3i f1 = c1;
+			f1[u_dir] += 1;
+			f1[v_dir] += 1;
+			
+			for(int z=c0[2]; z<=f1[2]; ++z)
+			for(int y=c0[1]; y<=f1[1]; ++y)
+			for(int x=c0[0]; x<=f1[0]; ++x) {
+				const Vector3i coord(x, y, z);
+				if(	coord[u_dir] <= 0 || coord[v_dir] <= 0 ||
+					coord[u_dir] >= lres[u_dir]-1 || 
+					coord[v_dir] >= lres[v_dir]-1 || 
+					coord[e] >= lres[e] - 2)
+					continue;
+				f(coord, e);
+			}
+		}
+	};
+	
+	//Vertices of the 4 cells around an edge, or -1
+	auto face_vertices = [&](Vector3i const& coord, int e, int* vert) {
+		const int u_dir = (e+1) % 3;
+		const int v_dir = (e+2) % 3;
+		int n = 0;
+		for(int u=0; u<=1; ++u)
+		for(int v=0; v<=1; ++v) {
+			Vector3i tmp(coord);
+			tmp[u_dir] -= u;
+			tmp[v_dir] -= v;
+			auto iter = cell_vertex.find(cell_key(tmp));
+			vert[n++] = (iter == cell_vertex.end()) ? -1 : iter->second;
+		}
+	};
+	
+	//Remove the old faces around those edges.  Both triangles of a face
+	//contain vert[1] and vert[2], and no other face has three of its
+	//vertices.
+	vector<int> dirty_chunks, touched;
+	for_each_face_edge([&](Vector3i const& coord, int e) {
+		int vert[4];
+		face_vertices(coord, e, vert);
+		if(vert[1] < 0 || vert[2] < 0) {
+			return;
+		}
+		//Copied, since removing triangles changes the incidence
+		auto incident = mesh.vertex_incidence(vert[1]);
+		vector<int> tris(incident.begin(), incident.end());
+		for(int i=0; i<tris.size(); ++i) {
+			const int t = tris[i];
+			auto tri = mesh.triangle(t);
+			bool in_face = tri.index_of(vert[2]) >= 0;
+			for(int k=0; k<3 && in_face; ++k) {
+				in_face = find(vert, vert+4, tri.v[k]) != vert+4;
+			}
+			if(!in_face) {
+				continue;
+			}
+			const int c = triangle_chunk[t];
+			vector<int>& list = chunk_triangles[c];
+			list.erase(find(list.begin(), list.end(), t));
+			dirty_chunks.push_back(c);
+			triangle_chunk[t] = -1;
+			for(int k=0; k<3; ++k) {
+				touched.push_back(tri.v[k]);
+			}
+			mesh.remove_triangle(t);
+		}
+	});
+	
+	//Recompute vertices, reusing their old names, and placed the same way
+	//as setup_solid() did
+	const QEFPlacement<function<Vector3f(Vector3f const&)> const> sharp(gradient, h);
+	Vector4f found[12];
+	for(int z=c0[2]; z<=c1[2]; ++z)
+	for(int y=c0[1]; y<=c1[1]; ++y)
+	for(int x=c0[0]; x<=c1[0]; ++x) {
+		const Vector3i cell(x, y, z);
+		int n = 0;
+		for(int e=0; e<3; ++e) {
+			const int u_dir = (e + 1)%3;
+			const int v_dir = (e + 2)%3;
+			for(int u=0; u<=1; ++u)
+			for(int v=0; v<=1; ++v) {
+				Vector3i tmp(cell);
+				tmp[u_dir] += u;
+				tmp[v_dir] += v;
+				if(!edge_in_range(tmp)) {
+					continue;
+				}
+				const int idx = edge_index(tmp, e);
+				if(crosses[idx]) {
+					found[n++] = crossings[idx];
+				}
+			}
+		}
+		
+		const int key = cell_key(cell);
+		auto iter = cell_vertex.find(key);
+		if(n == 0) {
+			if(iter != cell_vertex.end()) {
+				vertex_cells[iter->second] = Vector3i(-1, -1, -1);
+				free_vertices.push_back(iter->second);
+				cell_vertex.erase(iter);
+			}
+			continue;
+		}
+		
+		const Vector3f cell_lo = (cell.cast<float>().array() * h + lo.array()).matrix();
+		const Vertex vdata = attr((flags & SOLID_SHARP_FEATURES) ?
+			sharp(found, n, cell_lo) :
+			MeanPlacement()(found, n, cell_lo));
+		int id;
+		if(iter != cell_vertex.end()) {
+			id = iter->second;
+			mesh.vertex(id) = vdata;
+		}
+		else if(free_vertices.size() > 0) {
+			id = free_vertices.back();
+			free_vertices.pop_back();
+			mesh.vertex(id) = vdata;
+		}
+		else {
+			id = mesh.add_vertex(vdata);
+			vertex_cells.resize(id + 1);
+		}
+		vertex_cells[id] = cell;
+		cell_vertex[key] = id;
+		touched.push_back(id);
+	}
+	
+	//Rebuild faces
+	vector<int> added;
+	for_each_face_edge([&](Vector3i const& coord, int e) {
+		const int idx = edge_index(coord, e);
+		if(!crosses[idx]) {
+			return;
+		}
+		int vert[4];
+		face_vertices(coord, e, vert);
+		if(vert[0] < 0 || vert[1] < 0 || vert[2] < 0 || vert[3] < 0) {
+			return;
+		}
+		
+		int t[2];
+		if(crossings[idx][3] < 0) {
+			t[0] = mesh.add_triangle(vert[0], vert[1], vert[2]);
+			t[1] = mesh.add_triangle(vert[2], vert[1], vert[3]);
+		}
+		else {
+			t[0] = mesh.add_triangle(vert[0], vert[2], vert[1]);
+			t[1] = mesh.add_triangle(vert[1], vert[2], vert[3]);
+		}
+		added.push_back(t[0]);
+		added.push_back(t[1]);
+		for(int i=0; i<2; ++i) {
+			auto tri = mesh.triangle(t[i]);
+			const int c = chunk_of((mesh.vertex(tri.v[0]).position +
+									mesh.vertex(tri.v[1]).position +
+									mesh.vertex(tri.v[2]).position) / 3.f);
+			if(t[i] >= triangle_chunk.size()) {
+				triangle_chunk.resize(t[i] + 1);
+			}
+			triangle_chunk[t[i]] = c;
+			chunk_triangles[c].push_back(t[i]);
+			dirty_chunks.push_back(c);
+		}
+		for(int i=0; i<4; ++i) {
+			touched.push_back(vert[i]);
+		}
+	});
+	
+	//Drop any island the new faces are on, as contour_solid() did.  Its
+	//vertices keep their cells, like the ones contour_solid() dropped.
+	if(flags & SOLID_NO_ISLANDS) {
+		vector<bool> checked(mesh.triangles().size(), false);
+		vector<int> island;
+		for(int i=0; i<added.size(); ++i) {
+			if(checked[added[i]]) {
+				continue;
+			}
+			const bool small = small_component(mesh, added[i], MIN_ISLAND_TRIANGLES, island);
+			for(int j=0; j<island.size(); ++j) {
+				checked[island[j]] = true;
+			}
+			if(!small) {
+				continue;
+			}
+			for(int j=0; j<island.size(); ++j) {
+				const int t = island[j];
+				const int c = triangle_chunk[t];
+				vector<int>& list = chunk_triangles[c];
+				list.erase(find(list.begin(), list.end(), t));
+				dirty_chunks.push_back(c);
+				triangle_chunk[t] = -1;
+				for(int k=0; k<3; ++k) {
+					touched.push_back(mesh.triangle(t).v[k]);
+				}
+				mesh.remove_triangle(t);
+			}
 		}
 	}
+	
+	//Fix up normals of everything that moved or lost/gained a triangle
+	sort(touched.begin(), touched.end());
+	touched.erase(unique(touched.begin(), touched.end()), touched.end());
+	vector<int> live;
+	for(int i=0; i<touched.size(); ++i) {
+		if(mesh.vertex_incidence(touched[i]).size() > 0) {
+			live.push_back(touched[i]);
+		}
+	}
+	estimate_normals(mesh, live);
+	
+	//Removing the old faces unpacked the mesh; pack it again so queries get
+	//the compact incidence and neighbor table back.  Removed triangles keep
+	//their names.
+	mesh.compact();
+	
+	compile_chunks(dirty_chunks);
+}
+
+#if defined(__AVX2__)
+
+static inline __m256 lerp8(__m256 a, __m256 b, __m256 t) {
+	return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a)));
+}
+
+#elif defined(__SSE2__)
+
+static inline __m128 lerp4(__m128 a, __m128 b, __m128 t) {
+	return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a)));
+}
+
+#endif
+
+//Converts the density grid into a signed distance field
+void Solid::bake_distance_field() {
+	if(!distance_field) {
+		distance_field = new VoxelGrid(resolution, !voxels.dense());
+	}
+	compute_distance_field(voxels, scale.inverse(), *distance_field);
+}
+
+//Distances are only recomputed this many cells around a changed region
+static const int DISTANCE_MARGIN = 8;
+
+//Updates the distance field after the samples [lo, hi) changed
+void Solid::update_distance_field(const int* lo, const int* hi) {
+	int dlo[3], dhi[3];
+	for(int i=0; i<3; ++i) {
+		dlo[i] = lo[i] - DISTANCE_MARGIN;
+		dhi[i] = hi[i] + DISTANCE_MARGIN;
+	}
+	::update_distance_field(voxels, scale.inverse(), *distance_field, dlo, dhi);
+}
+
+//Batched trilinear sampling
+void Solid::sample(
+	int n,
+	const float* x,
+	const float* y,
+	const float* z,
+	float* density,
+	float* gx,
+	float* gy,
+	float* gz,
+	float* friction) const {
+	
+	const bool need_gradient = gx || gy || gz;
+	const bool need_density = density || need_gradient;
+	const int dy = resolution[0], dz = resolution[0]*resolution[1];
+	const int corner[8] = { 0, 1, dy, dy+1, dz, dz+1, dz+dy, dz+dy+1 };
+	int i = 0;
+
+#if defined(__AVX2__)
+	//8 points at a time, corners fetched with hardware gathers
+	if(voxels.dense()) {
+		const __m256 lo[3] = {
+			_mm256_set1_ps(lower_bound[0]),
+			_mm256_set1_ps(lower_bound[1]),
+			_mm256_set1_ps(lower_bound[2]) };
+		const __m256 sc[3] = {
+			_mm256_set1_ps(scale[0]),
+			_mm256_set1_ps(scale[1]),
+			_mm256_set1_ps(scale[2]) };
+		const __m256 hi[3] = {
+			_mm256_set1_ps(resolution[0] - 1),
+			_mm256_set1_ps(resolution[1] - 1),
+			_mm256_set1_ps(resolution[2] - 1) };
+		const __m256 zero = _mm256_setzero_ps(),
+					 outside_density = _mm256_set1_ps(-1000.f);
+		const float* dptr = voxels.density_data();
+		const float* fptr = voxels.friction_data();
+		const __m256 uniform_friction = _mm256_set1_ps(voxels.constant_friction_value());
+		const float* src[3] = { x, y, z };
+		
+		for(; i+8<=n; i+=8) {
+			__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1)), f[3];
+			__m256i iv[3];
+			for(int k=0; k<3; ++k) {
+				__m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(src[k]+i), lo[k]), sc[k]);
+				inside = _mm256_and_ps(inside, _mm256_and_ps(
+					_mm256_cmp_ps(v, zero, _CMP_GE_OQ),
+					_mm256_cmp_ps(v, hi[k], _CMP_LT_OQ)));
+				v = _mm256_and_ps(v, inside);
+				iv[k] = _mm256_cvttps_epi32(v);
+				f[k] = _mm256_sub_ps(v, _mm256_cvtepi32_ps(iv[k]));
+			}
+			
+			//Points outside the grid were clamped to cell 0, so all gathers are in range
+			__m256i base = _mm256_add_epi32(iv[0], _mm256_add_epi32(
+				_mm256_mullo_epi32(iv[1], _mm256_set1_epi32(dy)),
+				_mm256_mullo_epi32(iv[2], _mm256_set1_epi32(dz))));
+			base = _mm256_and_si256(base, _mm256_castps_si256(inside));
+			
+			if(need_density) {
+				__m256 c[8];
+				for(int j=0; j<8; ++j) {
+					c[j] = _mm256_i32gather_ps(dptr,
+						_mm256_add_epi32(base, _mm256_set1_epi32(corner[j])), sizeof(float));
+				}
+				__m256	a00 = lerp8(c[0], c[1], f[0]),
+						a10 = lerp8(c[2], c[3], f[0]),
+						a01 = lerp8(c[4], c[5], f[0]),
+						a11 = lerp8(c[6], c[7], f[0]),
+						b0  = lerp8(a00, a10, f[1]),
+						b1  = lerp8(a01, a11, f[1]);
+				if(density) {
+					__m256 d = lerp8(b0, b1, f[2]);
+					_mm256_storeu_ps(density+i, _mm256_blendv_ps(outside_density, d, inside));
+				}
+				if(gx) {
+					__m256	e0 = lerp8(_mm256_sub_ps(c[1], c[0]), _mm256_sub_ps(c[3], c[2]), f[1]),
+							e1 = lerp8(_mm256_sub_ps(c[5], c[4]), _mm256_sub_ps(c[7], c[6]), f[1]);
+					_mm256_storeu_ps(gx+i, _mm256_and_ps(lerp8(e0, e1, f[2]), inside));
+				}
+				if(gy) {
+					__m256 g = lerp8(_mm256_sub_ps(a10, a00), _mm256_sub_ps(a11, a01), f[2]);
+					_mm256_storeu_ps(gy+i, _mm256_and_ps(g, inside));
+				}
+				if(gz) {
+					_mm256_storeu_ps(gz+i, _mm256_and_ps(_mm256_sub_ps(b1, b0), inside));
+				}
+			}
+			
+			if(friction && !fptr) {
+				_mm256_storeu_ps(friction+i, _mm256_and_ps(uniform_friction, inside));
+			}
+			else if(friction) {
+				__m256 c[8];
+				for(int j=0; j<8; ++j) {
+					c[j] = _mm256_i32gather_ps(fptr,
+						_mm256_add_epi32(base, _mm256_set1_epi32(corner[j])), sizeof(float));
+				}
+				__m256	b0 = lerp8(lerp8(c[0], c[1], f[0]), lerp8(c[2], c[3], f[0]), f[1]),
+						b1 = lerp8(lerp8(c[4], c[5], f[0]), lerp8(c[6], c[7], f[0]), f[1]);
+				_mm256_storeu_ps(friction+i, _mm256_and_ps(lerp8(b0, b1, f[2]), inside));
+			}
+		}
+	}
+#elif defined(__SSE2__)
+	//4 points at a time.  SSE2 has no gather (or 32-bit multiply), so the
+	//corner loads are done per lane and everything else is vectorized.
+	if(voxels.dense()) {
+		const __m128 lo[3] = {
+			_mm_set1_ps(lower_bound[0]),
+			_mm_set1_ps(lower_bound[1]),
+			_mm_set1_ps(lower_bound[2]) };
+		const __m128 sc[3] = {
+			_mm_set1_ps(scale[0]),
+			_mm_set1_ps(scale[1]),
+			_mm_set1_ps(scale[2]) };
+		const __m128 hi[3] = {
+			_mm_set1_ps(resolution[0] - 1),
+			_mm_set1_ps(resolution[1] - 1),
+			_mm_set1_ps(resolution[2] - 1) };
+		const __m128 zero = _mm_setzero_ps(),
+					 outside_density = _mm_set1_ps(-1000.f);
+		const float* dptr = voxels.density_data();
+		const float* fptr = voxels.friction_data();
+		const __m128 uniform_friction = _mm_set1_ps(voxels.constant_friction_value());
+		const float* src[3] = { x, y, z };
+		
+		for(; i+4<=n; i+=4) {
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1)), f[3];
+			int icoord[12];
+			for(int k=0; k<3; ++k) {
+				__m128 v = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src[k]+i), lo[k]), sc[k]);
+				inside = _mm_and_ps(inside, _mm_and_ps(
+					_mm_cmpge_ps(v, zero),
+					_mm_cmplt_ps(v, hi[k])));
+				v = _mm_and_ps(v, inside);
+				__m128i iv = _mm_cvttps_epi32(v);
+				f[k] = _mm_sub_ps(v, _mm_cvtepi32_ps(iv));
+				_mm_storeu_si128((__m128i*)(icoord + 4*k), iv);
+			}
+			
+			//Points outside the grid were clamped to cell 0, so all loads are in range
+			int base[4];
+			for(int l=0; l<4; ++l) {
+				base[l] = icoord[l] + dy * icoord[4+l] + dz * icoord[8+l];
+			}
+			
+			if(need_density) {
+				__m128 c[8];
+				for(int j=0; j<8; ++j) {
+					c[j] = _mm_setr_ps(
+						dptr[base[0]+corner[j]],
+						dptr[base[1]+corner[j]],
+						dptr[base[2]+corner[j]],
+						dptr[base[3]+corner[j]]);
+				}
+				__m128	a00 = lerp4(c[0], c[1], f[0]),
+						a10 = lerp4(c[2], c[3], f[0]),
+						a01 = lerp4(c[4], c[5], f[0]),
+						a11 = lerp4(c[6], c[7], f[0]),
+						b0  = lerp4(a00, a10, f[1]),
+						b1  = lerp4(a01, a11, f[1]);
+				if(density) {
+					__m128 d = lerp4(b0, b1, f[2]);
+					_mm_storeu_ps(density+i, _mm_or_ps(
+						_mm_and_ps(inside, d),
+						_mm_andnot_ps(inside, outside_density)));
+				}
+				if(gx) {
+					__m128	e0 = lerp4(_mm_sub_ps(c[1], c[0]), _mm_sub_ps(c[3], c[2]), f[1]),
+							e1 = lerp4(_mm_sub_ps(c[5], c[4]), _mm_sub_ps(c[7], c[6]), f[1]);
+					_mm_storeu_ps(gx+i, _mm_and_ps(lerp4(e0, e1, f[2]), inside));
+				}
+				if(gy) {
+					__m128 g = lerp4(_mm_sub_ps(a10, a00), _mm_sub_ps(a11, a01), f[2]);
+					_mm_storeu_ps(gy+i, _mm_and_ps(g, inside));
+				}
+				if(gz) {
+					_mm_storeu_ps(gz+i, _mm_and_ps(_mm_sub_ps(b1, b0), inside));
+				}
+			}
+			
+			if(friction && !fptr) {
+				_mm_storeu_ps(friction+i, _mm_and_ps(uniform_friction, inside));
+			}
+			else if(friction) {
+				__m128 c[8];
+				for(int j=0; j<8; ++j) {
+					c[j] = _mm_setr_ps(
+						fptr[base[0]+corner[j]],
+						fptr[base[1]+corner[j]],
+						fptr[base[2]+corner[j]],
+						fptr[base[3]+corner[j]]);
+				}
+				__m128	b0 = lerp4(lerp4(c[0], c[1], f[0]), lerp4(c[2], c[3], f[0]), f[1]),
+						b1 = lerp4(lerp4(c[4], c[5], f[0]), lerp4(c[6], c[7], f[0]), f[1]);
+				_mm_storeu_ps(friction+i, _mm_and_ps(lerp4(b0, b1, f[2]), inside));
+			}
+		}
+	}
+#endif
+
+	//Remaining points (or all of them for sparse grids)
+	for(; i<n; ++i) {
+		float d, f;
+		Vector3f g;
+		sample(
+			Vector3f(x[i], y[i], z[i]),
+			density ? &d : NULL,
+			need_gradient ? &g : NULL,
+			friction ? &f : NULL);
+		if(density)		density[i] = d;
+		if(gx)			gx[i] = g[0];
+		if(gy)			gy[i] = g[1];
+		if(gz)			gz[i] = g[2];
+		if(friction)	friction[i] = f;
+	}
 }
 
-//Draws a solid
+//Draws a solid.  The render vertices are scaled back up here, so normals
+//need GL_NORMALIZE, which Puzzle::draw() turns on.  Each chunk is drawn at
+//the coarsest level of detail whose error comes to under LOD_PIXEL_ERROR
+//on screen, judged from the nearest point of the chunk's box.
 void Solid::draw() {
-    glCallList(display_list);
+	const Vector3f origin = render_origin();
+	const float step = render_step();
+	
+	//Error of each level of detail in eye space, and pixels per unit of
+	//eye space at unit distance
+	Matrix4f modelview = Matrix4f::Identity(), projection = Matrix4f::Identity();
+	GLint viewport[4] = { 0, 0, 1, 1 };
+	vector<float> lod_eye_errors(lod_lists.size());
+	float pixels = 0.f;
+	if(lod_lists.size() > 0) {
+		glGetFloatv(GL_MODELVIEW_MATRIX, modelview.data());
+		glGetFloatv(GL_PROJECTION_MATRIX, projection.data());
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		const float units = modelview.topLeftCorner<3,3>().colwise().norm().maxCoeff();
+		for(int l=0; l<lod_lists.size(); ++l) {
+			lod_eye_errors[l] = lod_errors[l] * scale.inverse().minCoeff() * units;
+		}
+		pixels = 0.5f * abs(projection(1,1)) * viewport[3];
+	}
+	const Vector3i cres = chunk_resolution();
+	const Array3f chunk_size = scale.inverse() * (float)(1 << CHUNK_SHIFT);
+	const float chunk_radius = 0.5f * chunk_size.matrix().norm() *
+		modelview.topLeftCorner<3,3>().colwise().norm().maxCoeff();
+	
+	glPushMatrix();
+	glTranslatef(origin[0], origin[1], origin[2]);
+	glScalef(step, step, step);
+	for(int c=0; c<display_lists.size(); ++c) {
+		if(!display_lists[c]) {
+			continue;
+		}
+		GLuint list = display_lists[c];
+		if(lod_lists.size() > 0) {
+			//Chunk c starts one cell below the grid, as the contour lattice does
+			const Array3f cell(
+				c % cres[0],
+				(c / cres[0]) % cres[1],
+				c / (cres[0] * cres[1]));
+			const Vector3f center = lower_bound + ((cell + 0.5f) * chunk_size - scale.inverse()).matrix();
+			const Vector4f eye = modelview * Vector4f(center[0], center[1], center[2], 1.f);
+			const float distance = eye.head<3>().norm() - chunk_radius;
+			for(int l=lod_lists.size()-1; l>=0 && distance > 0.f; --l) {
+				if(lod_lists[l][c] && lod_eye_errors[l] * pixels <= LOD_PIXEL_ERROR * distance) {
+					list = lod_lists[l][c];
+					break;
+				}
+			}
+		}
+		glCallList(list);
+	}
+	glPopMatrix();
 }
 
 IntrinsicCoordinate Solid::random_point() {
@@ -63,6 +969,9 @@ IntrinsicCoordinate Solid::random_point() {
 	}
 
 	int rnd_tri = rand() % mesh.triangles().size();
+	for(int i=0; i<mesh.triangles().size() && !live_triangle(rnd_tri); ++i) {
+		rnd_tri = (rnd_tri + 1) % mesh.triangles().size();
+	}
 	auto tr = mesh.triangle(rnd_tri);
 	
 	float a = drand48();
@@ -83,6 +992,9 @@ IntrinsicCoordinate Solid::closest_point(Eigen::Vector3f const& p) {
 	float d = 1e20;
 	
 	for(int i=mesh.triangles().size()-1; i>=0; --i) {
+		if(!live_triangle(i)) {
+			continue;
+		}
 		IntrinsicCoordinate tmp(i, p, this);
 		
 		//Get closest point
@@ -3,48 +3,225 @@
 
 #include <array>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <functional>
 #include <iostream>
 #include <cmath>
 #include <cassert>
+#include <stdint.h>
 #include <GL/glfw.h>
 #include <Eigen/Core>
 #include <mesh/mesh.h>
 
+#include "voxels.h"
+#include "solid_cache.h"
+
 typedef Eigen::Transform<float, 3, Eigen::Affine> Transform3f;
 
+//8 bit RGBA, which is all the renderer uses.  Assigning a float color
+//clamps it to [0, 1], like OpenGL would.
+struct PackedColor {
+	uint8_t rgba[4];
+	
+	PackedColor() {
+		rgba[0] = rgba[1] = rgba[2] = 0;
+		rgba[3] = 255;
+	}
+	
+	template<typename Derived>
+	PackedColor(Eigen::MatrixBase<Derived> const& c) {
+		*this = c;
+	}
+	
+	template<typename Derived>
+	PackedColor& operator=(Eigen::MatrixBase<Derived> const& c) {
+		for(int i=0; i<3; ++i) {
+			const float x = std::max(0.f, std::min(1.f, (float)c[i]));
+			rgba[i] = (uint8_t)(x * 255.f + 0.5f);
+		}
+		rgba[3] = 255;
+		return *this;
+	}
+};
+
+//Positions and normals are kept at full precision for collisions and
+//surface coordinates, colors are only drawn
 struct Vertex {
-	Eigen::Vector3f	position, normal, color;
+	Eigen::Vector3f	position, normal;
+	PackedColor		color;
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
-struct Cell {
-	float density, friction;
+//What the display lists are compiled from, 16 bytes a vertex.  Positions
+//are 16 bit steps from the middle of the contour lattice (see
+//Solid::render_origin()), normals are 8 bit.
+struct RenderVertex {
+	int16_t		position[4];
+	int8_t		normal[4];
+	PackedColor	color;
+};
+
+enum SolidFlags {
+	//Only keep samples in a narrow band around the surface
+	SOLID_SPARSE		= (1<<0),
+	
+	//Bake a signed distance field after filling, for distance()
+	SOLID_DISTANCE_FIELD	= (1<<1),
 	
-	//Friction ~ 1/number of seconds before stopping
+	//Place mesh vertices with dual contouring, which keeps creases and
+	//corners sharp, so a coarser grid looks as good
+	SOLID_SHARP_FEATURES	= (1<<2),
+	
+	//Dual contour, then merge cells where the surface is flat into bigger
+	//ones, for far fewer triangles.  Edits rebuild the whole mesh.
+	SOLID_ADAPTIVE		= (1<<3),
+	
+	//Simplify the mesh once it is contoured, for small pieces of artwork
+	//which never need the full detail.  Edits rebuild the whole mesh.
+	SOLID_LOW_POLY		= (1<<4),
+	
+	//Build coarser versions of each chunk (see Solid::lod_errors), which
+	//draw() switches to when they look the same on screen
+	SOLID_LOD		= (1<<5),
+	
+	//Leave out pieces of surface with fewer than MIN_ISLAND_TRIANGLES
+	//triangles, such as specks around lone samples, which only cost draw
+	//calls in a big level.  Edits drop the ones they make too.
+	SOLID_NO_ISLANDS	= (1<<6),
+};
+
+//How far SOLID_ADAPTIVE lets the surface move, in cells
+const float ADAPTIVE_ERROR = 0.1f;
+
+//Islands SOLID_NO_ISLANDS leaves out have fewer triangles than this
+const int MIN_ISLAND_TRIANGLES = 32;
+
+//How far SOLID_LOW_POLY lets the surface move, in cells
+const float LOW_POLY_ERROR = 0.25f;
+
+//How far each level of detail made for SOLID_LOD lets the surface move, in
+//cells, finest first
+const float LOD_ERRORS[] = { 0.25f, 1.f, 4.f };
+
+//How far a level of detail may be off on screen before draw() uses a finer
+//one, in pixels
+const float LOD_PIXEL_ERROR = 0.75f;
+
+//Makes the vertex for a collapsed edge of a solid's mesh, blending the
+//normals and colors of its ends
+struct VertexMerge {
+	Vertex operator()(
+		Vertex const& a,
+		Vertex const& b,
+		float t,
+		Eigen::Vector3f const& p) const;
 };
 
 struct Solid {
+	typedef Mesh::TriMesh<Vertex> SolidMesh;
+	
 	const Eigen::Array3f scale;
 	const Eigen::Vector3i resolution;
 	const Eigen::Vector3f lower_bound, upper_bound;
-	std::vector<Cell> data;
-	Mesh::TriMesh<Vertex> mesh;
-	GLuint display_list;
+	const int flags;
+	VoxelGrid voxels;
+	VoxelGrid* distance_field;
+	SolidMesh mesh;
 	float mass;
 
+	//Triangles are drawn in chunks of contour lattice cells, each with its
+	//own display list, so update_region() only recompiles the chunks it
+	//touches.  Removed triangles have chunk -1.
+	enum { CHUNK_SHIFT = 4 };
+	std::vector<GLuint> display_lists;
+	std::vector< std::vector<int> > chunk_triangles;
+	std::vector<int> triangle_chunk;
+	
+	//Coarser versions of the chunks, lod_lists[l][c] for chunk c with the
+	//surface moved by up to lod_errors[l] cells, or 0 where that wouldn't
+	//save much.  Vertices on the edges of a chunk stay put, so chunks at
+	//different levels still meet.
+	std::vector<float> lod_errors;
+	std::vector< std::vector<GLuint> > lod_lists;
+
+	//Contour lattice cell of each vertex, (-1,-1,-1) for unused vertices.
+	//cell_vertex maps lattice cells back to vertices, and is built the first
+	//time it is needed.
+	std::vector<Eigen::Vector3i> vertex_cells;
+	std::unordered_map<int, int> cell_vertex;
+	std::vector<int> free_vertices;
+
 	Solid(
 		Eigen::Vector3i const& res,
 		Eigen::Vector3f const& lo,
-		Eigen::Vector3f const& hi ) :
+		Eigen::Vector3f const& hi,
+		int flags_ = 0 ) :
 		resolution(res),
 		lower_bound(lo),
 		upper_bound(hi),
-		data(res[0]*res[1]*res[2]),
-		scale(Eigen::Array3f(res[0], res[1], res[2]) / (hi - lo).array()) {}
+		flags(flags_),
+		voxels(res, (flags_ & SOLID_SPARSE) != 0),
+		distance_field(NULL),
+		scale(Eigen::Array3f(res[0], res[1], res[2]) / (hi - lo).array()) {
+		if(flags_ & SOLID_LOD) {
+			lod_errors.assign(LOD_ERRORS, LOD_ERRORS + sizeof(LOD_ERRORS) / sizeof(LOD_ERRORS[0]));
+		}
+	}
+	~Solid() {
+		delete distance_field;
+		free_display_lists();
+	}
 
 	void setup_data();
+	void bake_distance_field();
+	void update_distance_field(const int* lo, const int* hi);
 	void draw();
 	
+	//Re-evaluates func in the box [lo, hi] and patches everything built from
+	//those samples in place: mass, distance field, mesh and display lists.
+	//Vertices and triangles outside the box keep their names.  Surface
+	//coordinates on triangles inside the box should be found again with
+	//closest_point().
+	template<typename ImplicitFunc_t, typename StyleFunc_t>
+	void update_region(
+		Eigen::Vector3f const& lo,
+		Eigen::Vector3f const& hi,
+		ImplicitFunc_t const& func,
+		StyleFunc_t& style_func);
+	
+	//Remeshes the contour lattice around the samples [lo, hi).  gradient is
+	//only used with SOLID_SHARP_FEATURES.
+	void patch_mesh(
+		const int* lo,
+		const int* hi,
+		std::function<Vertex(Eigen::Vector3f const&)> const& attr,
+		std::function<Eigen::Vector3f(Eigen::Vector3f const&)> const& gradient);
+	
+	//Reorders the mesh for the GPU vertex cache and the CPU caches, keeping
+	//vertex_cells in step.  Build with REPORT_MESH_STATS to print the
+	//simulated cache misses before and after.
+	void optimize_mesh();
+	
+	//Display lists hold RenderVertex positions, which draw() scales by
+	//render_step() and moves to render_origin()
+	Eigen::Vector3f render_origin() const;
+	float render_step() const;
+	RenderVertex render_vertex(Vertex const& v) const;
+	
+	//Chunk bookkeeping
+	Eigen::Vector3i chunk_resolution() const;
+	int chunk_of(Eigen::Vector3f const& p) const;
+	void compile_chunks(std::vector<int> chunks);
+	void compile_lods(std::vector<int> const& chunks);
+	GLuint compile_list(SolidMesh const& m, std::vector<int> const& tris, std::vector<int>& local) const;
+	void free_display_lists();
+	
+	//Triangles removed by update_region() stay in the mesh, unused
+	bool live_triangle(int t) const {
+		return triangle_chunk[t] >= 0;
+	}
+	
 	//Coordinate functions
 	struct IntrinsicCoordinate random_point();
 	struct IntrinsicCoordinate closest_point(Eigen::Vector3f const& p);
@@ -55,7 +232,7 @@ struct Solid {
 		Eigen::Vector3f& fv) const {
 		v = ((v - lower_bound).array() * scale).matrix();
 		for(int i=0; i<3; ++i) {
-			if(v[i] < 0 || v[i] >= resolution[i] - 1)
+			if(!(v[i] >= 0 && v[i] < resolution[i] - 1))
 				return false;
 			iv[i] = v[i];
 			fv[i] = v[i] - iv[i];
@@ -63,110 +240,321 @@ struct Solid {
 		return true;
 	}
 	
-	float operator()(Eigen::Vector3f const&v) const {
+	//Samples density, gradient and friction at a point in a single pass.
+	//Any of the outputs may be NULL.  Outside the grid, density is -1000 and
+	//gradient/friction are 0.
+	void sample(
+		Eigen::Vector3f const& v,
+		float* density,
+		Eigen::Vector3f* gradient,
+		float* friction) const {
 		using namespace Eigen;
 		Vector3i iv;
 		Vector3f fv;
-		if(!coordinate_parts(v, iv, fv))
-			return -1000.f;
+		if(!coordinate_parts(v, iv, fv)) {
+			if(density)		*density = -1000.f;
+			if(gradient)	*gradient = Vector3f(0, 0, 0);
+			if(friction)	*friction = 0.f;
+			return;
+		}
 		
-		float t = 0.0f;
-		for(int ix=0; ix<2; ++ix)
-		for(int iy=0; iy<2; ++iy)
-		for(int iz=0; iz<2; ++iz) {
-			float w = fabsf((1.f-ix-fv[0])*(1.f-iy-fv[1])*(1.f-iz-fv[2]));
-			t += cell(iv[0]+ix, iv[1]+iy, iv[2]+iz).density * w;
+		if(density || gradient) {
+			voxels.interpolate(iv, fv, density, gradient);
 		}
 		
-		return t;
+		if(friction) {
+			if(voxels.constant_friction()) {
+				*friction = voxels.constant_friction_value();
+				return;
+			}
+			float c[8];
+			voxels.friction_corners(iv[0], iv[1], iv[2], c);
+			float	a00 = c[0] + fv[0] * (c[1] - c[0]),
+					a10 = c[2] + fv[0] * (c[3] - c[2]),
+					a01 = c[4] + fv[0] * (c[5] - c[4]),
+					a11 = c[6] + fv[0] * (c[7] - c[6]),
+					b0  = a00 + fv[1] * (a10 - a00),
+					b1  = a01 + fv[1] * (a11 - a01);
+			*friction = b0 + fv[2] * (b1 - b0);
+		}
 	}
 	
-	float friction(Eigen::Vector3f const& v) const {
+	//Batched version of sample() over n points stored as separate x/y/z arrays.
+	//Any of the output arrays may be NULL.  Vectorized with SSE (or AVX2 when
+	//available) for dense grids, which is a lot faster than n separate lookups.
+	void sample(
+		int n,
+		const float* x,
+		const float* y,
+		const float* z,
+		float* density,
+		float* gx,
+		float* gy,
+		float* gz,
+		float* friction) const;
+	
+	bool has_distance_field() const {
+		return distance_field != NULL;
+	}
+	
+	//Signed distance to the surface (positive inside) from the baked field,
+	//with an optional gradient.  Both are in world units.  Outside the grid
+	//this is minus the distance to the grid.
+	float distance(
+		Eigen::Vector3f const& v,
+		Eigen::Vector3f* gradient = NULL) const {
 		using namespace Eigen;
+		assert(distance_field);
 		Vector3i iv;
 		Vector3f fv;
-		if(!coordinate_parts(v, iv, fv))
-			return 0.f;
-				
-		float t = 0.0f;
-		for(int ix=0; ix<2; ++ix)
-		for(int iy=0; iy<2; ++iy)
-		for(int iz=0; iz<2; ++iz) {
-			float w = fabsf((1.f-ix-fv[0])*(1.f-iy-fv[1])*(1.f-iz-fv[2]));
-			t += cell(iv[0]+ix, iv[1]+iy, iv[2]+iz).friction * w;
+		if(!coordinate_parts(v, iv, fv)) {
+			float d2 = 0.f;
+			for(int i=0; i<3; ++i) {
+				float x = (v[i] - lower_bound[i]) * scale[i];
+				float e = std::max(-x, x - (resolution[i] - 1)) / scale[i];
+				if(e > 0) {
+					d2 += e * e;
+				}
+			}
+			if(gradient) {
+				*gradient = Vector3f(0, 0, 0);
+			}
+			return -std::max(std::sqrt(d2), 1e-3f / scale.maxCoeff());
 		}
+		float d;
+		distance_field->interpolate(iv, fv, &d, gradient);
+		if(gradient) {
+			*gradient = (gradient->array() * scale).matrix();
+		}
+		return d;
+	}
+	
+	float operator()(Eigen::Vector3f const&v) const {
+		float t;
+		sample(v, &t, NULL, NULL);
 		return t;
 	}
 	
-	Eigen::Vector3f gradient(Eigen::Vector3f const& v) const {
-		using namespace Eigen;
-		Vector3i iv;
-		Vector3f fv;
-		if(!coordinate_parts(v, iv, fv))
-			return Vector3f(0, 0, 0);
-				
-		Vector3f r(0,0,0);
-		for(int ix=0; ix<2; ++ix)
-		for(int iy=0; iy<2; ++iy)
-		for(int iz=0; iz<2; ++iz) {
-			Vector3f w(
-				(ix?1:-1)*fabsf((1.f-iy-fv[1])*(1.f-iz-fv[2])),
-				(iy?1:-1)*fabsf((1.f-ix-fv[0])*(1.f-iz-fv[2])),
-				(iz?1:-1)*fabsf((1.f-iy-fv[1])*(1.f-ix-fv[0])));
-			r += cell(iv[0]+ix, iv[1]+iy, iv[2]+iz).density * w;
+	//Density at point (x,y,z) of the lattice Mesh::isocontour contours on,
+	//which is sample (x-1,y-1,z-1).  Inside the grid this is a plain lookup.
+	//Next to the faces, where operator() switches over to empty space and
+	//rounding decides which side a point lands on, it defers to operator().
+	float lattice_density(int x, int y, int z) const {
+		if(	x < 2 || x >= resolution[0] ||
+			y < 2 || y >= resolution[1] ||
+			z < 2 || z >= resolution[2]) {
+			const Eigen::Array3f h = (upper_bound - lower_bound).array() / resolution.array().cast<float>();
+			return (*this)((Eigen::Array3f(x, y, z) * h + (lower_bound - h.matrix()).array()).matrix());
 		}
+		return voxels.density(x - 1, y - 1, z - 1);
+	}
+	
+	float friction(Eigen::Vector3f const& v) const {
+		float t;
+		sample(v, NULL, NULL, &t);
+		return t;
+	}
+	
+	Eigen::Vector3f gradient(Eigen::Vector3f const& v) const {
+		Eigen::Vector3f r;
+		sample(v, NULL, &r, NULL);
 		return r;
 	}
 
-	Cell& cell(int i, int j, int k) {
-		return data[i + resolution[0]*(j + resolution[1]*k)];
+	//Range of samples [clo, chi) inside the box [lo, hi].  Returns false if
+	//there are none.
+	bool region_cells(
+		Eigen::Vector3f const& lo,
+		Eigen::Vector3f const& hi,
+		int* clo,
+		int* chi) const {
+		for(int i=0; i<3; ++i) {
+			clo[i] = std::max(0, (int)std::ceil((lo[i] - lower_bound[i]) * scale[i]));
+			chi[i] = std::min(resolution[i], (int)std::floor((hi[i] - lower_bound[i]) * scale[i]) + 1);
+			if(clo[i] >= chi[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//Writing through the reference gives the grid per-cell friction again;
+	//see VoxelGrid::get()
+	CellRef cell(int i, int j, int k) {
+		return voxels.get(i, j, k);
 	}
-	const Cell& cell(int i, int j, int k) const {
-		return data[i + resolution[0]*(j + resolution[1]*k)];
+	Cell cell(int i, int j, int k) const {
+		return voxels.get(i, j, k);
 	}
 
 	EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
 };
 
-//Reinitializes a puzzle with the given implicit function
+//Gradient of a density function, for placing vertices on sharp features.
+//Uses func.gradient() if the function has one (the CSG shapes do), and
+//otherwise the gradient of the solid's samples.
+template<typename ImplicitFunc_t>
+auto density_gradient(ImplicitFunc_t const& func, Solid const&, Eigen::Vector3f const& p, int)
+	-> decltype(func.gradient(p)) {
+	return func.gradient(p);
+}
+
+template<typename ImplicitFunc_t>
+Eigen::Vector3f density_gradient(ImplicitFunc_t const&, Solid const& solid, Eigen::Vector3f const& p, long) {
+	return solid.gradient(p);
+}
+
+//Builds the solid's mesh from its samples
 template<typename ImplicitFunc_t, typename StyleFunc_t>
-void setup_solid(Solid& solid, ImplicitFunc_t& func, StyleFunc_t& style_func) {
+void contour_solid(Solid& solid, ImplicitFunc_t const& func, StyleFunc_t& style_func) {
 	using namespace Eigen;
 	
+	auto samples = Mesh::lattice_samples([&](int x, int y, int z) {
+		return solid.lattice_density(x, y, z);
+	});
+	auto gradient = [&](Vector3f const& p) -> Vector3f {
+		return density_gradient(func, solid, p, 0);
+	};
+	const Array3f h = (solid.upper_bound - solid.lower_bound).array() / solid.resolution.array().cast<float>();
+	if(solid.flags & SOLID_ADAPTIVE) {
+		//Merged vertices belong to no single cell, so patch_mesh() can't
+		//be used on them
+		Mesh::adaptive_contour(
+			solid.mesh,
+			samples,
+			gradient,
+			style_func,
+			solid.lower_bound,
+			solid.upper_bound,
+			solid.resolution,
+			ADAPTIVE_ERROR * h.minCoeff());
+		solid.vertex_cells.clear();
+	}
+	else if(solid.flags & SOLID_SHARP_FEATURES) {
+		Mesh::dual_contour(
+			solid.mesh,
+			samples,
+			gradient,
+			style_func,
+			solid.lower_bound,
+			solid.upper_bound,
+			solid.resolution,
+			&solid.vertex_cells );
+	}
+	else {
+		Mesh::isocontour(
+			solid.mesh,
+			samples,
+			style_func,
+			solid.lower_bound,
+			solid.upper_bound,
+			solid.resolution,
+			&solid.vertex_cells );
+	}
 	
-	//Fill in data
-	Cell* ptr = &solid.data[0];
-	Eigen::Array3f step = (solid.upper_bound - solid.lower_bound).array() / (solid.resolution.array()).cast<float>();
+	if(solid.flags & SOLID_NO_ISLANDS) {
+		//Their vertices stay in their cells, so an edit which joins an
+		//island to the rest of the surface doesn't leave a hole
+		Mesh::remove_small_components(solid.mesh, MIN_ISLAND_TRIANGLES, true);
+	}
 	
-	Vector3f lb = solid.lower_bound;
-	for(int iz = solid.resolution[2]-1; iz>=0; --iz) {
-		lb[1] = solid.lower_bound[1];
-		for(int iy = solid.resolution[1]-1; iy>=0; --iy) {
-			lb[0] = solid.lower_bound[0];
-			for(int ix = solid.resolution[0]-1; ix>=0; --ix) {
-				*(ptr++) = func( lb );
-				lb[0] += step[0];			
-			}
-			lb[1] += step[1];
-		}
-		lb[2] += step[2];
+	//The mesh is only edited again by patch_mesh(), which unpacks it
+	solid.mesh.compact();
+	Mesh::estimate_normals(solid.mesh);
+	if(solid.flags & SOLID_LOW_POLY) {
+		//Collapsed vertices belong to no single cell either
+		Mesh::MeshSimplifier<Solid::SolidMesh, VertexMerge> simplifier(solid.mesh);
+		simplifier.simplify(LOW_POLY_ERROR * h.minCoeff());
+		simplifier.result(solid.mesh);
+		solid.vertex_cells.clear();
 	}
+	solid.optimize_mesh();
+}
+
+//Reinitializes a puzzle with the given implicit function.  func and
+//style_func are evaluated from several threads at once, so they must be
+//const and thread safe.  Styles should use PointRandom rather than
+//drand48(), so the mesh comes out the same every time.
+template<typename ImplicitFunc_t, typename StyleFunc_t>
+void setup_solid(Solid& solid, ImplicitFunc_t const& func, StyleFunc_t& style_func) {
+	using namespace Eigen;
 	
-	//Rebuild mesh
-	Mesh::isocontour(
-		solid.mesh,
-		solid,
-		style_func,
+	//Reuse a previous run's result if there is one
+	SolidCacheKey cache_key;
+	const bool cacheable = solid_cache_key(
+		solid.resolution,
 		solid.lower_bound,
 		solid.upper_bound,
-		solid.resolution );
+		solid.flags,
+		func,
+		style_func,
+		cache_key);
+	if(cacheable && load_cached_solid(solid, cache_key)) {
+		solid.setup_data();
+		return;
+	}
 	
-	Mesh::estimate_normals(solid.mesh);
+	//Fill in data, one z-slab per task
+	Eigen::Array3f step = (solid.upper_bound - solid.lower_bound).array() / (solid.resolution.array()).cast<float>();
+	solid.voxels.fill(func, solid.lower_bound, step);
+	
+	//Most levels use one friction value everywhere
+	solid.voxels.compact_friction();
+	
+	if(solid.flags & SOLID_DISTANCE_FIELD) {
+		solid.bake_distance_field();
+	}
+	
+	//Rebuild mesh, straight from the samples
+	contour_solid(solid, func, style_func);
+	
+	if(cacheable) {
+		save_cached_solid(solid, cache_key);
+	}
 	
 	//Generate display/collision stuff
 	solid.setup_data();
 }
 
+template<typename ImplicitFunc_t, typename StyleFunc_t>
+void Solid::update_region(
+	Eigen::Vector3f const& lo,
+	Eigen::Vector3f const& hi,
+	ImplicitFunc_t const& func,
+	StyleFunc_t& style_func) {
+	
+	int clo[3], chi[3];
+	if(!region_cells(lo, hi, clo, chi)) {
+		return;
+	}
+	
+	//Refill samples, keeping track of the change in mass
+	float J = 1.0 / (scale[0]*scale[1]*scale[2]);
+	mass -= J * voxels.positive_density_sum(clo, chi);
+	Eigen::Array3f step = (upper_bound - lower_bound).array() / resolution.array().cast<float>();
+	voxels.refill(func, lower_bound, step, clo, chi);
+	mass += J * voxels.positive_density_sum(clo, chi);
+	
+	if(distance_field) {
+		update_distance_field(clo, chi);
+	}
+	
+	if(flags & (SOLID_ADAPTIVE | SOLID_LOW_POLY)) {
+		mesh.clear();
+		contour_solid(*this, func, style_func);
+		setup_data();
+		return;
+	}
+	
+	patch_mesh(clo, chi,
+		[&](Eigen::Vector3f const& p) {
+			return style_func(p);
+		},
+		[&](Eigen::Vector3f const& p) -> Eigen::Vector3f {
+			return density_gradient(func, *this, p, 0);
+		});
+}
+
 //Forward reference
 #include "surface_coordinate.h"
 
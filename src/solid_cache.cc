@@ -0,0 +1,248 @@
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Eigen/Core>
+
+#include "solid.h"
+#include "solid_cache.h"
+
+using namespace std;
+using namespace Eigen;
+
+static const char* CACHE_DIR = "cache";
+static const unsigned CACHE_MAGIC = 0x31435352;		//"RSC1"
+static const int CACHE_VERSION = 1;
+
+struct CacheHeader {
+	unsigned		magic;
+	int				version;
+	SolidCacheKey	key;
+	int				vertex_size;
+	int				vertex_count;
+	int				triangle_count;
+	int				has_distance_field;
+};
+
+static bool cache_enabled = true;
+
+void set_solid_cache_enabled(bool enabled) {
+	cache_enabled = enabled;
+}
+
+//Deletes the entries, and any files left half written, of every build
+//but the one with this stamp
+static void prune_cache(SolidCacheKey stamp) {
+	char prefix[64];
+	snprintf(prefix, sizeof(prefix), "solid-%016llx-", stamp);
+	DIR* dir = opendir(CACHE_DIR);
+	if(!dir) {
+		return;
+	}
+	while(struct dirent* entry = readdir(dir)) {
+		if(strncmp(entry->d_name, "solid-", 6) == 0 &&
+		   strncmp(entry->d_name, prefix, strlen(prefix)) != 0) {
+			char path[512];
+			snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, entry->d_name);
+			remove(path);
+		}
+	}
+	closedir(dir);
+}
+
+//Stamp of this build: the executable's size and modification time, which
+//change whenever the game (and with it the level code) is rebuilt.
+//Returns false if the cache is off, or there is no executable to stat.
+static bool build_stamp(SolidCacheKey& stamp) {
+#ifdef NO_SOLID_CACHE
+	return false;
+#else
+	static int known = -1;
+	static SolidCacheKey value = 0;
+	if(known < 0) {
+		struct stat st;
+		known = stat("/proc/self/exe", &st) == 0;
+		if(known) {
+			SolidCacheHash h;
+			h.add(&st.st_size, sizeof(st.st_size));
+			h.add(&st.st_mtime, sizeof(st.st_mtime));
+			value = h.value;
+			prune_cache(value);
+		}
+	}
+	stamp = value;
+	return known && cache_enabled;
+#endif
+}
+
+//Mixes the build stamp into a key
+static SolidCacheKey build_key(SolidCacheKey stamp, SolidCacheKey key) {
+	SolidCacheHash h;
+	h.add(&stamp, sizeof(stamp));
+	h.add(&key, sizeof(key));
+	return h.value;
+}
+
+static void cache_path(SolidCacheKey stamp, SolidCacheKey key, char* path, int n) {
+	snprintf(path, n, "%s/solid-%016llx-%016llx.bin", CACHE_DIR, stamp, key);
+}
+
+template<typename T>
+static bool read_raw(const char*& ptr, const char* end, T* dst, size_t count) {
+	const size_t n = count * sizeof(T);
+	if(end - ptr < n) {
+		return false;
+	}
+	memcpy((void*)dst, ptr, n);
+	ptr += n;
+	return true;
+}
+
+//Parses a mapped cache file
+static bool read_solid(Solid& solid, SolidCacheKey key, const char* ptr, const char* end) {
+	CacheHeader header;
+	if(!read_raw(ptr, end, &header, 1) ||
+	   header.magic != CACHE_MAGIC ||
+	   header.version != CACHE_VERSION ||
+	   header.key != key ||
+	   header.vertex_size != sizeof(Vertex) ||
+	   header.has_distance_field != ((solid.flags & SOLID_DISTANCE_FIELD) != 0)) {
+		return false;
+	}
+	
+	if(!solid.voxels.read(ptr, end)) {
+		return false;
+	}
+	if(header.has_distance_field) {
+		if(!solid.distance_field) {
+			solid.distance_field = new VoxelGrid(solid.resolution, !solid.voxels.dense());
+		}
+		if(!solid.distance_field->read(ptr, end)) {
+			return false;
+		}
+	}
+	
+	//Check the mesh fits before touching it
+	const size_t mesh_bytes =
+		header.vertex_count * (sizeof(Vertex) + sizeof(Vector3i)) +
+		header.triangle_count * 3 * sizeof(int);
+	if(header.vertex_count < 0 || header.triangle_count < 0 || end - ptr < mesh_bytes) {
+		return false;
+	}
+	
+	Solid::SolidMesh::VertexList vertices(solid.mesh.get_allocator());
+	Solid::SolidMesh::TriangleList triangles(solid.mesh.get_allocator());
+	vertices.resize(header.vertex_count);
+	triangles.resize(header.triangle_count);
+	if(header.vertex_count > 0) {
+		read_raw(ptr, end, &vertices[0], header.vertex_count);
+	}
+	if(header.triangle_count > 0) {
+		read_raw(ptr, end, triangles[0].v, 3 * header.triangle_count);
+	}
+	for(int t=0; t<header.triangle_count; ++t) {
+		for(int i=0; i<3; ++i) {
+			if(triangles[t].v[i] < 0 || triangles[t].v[i] >= header.vertex_count) {
+				return false;
+			}
+		}
+	}
+	solid.mesh.assign(std::move(vertices), std::move(triangles));
+	solid.vertex_cells.resize(header.vertex_count);
+	if(header.vertex_count > 0) {
+		read_raw(ptr, end, &solid.vertex_cells[0], header.vertex_count);
+	}
+	return true;
+}
+
+bool load_cached_solid(Solid& solid, SolidCacheKey key) {
+	SolidCacheKey stamp;
+	if(!build_stamp(stamp)) {
+		return false;
+	}
+	char path[256];
+	cache_path(stamp, key, path, sizeof(path));
+	key = build_key(stamp, key);
+	
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if(fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		return false;
+	}
+	
+	const char* ptr = (const char*)data;
+	bool hit = read_solid(solid, key, ptr, ptr + st.st_size);
+	munmap(data, st.st_size);
+	
+	if(!hit) {
+		solid.mesh.clear();
+		solid.vertex_cells.clear();
+	}
+	return hit;
+}
+
+void save_cached_solid(Solid const& solid, SolidCacheKey key) {
+	SolidCacheKey stamp;
+	if(!build_stamp(stamp)) {
+		return;
+	}
+	char path[256], tmp_path[272];
+	cache_path(stamp, key, path, sizeof(path));
+	key = build_key(stamp, key);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+	
+	mkdir(CACHE_DIR, 0755);
+	FILE* file = fopen(tmp_path, "wb");
+	if(!file) {
+		return;
+	}
+	
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic				= CACHE_MAGIC;
+	header.version				= CACHE_VERSION;
+	header.key					= key;
+	header.vertex_size			= sizeof(Vertex);
+	header.vertex_count			= solid.mesh.vertices().size();
+	header.triangle_count		= solid.mesh.triangles().size();
+	header.has_distance_field	= solid.has_distance_field();
+	fwrite(&header, sizeof(header), 1, file);
+	
+	solid.voxels.write(file);
+	if(solid.distance_field) {
+		solid.distance_field->write(file);
+	}
+	
+	if(header.vertex_count > 0) {
+		fwrite(&solid.mesh.vertices()[0], sizeof(Vertex), header.vertex_count, file);
+	}
+	if(header.triangle_count > 0) {
+		fwrite(&solid.mesh.triangles()[0], 3 * sizeof(int), header.triangle_count, file);
+	}
+	vector<Vector3i> cells(solid.vertex_cells);
+	cells.resize(header.vertex_count, Vector3i(-1, -1, -1));
+	if(header.vertex_count > 0) {
+		fwrite(&cells[0], sizeof(Vector3i), header.vertex_count, file);
+	}
+	
+	//Only complete files get the real name
+	bool ok = !ferror(file);
+	ok = (fclose(file) == 0) && ok;
+	if(!ok || rename(tmp_path, path) != 0) {
+		remove(tmp_path);
+	}
+}
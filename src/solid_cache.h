@@ -0,0 +1,113 @@
+#ifndef SOLID_CACHE_H
+#define SOLID_CACHE_H
+
+#include <cstring>
+#include <typeinfo>
+#include <type_traits>
+#include <Eigen/Core>
+
+//Generated solids (samples, distance field and mesh) are kept on disk, so
+//loading a level a second time just maps a file instead of filling and
+//contouring again.  Files are named after a stamp of the executable and a
+//hash of everything which goes into setup_solid().  Entries left by other
+//builds are deleted the first time the cache is used.
+//
+//The cache is off when the game is built with NO_SOLID_CACHE, after
+//set_solid_cache_enabled(false), and wherever the executable can't be
+//stamped, since then a rebuilt level could load stale geometry.
+
+struct Solid;
+
+typedef unsigned long long SolidCacheKey;
+
+//64 bit FNV-1a
+struct SolidCacheHash {
+	SolidCacheKey value;
+
+	SolidCacheHash() : value(14695981039346656037ULL) {}
+
+	void add(const void* data, size_t n) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		for(size_t i=0; i<n; ++i) {
+			value = (value ^ bytes[i]) * 1099511628211ULL;
+		}
+	}
+	void add(const char* str) {
+		add(str, strlen(str));
+	}
+	void add(float x) {
+		add(&x, sizeof(float));
+	}
+	void add(Eigen::Vector3f const& v) {
+		add(v.data(), 3 * sizeof(float));
+	}
+	void add(Eigen::Matrix3f const& m) {
+		add(m.data(), 9 * sizeof(float));
+	}
+	
+	//Adds the type of a functor, and its contents through its cache_key()
+	//member if it has any.  Raw bytes would take in padding, and a pointer
+	//can see different data under the same value, so functors with state
+	//but no cache_key() can't be hashed and this returns false.
+	template<typename Func>
+	bool add_functor(Func const& func) {
+		add(typeid(Func).name());
+		return add_contents(func, std::integral_constant<bool, HasCacheKey<Func>::value>());
+	}
+	
+private:
+	//Whether Func has a void cache_key(SolidCacheHash&) const
+	template<typename Func>
+	struct HasCacheKey {
+		template<typename T> static char test(decltype(&T::cache_key));
+		template<typename T> static long test(...);
+		static const bool value = sizeof(test<Func>(0)) == 1;
+	};
+	
+	template<typename Func>
+	bool add_contents(Func const& func, std::true_type) {
+		func.cache_key(*this);
+		return true;
+	}
+	template<typename Func>
+	bool add_contents(Func const&, std::false_type) {
+		return std::is_empty<Func>::value;
+	}
+};
+
+//Key for a solid made by setup_solid().  Entries are also tied to the
+//executable, so rebuilding the game (and with it the level code) drops them.
+//Returns false if func or style_func can't be hashed, in which case the
+//solid isn't cached.
+template<typename ImplicitFunc_t, typename StyleFunc_t>
+bool solid_cache_key(
+	Eigen::Vector3i const& resolution,
+	Eigen::Vector3f const& lo,
+	Eigen::Vector3f const& hi,
+	int flags,
+	ImplicitFunc_t const& func,
+	StyleFunc_t const& style_func,
+	SolidCacheKey& key) {
+	SolidCacheHash h;
+	if(!h.add_functor(func) || !h.add_functor(style_func)) {
+		return false;
+	}
+	h.add(resolution.data(), 3 * sizeof(int));
+	h.add(lo);
+	h.add(hi);
+	h.add(&flags, sizeof(int));
+	key = h.value;
+	return true;
+}
+
+//Turns the cache off for the rest of the run, or back on
+void set_solid_cache_enabled(bool enabled);
+
+//Fills in a solid from the cache.  Returns false on a miss, leaving the
+//solid to be generated as usual.
+bool load_cached_solid(Solid& solid, SolidCacheKey key);
+
+//Stores a generated solid.  Failures are ignored.
+void save_cached_solid(Solid const& solid, SolidCacheKey key);
+
+#endif
@@ -164,7 +164,6 @@ struct IntrinsicCoordinate {
 		while(v_mag > 1e-8) {
 				
 			//Calculate tangent space
-			auto tri = solid->mesh.triangle(triangle_index);
 			auto verts = triangle_vertices();
 			Vector3f du = verts[2] - verts[0],
 					 dv = verts[1] - verts[0];			
@@ -216,18 +215,10 @@ struct IntrinsicCoordinate {
 				break;
 			}
 			
-			//Otherwise, find next triangle, and continue advecting
-			int e[3];
-			for(int i=0; i<3; ++i) {
-				e[i] = tri.v[(last_edge+i)%3];
-			}
-			auto ntris = solid->mesh.vertex_incidence(e[1]);
-			for(int i=0; i<ntris.size(); ++i) {
-				auto ntri = solid->mesh.triangle(ntris[i]);
-				if(ntri.index_of(e[2]) >= 0 && ntri.index_of(e[0]) < 0) {
-					triangle_index = ntris[i];
-					break;
-				}
+			//Otherwise, step across the edge we left by, and continue advecting
+			const int next = solid->mesh.triangle_neighbor(triangle_index, last_edge);
+			if(next >= 0) {
+				triangle_index = next;
 			}
 		}
 		
@@ -0,0 +1,946 @@
+#ifndef VOXELS_H
+#define VOXELS_H
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <type_traits>
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Core>
+#include <mesh/implementation/util.h>
+#include <mesh/implementation/parallel.h>
+
+#include "interval.h"
+
+struct Cell {
+	float density, friction;
+
+	//Friction ~ 1/number of seconds before stopping
+};
+
+//A writable reference to a cell stored in a VoxelGrid
+struct CellRef {
+	float& density;
+	float& friction;
+
+	CellRef(float& d, float& f) : density(d), friction(f) {}
+
+	CellRef& operator=(Cell const& c) {
+		density = c.density;
+		friction = c.friction;
+		return *this;
+	}
+
+	operator Cell() const {
+		Cell c;
+		c.density = density;
+		c.friction = friction;
+		return c;
+	}
+};
+
+//Storage for the samples of a solid.
+//
+//Density and friction live in separate, cache line aligned planes so that
+//density-only lookups don't pull friction through the cache.  When every
+//cell has the same friction the friction plane can be dropped, after which
+//all cells share a single friction value.
+//
+//A grid is either dense (one plane covering every cell) or sparse.  Sparse
+//grids are split into 8^3 bricks, and only bricks in a narrow band around
+//the zero level set keep their samples.  Every other brick is replaced by a
+//single uniform value with the same sign.
+struct VoxelGrid {
+
+	//Alignment of the sample planes in bytes
+	enum { PLANE_ALIGNMENT = 64 };
+
+	//Brick dimensions for sparse grids
+	enum {
+		BRICK_SHIFT	= 3,
+		BRICK_SIZE	= 1 << BRICK_SHIFT,
+		BRICK_MASK	= BRICK_SIZE - 1,
+		BRICK_CELLS	= BRICK_SIZE * BRICK_SIZE * BRICK_SIZE,
+	};
+
+	const Eigen::Vector3i resolution;
+
+	VoxelGrid(Eigen::Vector3i const& res, bool sparse = false) :
+		resolution(res),
+		density_plane(NULL),
+		friction_plane(NULL),
+		uniform_friction(0.f),
+		has_friction(true) {
+		if(sparse) {
+			for(int i=0; i<3; ++i) {
+				brick_res[i] = (res[i] + BRICK_MASK) >> BRICK_SHIFT;
+			}
+			const int nb = brick_res[0] * brick_res[1] * brick_res[2];
+			Cell zero = { 0.f, 0.f };
+			brick_density.resize(nb, NULL);
+			brick_friction.resize(nb, NULL);
+			brick_uniform.resize(nb, zero);
+		}
+		else {
+			brick_res = Eigen::Vector3i(0, 0, 0);
+			density_plane = alloc_plane(size());
+			friction_plane = alloc_plane(size());
+		}
+	}
+	~VoxelGrid() {
+		free(density_plane);
+		free(friction_plane);
+		for(int b=brick_density.size()-1; b>=0; --b) {
+			free(brick_density[b]);
+			free(brick_friction[b]);
+		}
+	}
+
+	int size() const {
+		return resolution[0] * resolution[1] * resolution[2];
+	}
+	bool dense() const {
+		return density_plane != NULL;
+	}
+	int index(int i, int j, int k) const {
+		return i + resolution[0] * (j + resolution[1] * k);
+	}
+
+	//Raw planes of a dense grid, indexed by index().  Both are NULL for
+	//sparse grids, and friction_data() is NULL once friction is constant.
+	const float* density_data() const	{ return density_plane; }
+	const float* friction_data() const	{ return friction_plane; }
+
+	bool constant_friction() const		{ return !has_friction; }
+	float constant_friction_value() const	{ return uniform_friction; }
+
+	float density(int i, int j, int k) const {
+		if(density_plane) {
+			return density_plane[index(i, j, k)];
+		}
+		const int b = brick_of(i, j, k);
+		const float* ptr = brick_density[b];
+		return ptr ? ptr[brick_offset(i, j, k)] : brick_uniform[b].density;
+	}
+	float friction(int i, int j, int k) const {
+		if(!has_friction) {
+			return uniform_friction;
+		}
+		if(friction_plane) {
+			return friction_plane[index(i, j, k)];
+		}
+		const int b = brick_of(i, j, k);
+		const float* ptr = brick_friction[b];
+		return ptr ? ptr[brick_offset(i, j, k)] : brick_uniform[b].friction;
+	}
+
+	Cell get(int i, int j, int k) const {
+		Cell c;
+		c.density = density(i, j, k);
+		c.friction = friction(i, j, k);
+		return c;
+	}
+
+	//Writable reference.  Uniform bricks are expanded first, and so is
+	//friction if compact_friction() shared it, or writing one cell would
+	//change them all.
+	CellRef get(int i, int j, int k) {
+		expand_friction();
+		if(density_plane) {
+			const int idx = index(i, j, k);
+			return CellRef(density_plane[idx], friction_plane[idx]);
+		}
+		const int b = brick_of(i, j, k), o = brick_offset(i, j, k);
+		expand_brick(b);
+		return CellRef(brick_density[b][o], brick_friction[b][o]);
+	}
+
+	//Stores a cell, leaving friction shared if it doesn't change
+	void set(int i, int j, int k, Cell const& c) {
+		if(has_friction || c.friction != uniform_friction) {
+			get(i, j, k) = c;
+			return;
+		}
+		if(density_plane) {
+			density_plane[index(i, j, k)] = c.density;
+			return;
+		}
+		const int b = brick_of(i, j, k);
+		expand_brick(b);
+		brick_density[b][brick_offset(i, j, k)] = c.density;
+	}
+
+	//Fetches the densities at the 8 corners of the cell (i,j,k), ordered
+	//with x varying fastest.  Cells must satisfy i+1 < resolution[0] etc.
+	void density_corners(int i, int j, int k, float* c) const {
+		if(density_plane) {
+			plane_corners(density_plane, index(i, j, k), c);
+		}
+		else {
+			brick_corners(brick_density, &Cell::density, i, j, k, c);
+		}
+	}
+	void friction_corners(int i, int j, int k, float* c) const {
+		if(!has_friction) {
+			for(int l=0; l<8; ++l) {
+				c[l] = uniform_friction;
+			}
+		}
+		else if(friction_plane) {
+			plane_corners(friction_plane, index(i, j, k), c);
+		}
+		else {
+			brick_corners(brick_friction, &Cell::friction, i, j, k, c);
+		}
+	}
+
+	//How a brick outside the narrow band is replaced by a single value
+	enum CollapseMode {
+		//Mean of the brick, which keeps the sign and the total mass
+		COLLAPSE_MEAN,
+		//Smallest magnitude in the brick, with the common sign.  Conservative
+		//for distance fields.
+		COLLAPSE_NEAREST,
+	};
+
+	//Evaluates func at every sample (lo + step * (i,j,k)).  Sparse grids are
+	//filled one layer of bricks at a time, and bricks outside the narrow band
+	//are collapsed as soon as their neighbors are known, so the full grid is
+	//never resident.
+	//
+	//Cells are evaluated in parallel (z-slabs for dense grids, bricks within a
+	//layer for sparse ones), so func must be safe to call from several threads
+	//at once.  The result doesn't depend on the number of threads.
+	//
+	//If func also has a method
+	//
+	//	Interval bound(IntervalVector const& box) const
+	//
+	//returning a range containing every density inside box, each slab or
+	//brick is subdivided as an octree instead.  Blocks whose density provably
+	//doesn't change sign get the bound nearest to zero without calling func
+	//per cell.  Bounds include a two cell border, so no cell next to a culled
+	//one is on a crossing edge and the contour doesn't change.  Only the sign
+	//of a culled block is right, though: the density is flat across it, so
+	//its gradient there is zero, and sums such as Solid::mass come out low.
+	template<typename Func>
+	void fill(Func const& func, Eigen::Vector3f const& lo, Eigen::Array3f const& step) {
+		typedef typename std::conditional<
+			has_interval_bound<Func>::value,
+			PointBound<Func>,
+			NoBound>::type Bound;
+		fill_cells(
+			[&](int i, int j, int k) {
+				return func(sample_point(lo, step, i, j, k));
+			},
+			Bound(func, lo, step));
+	}
+
+	//Same as fill(), but func is called with the integer coordinates of each
+	//cell and returns its Cell
+	template<typename Func>
+	void fill_cells(Func const& func, CollapseMode mode = COLLAPSE_MEAN) {
+		fill_cells(func, NoBound(), mode);
+	}
+
+	//Same as fill_cells(), with bound(lo, hi) giving the range of densities
+	//over the cells [lo, hi) and a two cell border around them
+	template<typename Func, typename Bound>
+	void fill_cells(Func const& func, Bound const& bound, CollapseMode mode = COLLAPSE_MEAN) {
+		expand_friction();
+
+		if(density_plane) {
+			const int slabs = (resolution[2] + BRICK_MASK) >> BRICK_SHIFT;
+			Mesh::impl::parallel_for(0, slabs, [&](int s) {
+				const int	lo[3] = { 0, 0, s << BRICK_SHIFT },
+							hi[3] = { resolution[0], resolution[1],
+								std::min(lo[2] + (int)BRICK_SIZE, resolution[2]) };
+				fill_block(func, bound, lo, hi, [&](int i, int j, int k, Cell const& c) {
+					const int idx = index(i, j, k);
+					density_plane[idx] = c.density;
+					friction_plane[idx] = c.friction;
+				});
+			});
+			return;
+		}
+
+		//Sign of each brick: 1 = all positive, -1 = all negative, 0 = mixed
+		std::vector<signed char> sign(brick_density.size(), 0);
+		const int layer = brick_res[0] * brick_res[1];
+		for(int bk=0; bk<brick_res[2]; ++bk) {
+			Mesh::impl::parallel_for(0, layer, [&](int l) {
+				const int bi = l % brick_res[0], bj = l / brick_res[0];
+				const int b = l + layer * bk;
+				const int	lo[3] = { bi << BRICK_SHIFT, bj << BRICK_SHIFT, bk << BRICK_SHIFT },
+							hi[3] = {
+								std::min(lo[0] + (int)BRICK_SIZE, resolution[0]),
+								std::min(lo[1] + (int)BRICK_SIZE, resolution[1]),
+								std::min(lo[2] + (int)BRICK_SIZE, resolution[2]) };
+
+				//Whole brick culled, never allocate it
+				if(Bound::enabled) {
+					Interval r = bound(lo, hi);
+					if(can_cull(r, lo, hi)) {
+						set_uniform_brick(b, bounded_cell(func, r, lo, hi));
+						sign[b] = (r.lo > 0) ? 1 : -1;
+						return;
+					}
+				}
+
+				expand_brick(b);
+				float* d = brick_density[b];
+				float* f = brick_friction[b];
+				fill_block(func, bound, lo, hi, [&](int i, int j, int k, Cell const& c) {
+					const int o = brick_offset(i, j, k);
+					d[o] = c.density;
+					f[o] = c.friction;
+				});
+
+				bool pos = true, neg = true;
+				for_each_brick_cell(bi, bj, bk, [&](int i, int j, int k, int o) {
+					pos = pos && (d[o] > FP_TOLERANCE);
+					neg = neg && (d[o] < -FP_TOLERANCE);
+				});
+				sign[b] = pos ? 1 : (neg ? -1 : 0);
+			});
+			if(bk > 0) {
+				collapse_layer(bk-1, sign, mode);
+			}
+		}
+		collapse_layer(brick_res[2]-1, sign, mode);
+	}
+
+	//Re-evaluates func at the samples of the cells [lo, hi) only, leaving the
+	//rest of the grid alone.  Bricks of a sparse grid which overlap the region
+	//are expanded, and stay expanded until the next fill().
+	template<typename Func>
+	void refill(
+		Func const& func,
+		Eigen::Vector3f const& lo,
+		Eigen::Array3f const& step,
+		const int* clo,
+		const int* chi) {
+		typedef typename std::conditional<
+			has_interval_bound<Func>::value,
+			PointBound<Func>,
+			NoBound>::type Bound;
+		refill_cells(
+			[&](int i, int j, int k) {
+				return func(sample_point(lo, step, i, j, k));
+			},
+			Bound(func, lo, step),
+			clo,
+			chi);
+	}
+
+	//Same as refill(), but func is called with the integer coordinates of
+	//each cell
+	template<typename Func>
+	void refill_cells(Func const& func, const int* lo, const int* hi) {
+		refill_cells(func, NoBound(), lo, hi);
+	}
+
+	template<typename Func, typename Bound>
+	void refill_cells(Func const& func, Bound const& bound, const int* lo, const int* hi) {
+		const int nx = hi[0] - lo[0], ny = hi[1] - lo[1], nz = hi[2] - lo[2];
+		if(nx <= 0 || ny <= 0 || nz <= 0) {
+			return;
+		}
+
+		//Evaluate first, so the friction plane only comes back if needed
+		std::vector<Cell> cells(nx * ny * nz);
+		const int slabs = (nz + BRICK_MASK) >> BRICK_SHIFT;
+		Mesh::impl::parallel_for(0, slabs, [&](int s) {
+			const int	slo[3] = { lo[0], lo[1], lo[2] + (s << BRICK_SHIFT) },
+						shi[3] = { hi[0], hi[1], std::min(slo[2] + (int)BRICK_SIZE, hi[2]) };
+			fill_block(func, bound, slo, shi, [&](int i, int j, int k, Cell const& c) {
+				cells[(i - lo[0]) + nx * ((j - lo[1]) + ny * (k - lo[2]))] = c;
+			});
+		});
+		if(!has_friction) {
+			for(int c=cells.size()-1; c>=0; --c) {
+				if(cells[c].friction != uniform_friction) {
+					expand_friction();
+					break;
+				}
+			}
+		}
+
+		if(!density_plane) {
+			for(int bk=lo[2]>>BRICK_SHIFT; bk<=(hi[2]-1)>>BRICK_SHIFT; ++bk)
+			for(int bj=lo[1]>>BRICK_SHIFT; bj<=(hi[1]-1)>>BRICK_SHIFT; ++bj)
+			for(int bi=lo[0]>>BRICK_SHIFT; bi<=(hi[0]-1)>>BRICK_SHIFT; ++bi) {
+				expand_brick(bi + brick_res[0] * (bj + brick_res[1] * bk));
+			}
+		}
+
+		Mesh::impl::parallel_for(0, nz, [&](int z) {
+			int idx = z * nx * ny;
+			const int k = lo[2] + z;
+			for(int j=lo[1]; j<hi[1]; ++j)
+			for(int i=lo[0]; i<hi[0]; ++i) {
+				Cell const& c = cells[idx++];
+				float *d, *f;
+				if(density_plane) {
+					d = density_plane + index(i, j, k);
+					f = friction_plane ? friction_plane + index(i, j, k) : NULL;
+				}
+				else {
+					const int b = brick_of(i, j, k), o = brick_offset(i, j, k);
+					d = brick_density[b] + o;
+					f = has_friction ? brick_friction[b] + o : NULL;
+				}
+				*d = c.density;
+				if(f) {
+					*f = c.friction;
+				}
+			}
+		});
+	}
+
+	//Trilinear interpolation of density within cell iv at offset fv.  The
+	//gradient is in grid units.  Either output may be NULL.
+	void interpolate(
+		Eigen::Vector3i const& iv,
+		Eigen::Vector3f const& fv,
+		float* value,
+		Eigen::Vector3f* gradient) const {
+		float c[8];
+		density_corners(iv[0], iv[1], iv[2], c);
+		float	c000 = c[0],	c100 = c[1],
+				c010 = c[2],	c110 = c[3],
+				c001 = c[4],	c101 = c[5],
+				c011 = c[6],	c111 = c[7];
+		
+		float	a00 = c000 + fv[0] * (c100 - c000),
+				a10 = c010 + fv[0] * (c110 - c010),
+				a01 = c001 + fv[0] * (c101 - c001),
+				a11 = c011 + fv[0] * (c111 - c011),
+				b0  = a00 + fv[1] * (a10 - a00),
+				b1  = a01 + fv[1] * (a11 - a01);
+		
+		if(value) {
+			*value = b0 + fv[2] * (b1 - b0);
+		}
+		if(gradient) {
+			float	e0 = (c100 - c000) + fv[1] * ((c110 - c010) - (c100 - c000)),
+					e1 = (c101 - c001) + fv[1] * ((c111 - c011) - (c101 - c001));
+			(*gradient)[0] = e0 + fv[2] * (e1 - e0);
+			(*gradient)[1] = (a10 - a00) + fv[2] * ((a11 - a01) - (a10 - a00));
+			(*gradient)[2] = b1 - b0;
+		}
+	}
+
+	//Frees the friction plane, replacing it with a single value
+	void drop_friction(float f) {
+		free(friction_plane);
+		friction_plane = NULL;
+		for(int b=brick_friction.size()-1; b>=0; --b) {
+			free(brick_friction[b]);
+			brick_friction[b] = NULL;
+		}
+		uniform_friction = f;
+		has_friction = false;
+	}
+
+	//Drops the friction plane if every cell has the same friction.
+	//Returns true if the plane was dropped.
+	bool compact_friction() {
+		if(!has_friction) {
+			return true;
+		}
+		if(friction_plane) {
+			const int n = size();
+			const float f = friction_plane[0];
+			for(int i=1; i<n; ++i) {
+				if(friction_plane[i] != f) {
+					return false;
+				}
+			}
+			drop_friction(f);
+			return true;
+		}
+		const float f = friction(0, 0, 0);
+		for(int b=brick_friction.size()-1; b>=0; --b) {
+			const float* ptr = brick_friction[b];
+			if(!ptr) {
+				if(brick_uniform[b].friction != f) {
+					return false;
+				}
+				continue;
+			}
+			for(int o=0; o<BRICK_CELLS; ++o) {
+				if(ptr[o] != f) {
+					return false;
+				}
+			}
+		}
+		drop_friction(f);
+		return true;
+	}
+
+	//Sum of the positive densities of the cells [lo, hi)
+	double positive_density_sum(const int* lo, const int* hi) const {
+		double s = 0.0;
+		for(int k=lo[2]; k<hi[2]; ++k)
+		for(int j=lo[1]; j<hi[1]; ++j)
+		for(int i=lo[0]; i<hi[0]; ++i) {
+			const float d = density(i, j, k);
+			if(d > 0) {
+				s += d;
+			}
+		}
+		return s;
+	}
+
+	//Sum of all positive densities
+	double positive_density_sum() const {
+		double s = 0.0;
+		if(density_plane) {
+			for(int i=size()-1; i>=0; --i) {
+				if(density_plane[i] > 0) {
+					s += density_plane[i];
+				}
+			}
+			return s;
+		}
+		for(int bk=0; bk<brick_res[2]; ++bk)
+		for(int bj=0; bj<brick_res[1]; ++bj)
+		for(int bi=0; bi<brick_res[0]; ++bi) {
+			const int b = bi + brick_res[0] * (bj + brick_res[1] * bk);
+			const float* ptr = brick_density[b];
+			const float u = brick_uniform[b].density;
+			for_each_brick_cell(bi, bj, bk, [&](int i, int j, int k, int o) {
+				const float d = ptr ? ptr[o] : u;
+				if(d > 0) {
+					s += d;
+				}
+			});
+		}
+		return s;
+	}
+
+	//Binary dump of the samples, read back by read()
+	void write(FILE* file) const {
+		const int header[2] = { dense(), has_friction };
+		fwrite(header, sizeof(header), 1, file);
+		fwrite(&uniform_friction, sizeof(float), 1, file);
+		if(density_plane) {
+			fwrite(density_plane, sizeof(float), size(), file);
+			if(friction_plane) {
+				fwrite(friction_plane, sizeof(float), size(), file);
+			}
+			return;
+		}
+		for(int b=0; b<brick_density.size(); ++b) {
+			const int expanded = (brick_density[b] != NULL);
+			fwrite(&expanded, sizeof(int), 1, file);
+			fwrite(&brick_uniform[b], sizeof(Cell), 1, file);
+			if(expanded) {
+				fwrite(brick_density[b], sizeof(float), BRICK_CELLS, file);
+				if(has_friction) {
+					fwrite(brick_friction[b], sizeof(float), BRICK_CELLS, file);
+				}
+			}
+		}
+	}
+
+	//Loads a dump made by write() from a grid with the same resolution and
+	//storage, advancing ptr.  Returns false if the data doesn't match, in
+	//which case the grid must be filled again.
+	bool read(const char*& ptr, const char* end) {
+		int header[2];
+		float f;
+		if(!read_raw(ptr, end, header, sizeof(header)) ||
+		   !read_raw(ptr, end, &f, sizeof(float)) ||
+		   header[0] != dense()) {
+			return false;
+		}
+		if(header[1]) {
+			expand_friction();
+		}
+		else {
+			drop_friction(f);
+		}
+		if(density_plane) {
+			return read_raw(ptr, end, density_plane, size() * sizeof(float)) &&
+				(!friction_plane || read_raw(ptr, end, friction_plane, size() * sizeof(float)));
+		}
+		for(int b=0; b<brick_density.size(); ++b) {
+			int expanded;
+			Cell c;
+			if(!read_raw(ptr, end, &expanded, sizeof(int)) ||
+			   !read_raw(ptr, end, &c, sizeof(Cell))) {
+				return false;
+			}
+			if(!expanded) {
+				set_uniform_brick(b, c);
+				continue;
+			}
+			brick_uniform[b] = c;
+			expand_brick(b);
+			if(!read_raw(ptr, end, brick_density[b], BRICK_CELLS * sizeof(float)) ||
+			   (has_friction && !read_raw(ptr, end, brick_friction[b], BRICK_CELLS * sizeof(float)))) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	//Number of bytes used by sample storage
+	size_t memory_usage() const {
+		size_t bytes = 0;
+		if(density_plane)	bytes += size() * sizeof(float);
+		if(friction_plane)	bytes += size() * sizeof(float);
+		for(int b=brick_density.size()-1; b>=0; --b) {
+			if(brick_density[b])	bytes += BRICK_CELLS * sizeof(float);
+			if(brick_friction[b])	bytes += BRICK_CELLS * sizeof(float);
+		}
+		bytes += brick_density.size() * (2 * sizeof(float*) + sizeof(Cell));
+		return bytes;
+	}
+
+private:
+	float*	density_plane;
+	float*	friction_plane;
+	float	uniform_friction;
+	bool	has_friction;
+
+	Eigen::Vector3i		brick_res;
+	std::vector<float*>	brick_density, brick_friction;
+	std::vector<Cell>	brick_uniform;
+
+	//Detects a bound() method on a density functor
+	template<typename Func>
+	struct has_interval_bound {
+		template<typename F> static char test(decltype(&F::bound));
+		template<typename F> static long test(...);
+		enum { value = (sizeof(test<Func>(0)) == 1) };
+	};
+
+	//Bounds a functor with a bound() method over a block of cells
+	template<typename Func>
+	struct PointBound {
+		enum { enabled = 1 };
+		Func const& func;
+		const Eigen::Vector3f lo;
+		const Eigen::Array3f step;
+
+		PointBound(Func const& f, Eigen::Vector3f const& l, Eigen::Array3f const& s) :
+			func(f), lo(l), step(s) {}
+
+		Interval operator()(const int* a, const int* b) const {
+			return func.bound(IntervalVector(
+				sample_point(lo, step, a[0]-2, a[1]-2, a[2]-2),
+				sample_point(lo, step, b[0]+1, b[1]+1, b[2]+1)));
+		}
+		EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+	};
+
+	//For functors without bounds
+	struct NoBound {
+		enum { enabled = 0 };
+
+		NoBound() {}
+		template<typename Func>
+		NoBound(Func const&, Eigen::Vector3f const&, Eigen::Array3f const&) {}
+
+		Interval operator()(const int*, const int*) const {
+			return Interval(-HUGE_VALF, HUGE_VALF);
+		}
+	};
+
+	//True if the cells [lo, hi) can be given a single value, because every
+	//density in r has the same sign as far as the contour is concerned.  The
+	//margin covers rounding error in the bound.  The contour reads samples
+	//outside the grid as negative, so positive blocks on the border of the
+	//grid are never culled.
+	bool can_cull(Interval const& r, const int* lo, const int* hi) const {
+		const float tol = FP_TOLERANCE + 1e-5f * std::max(std::abs(r.lo), std::abs(r.hi));
+		if(r.hi < -tol) {
+			return true;
+		}
+		if(r.lo > tol) {
+			for(int a=0; a<3; ++a) {
+				if(lo[a] < 2 || hi[a] > resolution[a] - 3) {
+					return false;
+				}
+			}
+			return true;
+		}
+		return false;
+	}
+
+	//Value stored for a culled block: the bound nearest zero, and the friction
+	//at the middle of the block.  The density keeps its sign but none of its
+	//slope; see fill().
+	template<typename Func>
+	static Cell bounded_cell(Func const& func, Interval const& r, const int* lo, const int* hi) {
+		Cell c = func(
+			(lo[0] + hi[0] - 1) / 2,
+			(lo[1] + hi[1] - 1) / 2,
+			(lo[2] + hi[2] - 1) / 2);
+		c.density = (r.lo > 0) ? r.lo : r.hi;
+		return c;
+	}
+
+	//Evaluates the cells [lo, hi), subdividing as an octree when there is a
+	//bound
+	template<typename Func, typename Bound, typename Store>
+	void fill_block(
+		Func const& func,
+		Bound const& bound,
+		const int* lo,
+		const int* hi,
+		Store const& store) const {
+
+		if(Bound::enabled) {
+			Interval r = bound(lo, hi);
+			if(can_cull(r, lo, hi)) {
+				const Cell c = bounded_cell(func, r, lo, hi);
+				for(int k=lo[2]; k<hi[2]; ++k)
+				for(int j=lo[1]; j<hi[1]; ++j)
+				for(int i=lo[0]; i<hi[0]; ++i) {
+					store(i, j, k, c);
+				}
+				return;
+			}
+
+			if(	hi[0] - lo[0] > 2 ||
+				hi[1] - lo[1] > 2 ||
+				hi[2] - lo[2] > 2 ) {
+				const int mid[3] = {
+					lo[0] + (hi[0] - lo[0]) / 2,
+					lo[1] + (hi[1] - lo[1]) / 2,
+					lo[2] + (hi[2] - lo[2]) / 2 };
+				for(int octant=0; octant<8; ++octant) {
+					int clo[3], chi[3];
+					bool empty = false;
+					for(int a=0; a<3; ++a) {
+						const bool upper = (octant >> a) & 1;
+						clo[a] = upper ? mid[a] : lo[a];
+						chi[a] = upper ? hi[a] : mid[a];
+						empty = empty || (clo[a] == chi[a]);
+					}
+					if(!empty) {
+						fill_block(func, bound, clo, chi, store);
+					}
+				}
+				return;
+			}
+		}
+
+		for(int k=lo[2]; k<hi[2]; ++k)
+		for(int j=lo[1]; j<hi[1]; ++j)
+		for(int i=lo[0]; i<hi[0]; ++i) {
+			store(i, j, k, func(i, j, k));
+		}
+	}
+
+	static Eigen::Vector3f sample_point(
+		Eigen::Vector3f const& lo,
+		Eigen::Array3f const& step,
+		int i, int j, int k) {
+		return (lo.array() + step * Eigen::Array3f(i, j, k)).matrix();
+	}
+
+	static bool read_raw(const char*& ptr, const char* end, void* dst, size_t n) {
+		if(end - ptr < n) {
+			return false;
+		}
+		memcpy(dst, ptr, n);
+		ptr += n;
+		return true;
+	}
+
+	static float* alloc_plane(int n) {
+		void* ptr = NULL;
+		if(posix_memalign(&ptr, PLANE_ALIGNMENT, n * sizeof(float)) != 0) {
+			assert(false);
+			return NULL;
+		}
+		memset(ptr, 0, n * sizeof(float));
+		return (float*)ptr;
+	}
+
+	void plane_corners(const float* plane, int idx, float* c) const {
+		const int dy = resolution[0], dz = resolution[0] * resolution[1];
+		c[0] = plane[idx];			c[1] = plane[idx+1];
+		c[2] = plane[idx+dy];		c[3] = plane[idx+dy+1];
+		c[4] = plane[idx+dz];		c[5] = plane[idx+dz+1];
+		c[6] = plane[idx+dz+dy];	c[7] = plane[idx+dz+dy+1];
+	}
+
+	void brick_corners(
+		std::vector<float*> const& blocks,
+		float Cell::*field,
+		int i, int j, int k,
+		float* c) const {
+
+		//Common case: all 8 corners in one brick
+		if((i & BRICK_MASK) != BRICK_MASK &&
+		   (j & BRICK_MASK) != BRICK_MASK &&
+		   (k & BRICK_MASK) != BRICK_MASK) {
+			const int b = brick_of(i, j, k);
+			const float* ptr = blocks[b];
+			if(!ptr) {
+				const float u = brick_uniform[b].*field;
+				for(int l=0; l<8; ++l) {
+					c[l] = u;
+				}
+				return;
+			}
+			const int dy = BRICK_SIZE, dz = BRICK_SIZE * BRICK_SIZE;
+			ptr += brick_offset(i, j, k);
+			c[0] = ptr[0];		c[1] = ptr[1];
+			c[2] = ptr[dy];		c[3] = ptr[dy+1];
+			c[4] = ptr[dz];		c[5] = ptr[dz+1];
+			c[6] = ptr[dz+dy];	c[7] = ptr[dz+dy+1];
+			return;
+		}
+
+		for(int l=0; l<8; ++l) {
+			const int x = i + (l&1), y = j + ((l>>1)&1), z = k + (l>>2);
+			const int b = brick_of(x, y, z);
+			const float* ptr = blocks[b];
+			c[l] = ptr ? ptr[brick_offset(x, y, z)] : brick_uniform[b].*field;
+		}
+	}
+
+	int brick_of(int i, int j, int k) const {
+		return (i >> BRICK_SHIFT) + brick_res[0] *
+			((j >> BRICK_SHIFT) + brick_res[1] * (k >> BRICK_SHIFT));
+	}
+	static int brick_offset(int i, int j, int k) {
+		return (i & BRICK_MASK) |
+			((j & BRICK_MASK) << BRICK_SHIFT) |
+			((k & BRICK_MASK) << (2*BRICK_SHIFT));
+	}
+
+	//Calls f(i, j, k, offset) for every cell of a brick inside the grid
+	template<typename F>
+	void for_each_brick_cell(int bi, int bj, int bk, F const& f) const {
+		const int	x0 = bi << BRICK_SHIFT,
+					y0 = bj << BRICK_SHIFT,
+					z0 = bk << BRICK_SHIFT;
+		const int	x1 = std::min(x0 + (int)BRICK_SIZE, resolution[0]),
+					y1 = std::min(y0 + (int)BRICK_SIZE, resolution[1]),
+					z1 = std::min(z0 + (int)BRICK_SIZE, resolution[2]);
+		for(int k=z0; k<z1; ++k)
+		for(int j=y0; j<y1; ++j)
+		for(int i=x0; i<x1; ++i) {
+			f(i, j, k, brick_offset(i, j, k));
+		}
+	}
+
+	//Makes a brick uniform, freeing its samples
+	void set_uniform_brick(int b, Cell const& c) {
+		free(brick_density[b]);
+		free(brick_friction[b]);
+		brick_density[b] = NULL;
+		brick_friction[b] = NULL;
+		brick_uniform[b] = c;
+	}
+
+	//Allocates the samples of a uniform brick
+	void expand_brick(int b) {
+		if(brick_density[b]) {
+			return;
+		}
+		brick_density[b] = alloc_plane(BRICK_CELLS);
+		for(int o=0; o<BRICK_CELLS; ++o) {
+			brick_density[b][o] = brick_uniform[b].density;
+		}
+		if(has_friction) {
+			brick_friction[b] = alloc_plane(BRICK_CELLS);
+			for(int o=0; o<BRICK_CELLS; ++o) {
+				brick_friction[b][o] = brick_uniform[b].friction;
+			}
+		}
+	}
+
+	//Brings back per-cell friction after compact_friction()
+	void expand_friction() {
+		if(has_friction) {
+			return;
+		}
+		has_friction = true;
+		if(density_plane) {
+			friction_plane = alloc_plane(size());
+			for(int i=size()-1; i>=0; --i) {
+				friction_plane[i] = uniform_friction;
+			}
+			return;
+		}
+		for(int b=brick_density.size()-1; b>=0; --b) {
+			brick_uniform[b].friction = uniform_friction;
+			if(brick_density[b]) {
+				brick_friction[b] = alloc_plane(BRICK_CELLS);
+				for(int o=0; o<BRICK_CELLS; ++o) {
+					brick_friction[b][o] = uniform_friction;
+				}
+			}
+		}
+	}
+
+	//Collapses every brick in layer bk which has the same sign as all of its
+	//neighbors.  No edge touching such a brick crosses the surface, so this
+	//does not move the contour.  Samples outside the grid read as negative.
+	void collapse_layer(int bk, std::vector<signed char> const& sign, CollapseMode mode) {
+		Mesh::impl::parallel_for(0, brick_res[0] * brick_res[1], [&](int l) {
+			const int bi = l % brick_res[0], bj = l / brick_res[0];
+			const int b = bi + brick_res[0] * (bj + brick_res[1] * bk);
+			const int s = sign[b];
+			if(s == 0 || !brick_density[b]) {
+				return;
+			}
+			bool uniform = true;
+			for(int dk=-1; dk<=1 && uniform; ++dk)
+			for(int dj=-1; dj<=1 && uniform; ++dj)
+			for(int di=-1; di<=1 && uniform; ++di) {
+				const int	ni = bi + di,
+							nj = bj + dj,
+							nk = bk + dk;
+				if( ni < 0 || ni >= brick_res[0] ||
+					nj < 0 || nj >= brick_res[1] ||
+					nk < 0 || nk >= brick_res[2] ) {
+					uniform = (s < 0);
+				}
+				else {
+					uniform = (sign[ni + brick_res[0] * (nj + brick_res[1] * nk)] == s);
+				}
+			}
+			if(!uniform) {
+				return;
+			}
+
+			const float* d = brick_density[b];
+			const float* f = brick_friction[b];
+			double dsum = 0.0, fsum = 0.0;
+			float dmin = std::abs(d[0]);
+			int n = 0;
+			for_each_brick_cell(bi, bj, bk, [&](int i, int j, int k, int o) {
+				dsum += d[o];
+				dmin = std::min(dmin, std::abs(d[o]));
+				if(f) {
+					fsum += f[o];
+				}
+				++n;
+			});
+			Cell c;
+			c.density = (mode == COLLAPSE_MEAN) ? dsum / n : s * dmin;
+			c.friction = fsum / n;
+			set_uniform_brick(b, c);
+		});
+	}
+
+	//Not copyable
+	VoxelGrid(VoxelGrid const&);
+	VoxelGrid& operator=(VoxelGrid const&);
+};
+
+#endif
+